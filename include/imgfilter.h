@@ -0,0 +1,394 @@
+/*******************************************************************************
+ * libimgfilter - image filter kernels shared by all front-ends
+ *
+ * Images are interleaved 8-bit pixels, row-major, 'ch' bytes per pixel.
+ * Borders are handled by clamping coordinates to the image (clamp-to-edge).
+ *
+ * Every kernel takes an execution backend:
+ *   IMGF_SERIAL   runs on the calling thread
+ *   IMGF_THREADS  splits the work with OpenMP (serial when built without it)
+ ******************************************************************************/
+#ifndef IMGFILTER_H
+#define IMGFILTER_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    IMGF_SERIAL = 0,
+    IMGF_THREADS = 1
+} imgf_backend;
+
+/*******************************************************************************
+ * KERNELS
+ ******************************************************************************/
+
+// Largest accepted kernel size
+#define IMGF_MAX_KSIZE 255
+
+// Normalised ksize x ksize Gaussian kernel (ksize up to IMGF_MAX_KSIZE);
+// imgf_buffer_free() the result, NULL if it cannot be allocated
+double* imgf_build_gaussian(int ksize, double sigma);
+
+// Luma (0.299 R + 0.587 G + 0.114 B) of w*h pixels; imgf_buffer_free() the
+// result, NULL if it cannot be allocated
+unsigned char* imgf_to_grayscale(const unsigned char *img, int w, int h,
+                                 int ch, imgf_backend be);
+
+/*
+ * Band kernels. A band is 'rows' output rows starting at global row 'y0' of
+ * an image 'global_h' rows high. 'extended' holds 'halo' rows above the band,
+ * the band itself and 'halo' rows below it; rows outside the image must
+ * already be filled (e.g. by replicating the edge row). For a whole image
+ * pass the image itself with halo = 0, y0 = 0 and rows = global_h.
+ * Sobel allocates a luma plane and returns 0 if it cannot.
+ */
+void imgf_convolve_band(const unsigned char *extended, unsigned char *out,
+                        int w, int rows, int ch,
+                        const double *kernel, int ksize, int halo,
+                        int y0, int global_h, imgf_backend be);
+
+int imgf_sobel_band(const unsigned char *extended, unsigned char *out,
+                    int w, int rows, int ch, int halo,
+                    int y0, int global_h, imgf_backend be);
+
+// Whole-image convenience wrappers
+void imgf_convolve(const unsigned char *in, unsigned char *out,
+                   int w, int h, int ch, const double *kernel, int ksize,
+                   imgf_backend be);
+
+int imgf_sobel(const unsigned char *in, unsigned char *out,
+               int w, int h, int ch, imgf_backend be);
+
+/*******************************************************************************
+ * FILTER STAGES
+ *
+ * A stage names one filter and its parameters. Chains are written as
+ * comma-separated stages, e.g. "gaussian:5:1.0,sobel".
+ ******************************************************************************/
+#define IMGF_MAX_STAGES 16
+
+typedef struct {
+    char name[16];    // sobel, gaussian, laplacian or sharpen
+    int ksize;
+    double sigma;
+    double *kernel;   // built by imgf_stage_build(); NULL for sobel
+    int halo;         // rows needed above and below a band
+} imgf_stage;
+
+// Sets up a stage from a name and (gaussian only) ksize/sigma; 0 if invalid.
+// A gaussian ksize must be odd and at most IMGF_MAX_KSIZE
+int imgf_stage_init(imgf_stage *st, const char *name, int ksize, double sigma);
+
+// Parses a chain; returns the number of stages, 0 on error
+int imgf_parse_chain(const char *spec, imgf_stage *stages, int max_stages);
+
+// Parses a front-end filter argument: either a chain, or a single filter
+// name followed by its parameters (ksize/sigma strings, NULL if absent).
+// Returns the number of stages, 0 on error
+int imgf_parse_filter(const char *mode, const char *ksize_arg,
+                      const char *sigma_arg, imgf_stage *stages,
+                      int max_stages);
+
+// Builds / frees the convolution kernel of an initialised stage; build
+// returns 0 if the kernel cannot be allocated
+int imgf_stage_build(imgf_stage *st);
+void imgf_stage_free(imgf_stage *st);
+
+// Builds every stage of a chain; 0 if a kernel cannot be allocated, in which
+// case none of them is left built
+int imgf_chain_build(imgf_stage *stages, int nstages);
+
+// Largest halo over a chain
+int imgf_chain_halo(const imgf_stage *stages, int nstages);
+
+// Applies one stage to a band (same buffer contract as the band kernels;
+// 'halo' is the number of rows actually present above/below, >= st->halo).
+// 0 if a scratch buffer cannot be allocated
+int imgf_apply_band(const imgf_stage *st, const unsigned char *extended,
+                    unsigned char *out, int w, int rows, int ch, int halo,
+                    int y0, int global_h, imgf_backend be);
+
+// Applies one stage to a band read in place from 'src_rows' rows 'pitch'
+// bytes apart holding global rows first_row, first_row + 1, ... (e.g. a
+// mapped file). They must cover the band and the st->halo rows around it
+// that exist in the image; 'out' is packed. 0 as for imgf_apply_band
+int imgf_apply_rows(const imgf_stage *st, const unsigned char *src,
+                    size_t pitch, int first_row, int src_rows,
+                    unsigned char *out, int w, int rows, int ch,
+                    int y0, int global_h, imgf_backend be);
+
+// Applies a chain of built stages to a whole image; 0 if a scratch buffer
+// cannot be allocated ('out' is then incomplete)
+int imgf_apply_chain(const imgf_stage *stages, int nstages,
+                     const unsigned char *in, unsigned char *out,
+                     int w, int h, int ch, imgf_backend be);
+
+// Same, for input rows 'pitch' bytes apart (the output is packed)
+int imgf_apply_chain_pitch(const imgf_stage *stages, int nstages,
+                           const unsigned char *in, size_t pitch,
+                           unsigned char *out, int w, int h, int ch,
+                           imgf_backend be);
+
+/*******************************************************************************
+ * OUTPUT NAMES (batch and farm modes)
+ *
+ * Many inputs are written to one output directory as STEM.png, so two
+ * inputs with the same stem (a.png and a.jpg, x/img.png and y/img.png)
+ * would overwrite each other. Front-ends check the whole list first.
+ ******************************************************************************/
+
+// OUTDIR/STEM.png for DIR/STEM.EXT
+void imgf_output_path(char *out, size_t size, const char *outdir,
+                      const char *input);
+
+// -1 if all inputs get distinct output paths; otherwise the index of an
+// input whose path repeats that of input *earlier
+int imgf_output_collision(const char *outdir, const char *const *inputs,
+                          int n, int *earlier);
+
+/*******************************************************************************
+ * SYNTHETIC TEST IMAGES (src/imgsynth.c)
+ *
+ * Deterministic images of any size, so kernels can be measured without
+ * decoding a file. The same arguments give the same bytes on every run and
+ * for any thread count.
+ ******************************************************************************/
+typedef enum {
+    IMGF_PATTERN_NOISE = 0,     // independent random bytes (incompressible)
+    IMGF_PATTERN_GRADIENT = 1,  // smooth ramps
+    IMGF_PATTERN_EDGES = 2,     // checkerboard, ring and line: hard edges
+    IMGF_PATTERN_FRACTAL = 3    // fractal value noise, photograph-like
+} imgf_pattern;
+
+// w*h pixels of 1..4 channels from the buffer pool; release the result with
+// imgf_buffer_free. NULL on bad arguments
+unsigned char* imgf_synthesize(imgf_pattern pattern, int w, int h, int ch,
+                               unsigned int seed, imgf_backend be);
+
+// "noise", "gradient", "edges" or "fractal"; 0 if unknown
+int imgf_pattern_from_name(const char *name, imgf_pattern *pattern);
+
+// Parses "synth:PATTERN:WxH[xCH][:SEED]" (3 channels, seed 1 by default);
+// 0 if 'spec' is not such a string
+int imgf_parse_synth(const char *spec, imgf_pattern *pattern,
+                     int *w, int *h, int *ch, unsigned int *seed);
+
+/*******************************************************************************
+ * HARDWARE PERFORMANCE COUNTERS (src/imgperf.c)
+ *
+ * Linux perf_event_open counters for the calling thread and every thread it
+ * creates after imgf_counters_open(), so open them before the first OpenMP
+ * parallel region. Counts between start/stop pairs accumulate in 'value'.
+ * Elsewhere, or without PMU access, open returns 0 and the rest are no-ops.
+ ******************************************************************************/
+enum {
+    IMGF_CNT_CYCLES = 0,
+    IMGF_CNT_INSTRUCTIONS,
+    IMGF_CNT_BRANCHES,
+    IMGF_CNT_BRANCH_MISSES,
+    IMGF_CNT_L1D_LOADS,
+    IMGF_CNT_L1D_MISSES,
+    IMGF_CNT_LLC_REFS,
+    IMGF_CNT_LLC_MISSES,
+    IMGF_CNT_DTLB_LOADS,
+    IMGF_CNT_DTLB_MISSES,
+    IMGF_NUM_COUNTERS
+};
+
+typedef struct {
+    int enabled;                       // at least one event could be opened
+    int fd[IMGF_NUM_COUNTERS];         // -1 for events the CPU does not have
+    double start[IMGF_NUM_COUNTERS];
+    double value[IMGF_NUM_COUNTERS];   // accumulated, scaled for multiplexing
+} imgf_counters;
+
+typedef struct {
+    double ipc;                    // instructions per cycle
+    double l1_miss_rate;           // L1d read misses / L1d reads
+    double llc_miss_rate;          // LLC misses / LLC references
+    double branch_miss_rate;       // branch misses / branches
+    double dtlb_miss_rate;         // dTLB read misses / dTLB reads
+    double dram_bytes_per_pixel;   // LLC misses * 64 / pixels
+} imgf_counter_summary;          // -1 where the events are missing
+
+// Returns the number of events opened (0: counters unavailable)
+int imgf_counters_open(imgf_counters *pc);
+void imgf_counters_start(imgf_counters *pc);
+void imgf_counters_stop(imgf_counters *pc);
+void imgf_counters_reset(imgf_counters *pc);
+void imgf_counters_close(imgf_counters *pc);
+int imgf_counter_available(const imgf_counters *pc, int counter);
+
+void imgf_counters_summary(const imgf_counters *pc, double pixels,
+                           imgf_counter_summary *sum);
+
+// Two lines: derived metrics, then the raw counts
+void imgf_counters_print(FILE *fp, const char *label, const imgf_counters *pc,
+                         double pixels);
+
+/*******************************************************************************
+ * THROUGHPUT AND ROOFLINE (src/imgroof.c)
+ *
+ * FLOP and compulsory bytes per output pixel of a chain, machine peaks from a
+ * STREAM-triad and a multiply-add microbenchmark, and report lines that set
+ * a measured filter time against them.
+ ******************************************************************************/
+typedef struct {
+    double flops;       // double-precision FLOP/s
+    double bandwidth;   // bytes/s (STREAM triad)
+    int threads;        // threads the peaks were measured with
+} imgf_machine_peaks;
+
+double imgf_chain_flops_per_pixel(const imgf_stage *stages, int nstages, int ch);
+double imgf_chain_bytes_per_pixel(const imgf_stage *stages, int nstages, int ch);
+
+// Takes about half a second; IMGF_THREADS measures with all OpenMP threads
+void imgf_measure_peaks(imgf_machine_peaks *pk, imgf_backend be);
+
+// "label: MPixels/s, GFLOP/s, GB/s" for 'pixels' filtered in 'seconds'
+void imgf_throughput_print(FILE *fp, const char *label,
+                           const imgf_stage *stages, int nstages,
+                           double pixels, int ch, double seconds);
+
+// Achieved FLOP/s over min(compute peak, intensity * bandwidth); -1 if unknown
+double imgf_roof_fraction(const imgf_stage *stages, int nstages,
+                          double pixels, int ch, double seconds,
+                          const imgf_machine_peaks *pk);
+
+// Peaks, arithmetic intensity, bound and the fraction of the roof achieved
+void imgf_roofline_print(FILE *fp, const char *label,
+                         const imgf_stage *stages, int nstages,
+                         double pixels, int ch, double seconds,
+                         const imgf_machine_peaks *pk);
+
+/*******************************************************************************
+ * TIMELINE TRACING (src/imgtrace.c)
+ *
+ * Begin/end spans per thread, written as Chrome trace event JSON (open in
+ * Perfetto or chrome://tracing). Recording goes to a per-thread ring buffer
+ * without locks; until imgf_trace_start() begin/end only test a flag.
+ * The kernels record one span per thread and band.
+ ******************************************************************************/
+
+// Starts recording; timestamps count from here. 'pid' and 'name' label this
+// process in the trace (e.g. the MPI rank)
+void imgf_trace_start(int pid, const char *name);
+int imgf_trace_active(void);
+
+// 'name' is stored, not copied: pass a string literal
+void imgf_trace_begin(const char *name);
+void imgf_trace_end(void);
+
+// This process's events as comma-separated JSON objects; free() the result.
+// Call it while no other thread is recording
+char* imgf_trace_events(size_t *len);
+
+// Writes a trace file around 'events' (possibly joined from several processes)
+int imgf_trace_write_events(const char *path, const char *events);
+
+// Writes a trace file with this process's events
+int imgf_trace_write(const char *path);
+
+/*******************************************************************************
+ * BUFFER POOL (src/imgpool.c)
+ *
+ * Image and scratch buffers in size classes (four per power of two). A freed
+ * buffer is kept for the next request of its class, so repeated images and
+ * frames reuse memory instead of paying for malloc and fresh page faults
+ * each time, up to 256 MiB of cached buffers. Thread-safe. Buffers must be
+ * released with imgf_buffer_free().
+ *
+ * Blocks of 2 MiB and more can be backed by huge pages, so a large image
+ * needs one TLB entry per 2 MiB instead of one per 4 KiB (Linux; elsewhere
+ * they fall back to malloc).
+ ******************************************************************************/
+typedef enum {
+    IMGF_PAGES_DEFAULT = 0,   // malloc
+    IMGF_PAGES_THP = 1,       // 2 MiB aligned mmap + madvise(MADV_HUGEPAGE)
+    IMGF_PAGES_HUGETLB = 2    // MAP_HUGETLB (reserved hugetlbfs pages); THP if none are free
+} imgf_page_mode;
+
+typedef struct {
+    unsigned long requests;    // imgf_buffer_alloc() calls
+    unsigned long reused;      // served from the pool: allocations avoided
+    unsigned long allocated;   // new blocks from the system
+    unsigned long huge;        // of those, mapped for huge pages
+    size_t cached_bytes;       // held by the pool now
+    size_t peak_bytes;         // most bytes in use and cached at once
+} imgf_pool_stats;
+
+void* imgf_buffer_alloc(size_t bytes);
+void imgf_buffer_free(void *p);
+
+// Keeps the contents up to the smaller size; realloc() semantics for NULL
+void* imgf_buffer_realloc(void *p, size_t bytes);
+
+// Backing for blocks allocated from now on
+void imgf_pool_pages(imgf_page_mode mode);
+
+// "thp" or "hugetlb" ("" and "default" give IMGF_PAGES_DEFAULT); 0 if unknown
+int imgf_page_mode_from_name(const char *name, imgf_page_mode *mode);
+
+// Touch every page of newly allocated blocks before returning them
+void imgf_pool_prefault(int enable);
+
+// Returns the cached blocks to the system
+void imgf_pool_trim(void);
+
+void imgf_pool_get_stats(imgf_pool_stats *st);
+
+// "label: requests, reused (allocations avoided), allocated, peak", and
+// with huge pages how many blocks were mapped for them and how much of the
+// process is on transparent huge pages
+void imgf_pool_print(FILE *fp, const char *label);
+
+/*******************************************************************************
+ * RAW IMAGE FILES (src/imgraw.c)
+ *
+ * An uncompressed container the tools map instead of decoding (.imgf): a
+ * 4 KiB header, then the pixels with every row padded to a multiple of
+ * IMGF_RAW_ALIGN bytes. Optionally the pixels are stored in square tiles,
+ * tile rows top to bottom, tiles left to right, each tile's rows padded the
+ * same way. Mapping is read-only and copies nothing for row-ordered files,
+ * so the filters read straight from the page cache; a range of rows can be
+ * mapped on its own (an MPI rank's band). Elsewhere than POSIX the range is
+ * read into a pool buffer instead.
+ ******************************************************************************/
+#define IMGF_RAW_ALIGN 64
+
+typedef struct {
+    int w, h, ch;
+    int tile;                     // tile edge in pixels, 0: rows in order
+    size_t pitch;                 // bytes from one stored row to the next
+    int first_row, rows;          // the mapped range of image rows
+    const unsigned char *pixels;  // first stored row of the range
+    unsigned char *untiled;       // packed copy of a tiled range, or NULL
+    void *map;                    // whole mapping (or buffer)
+    size_t map_bytes;
+} imgf_raw;
+
+// Size and channels from the header; 0 if 'path' is not a raw image
+int imgf_raw_info(const char *path, int *w, int *h, int *ch);
+
+// Writes w*h packed pixels; tile 0 stores rows in order. 0 on error
+int imgf_raw_write(const char *path, const unsigned char *pixels,
+                   int w, int h, int ch, int tile);
+
+// Maps rows y0 .. y0 + rows - 1 (clipped to the image; rows < 0: all of
+// them) read-only. 0 if the file is not a raw image or cannot be mapped
+int imgf_raw_map(const char *path, int y0, int rows, imgf_raw *img);
+void imgf_raw_unmap(imgf_raw *img);
+
+// The mapped range as rows '*pitch' bytes apart, first_row first: the
+// mapping itself, or for tiled files a packed copy made on the first call
+const unsigned char* imgf_raw_rows(imgf_raw *img, size_t *pitch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
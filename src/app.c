@@ -1,6 +1,21 @@
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include "imgfilter.h"
+
+// Decoded and synthetic images both come from the libimgfilter pool, so
+// either kind is released with imgf_buffer_free
+#define STBI_MALLOC(sz) imgf_buffer_alloc(sz)
+#define STBI_REALLOC(p, newsz) imgf_buffer_realloc(p, newsz)
+#define STBI_FREE(p) imgf_buffer_free(p)
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+#include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #ifdef _WIN32
     #include <windows.h>
@@ -27,9 +42,24 @@ const char *filters[NUM_FILTERS] = {
 
 const char *images[NUM_IMAGES] = {
     "../input_images/input1.png",
-    "../input_images/input2_8k.png"
+    "synth:fractal:7680x4320"   // 8K, generated in memory
 };
 
+/* ============================================================
+ * BENCHMARK SETTINGS
+ * ============================================================ */
+typedef struct {
+    int warmup;      // untimed runs before measuring
+    int reps;        // timed runs per measurement
+    int threads;     // OpenMP threads for the parallel backend
+    int ranks;       // MPI ranks for mpi_filter, 0 to skip it
+    const char *json_path;   // machine-readable results, NULL for none
+    const char *csv_path;
+    imgf_counters *counters;   // hardware counters, NULL when not requested
+    const imgf_machine_peaks *serial_peaks;   // roofline peaks, NULL when not
+    const imgf_machine_peaks *thread_peaks;   // requested (--roofline)
+} bench_config;
+
 /* ============================================================
  * WALL-CLOCK TIMER (FIXED CORE FUNCTION)
  * ============================================================ */
@@ -56,30 +86,1075 @@ double now_seconds() {
 #endif
 
 /* ============================================================
- * COMMAND EXECUTION
+ * STATISTICS OVER REPETITIONS
+ * ============================================================ */
+typedef struct {
+    int n;
+    double median;
+    double p95;
+    double mean;
+    double stddev;   // sample standard deviation
+    double min;
+} bench_stats;
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts 'samples' in place
+void compute_stats(double *samples, int n, bench_stats *st) {
+    memset(st, 0, sizeof(*st));
+    st->n = n;
+    if (n <= 0) return;
+
+    qsort(samples, n, sizeof(double), compare_doubles);
+
+    st->min = samples[0];
+    st->median = (n % 2) ? samples[n / 2]
+                         : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+
+    // Nearest-rank percentile
+    int rank95 = (int)ceil(0.95 * n) - 1;
+    if (rank95 < 0) rank95 = 0;
+    st->p95 = samples[rank95];
+
+    for (int i = 0; i < n; i++) st->mean += samples[i];
+    st->mean /= n;
+
+    if (n > 1) {
+        double ss = 0.0;
+        for (int i = 0; i < n; i++)
+            ss += (samples[i] - st->mean) * (samples[i] - st->mean);
+        st->stddev = sqrt(ss / (n - 1));
+    }
+}
+
+/* ============================================================
+ * RESULT RECORDS
+ *
+ * One record per measured phase of one configuration. 'bytes' is the
+ * pixel data the phase reads plus writes, used for GB/s.
+ * ============================================================ */
+typedef struct {
+    char image[256];
+    int width, height, channels;
+    char filter[16];
+    char params[32];
+    char backend[16];   // stb, serial, openmp or mpi
+    int threads;
+    int ranks;
+    char phase[16];     // decode, filter, encode, compute or total
+    bench_stats st;
+    double mpix_per_s;
+    double gb_per_s;
+    double gflop_per_s;
+    double roof_fraction;   // of the attainable roofline, -1 when not measured
+    double *samples;    // st.n timed samples, sorted
+    int has_counters;
+    imgf_counter_summary counters;
+} bench_record;
+
+typedef struct {
+    bench_record *items;
+    int count;
+    int capacity;
+} record_list;
+
+// Computes the statistics of 'samples' (sorted in place) and appends a record
+bench_record* add_record(record_list *list, const char *image, int w, int h, int ch,
+                         const char *filter, const char *params, const char *backend,
+                         int threads, int ranks, const char *phase,
+                         double *samples, int n, double bytes, double flops) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 64;
+        list->items = realloc(list->items, list->capacity * sizeof(bench_record));
+    }
+
+    bench_record *r = &list->items[list->count++];
+    memset(r, 0, sizeof(*r));
+    r->roof_fraction = -1.0;
+    snprintf(r->image, sizeof(r->image), "%s", image);
+    r->width = w;
+    r->height = h;
+    r->channels = ch;
+    snprintf(r->filter, sizeof(r->filter), "%s", filter);
+    snprintf(r->params, sizeof(r->params), "%s", params);
+    snprintf(r->backend, sizeof(r->backend), "%s", backend);
+    r->threads = threads;
+    r->ranks = ranks;
+    snprintf(r->phase, sizeof(r->phase), "%s", phase);
+
+    compute_stats(samples, n, &r->st);
+    r->samples = malloc((n > 0 ? n : 1) * sizeof(double));
+    memcpy(r->samples, samples, n * sizeof(double));
+
+    if (r->st.median > 0.0) {
+        r->mpix_per_s = (double)w * h / 1e6 / r->st.median;
+        r->gb_per_s = bytes / 1e9 / r->st.median;
+        r->gflop_per_s = flops / 1e9 / r->st.median;
+    }
+    return r;
+}
+
+void free_records(record_list *list) {
+    for (int i = 0; i < list->count; i++) free(list->items[i].samples);
+    free(list->items);
+    list->items = NULL;
+    list->count = list->capacity = 0;
+}
+
+void print_record(FILE *fp, const char *label, const bench_record *r) {
+    fprintf(fp, "%s: median %.6f s, p95 %.6f s, stddev %.6f s (n=%d), "
+            "%.2f MP/s, %.3f GB/s", label, r->st.median, r->st.p95,
+            r->st.stddev, r->st.n, r->mpix_per_s, r->gb_per_s);
+    if (r->gflop_per_s > 0.0) fprintf(fp, ", %.3f GFLOP/s", r->gflop_per_s);
+    fprintf(fp, "\n");
+}
+
+static void json_write_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+        else if (c < 0x20) fprintf(fp, "\\u%04x", c);
+        else fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+// Writes one record per line so that --compare can read the file back
+int write_json(const char *path, const record_list *list, const bench_config *cfg) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return 0;
+
+    fprintf(fp, "{\n  \"config\": {\"warmup\": %d, \"reps\": %d, \"threads\": %d, "
+            "\"ranks\": %d},\n  \"records\": [\n",
+            cfg->warmup, cfg->reps, cfg->threads, cfg->ranks);
+
+    for (int i = 0; i < list->count; i++) {
+        const bench_record *r = &list->items[i];
+        fprintf(fp, "    {\"image\": ");
+        json_write_string(fp, r->image);
+        fprintf(fp, ", \"width\": %d, \"height\": %d, \"channels\": %d, \"filter\": ",
+                r->width, r->height, r->channels);
+        json_write_string(fp, r->filter);
+        fprintf(fp, ", \"params\": ");
+        json_write_string(fp, r->params);
+        fprintf(fp, ", \"backend\": ");
+        json_write_string(fp, r->backend);
+        fprintf(fp, ", \"threads\": %d, \"ranks\": %d, \"phase\": ", r->threads, r->ranks);
+        json_write_string(fp, r->phase);
+        fprintf(fp, ", \"n\": %d, \"median\": %.9f, \"p95\": %.9f, \"mean\": %.9f, "
+                "\"stddev\": %.9f, \"min\": %.9f, \"mpix_per_s\": %.4f, "
+                "\"gb_per_s\": %.6f, \"gflop_per_s\": %.6f, \"samples\": [",
+                r->st.n, r->st.median, r->st.p95, r->st.mean, r->st.stddev,
+                r->st.min, r->mpix_per_s, r->gb_per_s, r->gflop_per_s);
+        for (int k = 0; k < r->st.n; k++)
+            fprintf(fp, "%s%.9f", k ? ", " : "", r->samples[k]);
+        fprintf(fp, "]");
+        if (r->roof_fraction >= 0.0)
+            fprintf(fp, ", \"roof_fraction\": %.4f", r->roof_fraction);
+        if (r->has_counters) {
+            // -1 marks events the CPU does not provide
+            fprintf(fp, ", \"counters\": {\"ipc\": %.4f, \"l1_miss_rate\": %.6f, "
+                    "\"llc_miss_rate\": %.6f, \"branch_miss_rate\": %.6f, "
+                    "\"dtlb_miss_rate\": %.6f, \"dram_bytes_per_pixel\": %.4f}",
+                    r->counters.ipc, r->counters.l1_miss_rate, r->counters.llc_miss_rate,
+                    r->counters.branch_miss_rate, r->counters.dtlb_miss_rate,
+                    r->counters.dram_bytes_per_pixel);
+        }
+        fprintf(fp, "}%s\n", i + 1 < list->count ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    return 1;
+}
+
+int write_csv(const char *path, const record_list *list) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return 0;
+
+    fprintf(fp, "image,width,height,channels,filter,params,backend,threads,ranks,"
+            "phase,n,median_s,p95_s,mean_s,stddev_s,min_s,mpix_per_s,gb_per_s,gflop_per_s,samples\n");
+
+    for (int i = 0; i < list->count; i++) {
+        const bench_record *r = &list->items[i];
+        fprintf(fp, "\"%s\",%d,%d,%d,%s,\"%s\",%s,%d,%d,%s,%d,"
+                "%.9f,%.9f,%.9f,%.9f,%.9f,%.4f,%.6f,%.6f,\"",
+                r->image, r->width, r->height, r->channels, r->filter, r->params,
+                r->backend, r->threads, r->ranks, r->phase, r->st.n,
+                r->st.median, r->st.p95, r->st.mean, r->st.stddev, r->st.min,
+                r->mpix_per_s, r->gb_per_s, r->gflop_per_s);
+        for (int k = 0; k < r->st.n; k++)
+            fprintf(fp, "%s%.9f", k ? ";" : "", r->samples[k]);
+        fprintf(fp, "\"\n");
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+/* ============================================================
+ * FILE HELPERS
  * ============================================================ */
-void run_command(const char *cmd) {
-    printf("Running: %s\n", cmd);
-    int ret = system(cmd);
-    if (ret != 0) {
-        fprintf(stderr, "Command failed: %s\n", cmd);
+char* read_text_file(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (len < 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    char *text = malloc(len + 1);
+    if (!text) {
+        fclose(fp);
+        return NULL;
     }
+    size_t got = fread(text, 1, len, fp);
+    text[got] = '\0';
+    fclose(fp);
+    return text;
+}
+
+int write_ppm(const char *path, const unsigned char *img, int w, int h) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return 0;
+    fprintf(fp, "P6\n%d %d\n255\n", w, h);
+    size_t bytes = (size_t)w * h * 3;
+    int ok = fwrite(img, 1, bytes, fp) == bytes;
+    fclose(fp);
+    return ok;
 }
 
 /* ============================================================
- * TIMED EXECUTION (FIXED CORE FUNCTION)
+ * REGRESSION COMPARISON
+ *
+ * Matches the records of two JSON files written by --json on
+ * (image, resolution, filter, params, backend, threads, ranks, phase)
+ * and tests whether the new samples are slower with a one-sided
+ * Mann-Whitney U test (normal approximation with tie correction).
+ * A record is a regression when its median got worse by more than the
+ * threshold and the test is significant at 'alpha'.
  * ============================================================ */
-double time_command(const char *cmd) {
-    double start = now_seconds();
-    run_command(cmd);
-    double end = now_seconds();
-    return end - start;
+
+// Copies the string value of "key" into 'out'; 0 if absent
+static int json_get_string(const char *line, const char *key, char *out, size_t len) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+    const char *p = strstr(line, pattern);
+    if (!p || len == 0) return 0;
+    p += strlen(pattern);
+
+    size_t n = 0;
+    while (*p && *p != '"') {
+        char c = *p++;
+        if (c == '\\' && *p) {
+            c = *p++;
+            if (c == 'u') {   // only control characters are written as \u
+                char hex[5] = {0};
+                strncpy(hex, p, 4);
+                c = (char)strtol(hex, NULL, 16);
+                p += strlen(hex);
+            }
+        }
+        if (n + 1 < len) out[n++] = c;
+    }
+    out[n] = '\0';
+    return 1;
+}
+
+static double json_get_number(const char *line, const char *key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char *p = strstr(line, pattern);
+    return p ? atof(p + strlen(pattern)) : 0.0;
+}
+
+// Reads the records written by write_json(); returns 0 if unreadable
+int read_json(const char *path, record_list *list) {
+    char *text = read_text_file(path);
+    if (!text) return 0;
+
+    char *line = text;
+    while (line && *line) {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+
+        bench_record r;
+        memset(&r, 0, sizeof(r));
+        if (json_get_string(line, "phase", r.phase, sizeof(r.phase))) {
+            json_get_string(line, "image", r.image, sizeof(r.image));
+            json_get_string(line, "filter", r.filter, sizeof(r.filter));
+            json_get_string(line, "params", r.params, sizeof(r.params));
+            json_get_string(line, "backend", r.backend, sizeof(r.backend));
+            r.width = (int)json_get_number(line, "width");
+            r.height = (int)json_get_number(line, "height");
+            r.channels = (int)json_get_number(line, "channels");
+            r.threads = (int)json_get_number(line, "threads");
+            r.ranks = (int)json_get_number(line, "ranks");
+
+            int n = (int)json_get_number(line, "n");
+            double *samples = malloc((n > 0 ? n : 1) * sizeof(double));
+            const char *p = strstr(line, "\"samples\": [");
+            int got = 0;
+            if (p) {
+                p += strlen("\"samples\": [");
+                while (got < n && *p && *p != ']') {
+                    char *end;
+                    samples[got] = strtod(p, &end);
+                    if (end == p) break;
+                    got++;
+                    p = end;
+                    while (*p == ',' || *p == ' ') p++;
+                }
+            }
+
+            add_record(list, r.image, r.width, r.height, r.channels, r.filter,
+                       r.params, r.backend, r.threads, r.ranks, r.phase,
+                       samples, got, 0.0, 0.0);
+            list->items[list->count - 1].mpix_per_s = json_get_number(line, "mpix_per_s");
+            list->items[list->count - 1].gb_per_s = json_get_number(line, "gb_per_s");
+            list->items[list->count - 1].gflop_per_s = json_get_number(line, "gflop_per_s");
+            free(samples);
+        }
+        line = next;
+    }
+
+    free(text);
+    return 1;
+}
+
+static int same_config(const bench_record *a, const bench_record *b) {
+    return strcmp(a->image, b->image) == 0 && a->width == b->width &&
+           a->height == b->height && strcmp(a->filter, b->filter) == 0 &&
+           strcmp(a->params, b->params) == 0 && strcmp(a->backend, b->backend) == 0 &&
+           a->threads == b->threads && a->ranks == b->ranks &&
+           strcmp(a->phase, b->phase) == 0;
+}
+
+// One-sided p-value that 'b' tends to be larger than 'a' (b slower than a)
+double mann_whitney_p(const double *a, int na, const double *b, int nb) {
+    int n = na + nb;
+    double *v = malloc(n * sizeof(double));
+    int *from_b = malloc(n * sizeof(int));
+    double *rank = malloc(n * sizeof(double));
+
+    for (int i = 0; i < na; i++) { v[i] = a[i]; from_b[i] = 0; }
+    for (int i = 0; i < nb; i++) { v[na + i] = b[i]; from_b[na + i] = 1; }
+
+    // Insertion sort keeps the origin flags with the values
+    for (int i = 1; i < n; i++) {
+        double x = v[i];
+        int f = from_b[i];
+        int j = i - 1;
+        while (j >= 0 && v[j] > x) {
+            v[j + 1] = v[j];
+            from_b[j + 1] = from_b[j];
+            j--;
+        }
+        v[j + 1] = x;
+        from_b[j + 1] = f;
+    }
+
+    // Average ranks over ties
+    double tie_sum = 0.0;
+    for (int i = 0; i < n; ) {
+        int j = i;
+        while (j + 1 < n && v[j + 1] == v[i]) j++;
+        double t = j - i + 1;
+        for (int k = i; k <= j; k++) rank[k] = 0.5 * (i + j) + 1.0;
+        tie_sum += t * t * t - t;
+        i = j + 1;
+    }
+
+    double rank_b = 0.0;
+    for (int i = 0; i < n; i++)
+        if (from_b[i]) rank_b += rank[i];
+
+    double u = rank_b - nb * (nb + 1) / 2.0;
+    double mean = na * nb / 2.0;
+    double var = na * nb / 12.0 * ((n + 1) - tie_sum / ((double)n * (n - 1)));
+
+    free(v);
+    free(from_b);
+    free(rank);
+
+    if (var <= 0.0) return 1.0;
+    double z = (u - mean - 0.5) / sqrt(var);   // continuity correction
+    return 0.5 * erfc(z / sqrt(2.0));
+}
+
+// Returns the number of regressions, or -1 if a file cannot be read
+int compare_results(const char *base_path, const char *new_path,
+                    double threshold_pct, double alpha) {
+    record_list base = {0}, cur = {0};
+
+    if (!read_json(base_path, &base) || !read_json(new_path, &cur)) {
+        fprintf(stderr, "Could not read %s or %s\n", base_path, new_path);
+        free_records(&base);
+        free_records(&cur);
+        return -1;
+    }
+
+    int regressions = 0, improvements = 0, matched = 0;
+
+    printf("Comparing %s (base) with %s (new): threshold %.1f%%, alpha %.3f\n\n",
+           base_path, new_path, threshold_pct, alpha);
+    printf("%-28s %-10s %-7s %4s %4s %-8s %12s %12s %8s %8s  %s\n",
+           "image", "filter", "backend", "thr", "rnk", "phase",
+           "base (s)", "new (s)", "change", "p", "verdict");
+
+    for (int i = 0; i < cur.count; i++) {
+        const bench_record *n = &cur.items[i];
+        const bench_record *b = NULL;
+        for (int j = 0; j < base.count && !b; j++)
+            if (same_config(&base.items[j], n)) b = &base.items[j];
+
+        const char *image = strrchr(n->image, '/');
+        image = image ? image + 1 : n->image;
+
+        if (!b) {
+            printf("%-28.28s %-10s %-7s %4d %4d %-8s %12s %12.6f %8s %8s  new\n",
+                   image, n->filter, n->backend, n->threads, n->ranks, n->phase,
+                   "-", n->st.median, "-", "-");
+            continue;
+        }
+        matched++;
+
+        double change = b->st.median > 0.0
+                      ? 100.0 * (n->st.median - b->st.median) / b->st.median : 0.0;
+        const char *verdict = "ok";
+        double p = 1.0;
+
+        if (b->st.n < 2 || n->st.n < 2) {
+            verdict = "too few samples";
+        }
+        else if (change > threshold_pct) {
+            p = mann_whitney_p(b->samples, b->st.n, n->samples, n->st.n);
+            if (p < alpha) { verdict = "REGRESSION"; regressions++; }
+            else verdict = "slower (not significant)";
+        }
+        else if (change < -threshold_pct) {
+            p = mann_whitney_p(n->samples, n->st.n, b->samples, b->st.n);
+            if (p < alpha) { verdict = "improved"; improvements++; }
+            else verdict = "faster (not significant)";
+        }
+
+        printf("%-28.28s %-10s %-7s %4d %4d %-8s %12.6f %12.6f %+7.1f%% %8.4f  %s\n",
+               image, n->filter, n->backend, n->threads, n->ranks, n->phase,
+               b->st.median, n->st.median, change, p, verdict);
+    }
+
+    printf("\n%d matched record(s): %d regression(s), %d improvement(s)\n",
+           matched, regressions, improvements);
+    if (base.count > matched)
+        printf("%d base record(s) have no counterpart in the new file\n",
+               base.count - matched);
+
+    free_records(&base);
+    free_records(&cur);
+    return regressions;
+}
+
+/* ============================================================
+ * IN-PROCESS PHASES
+ *
+ * Each function fills 'samples' with cfg->reps timings taken after
+ * cfg->warmup untimed runs.
+ * ============================================================ */
+
+// Decodes the image warmup + reps times and returns the last decode
+unsigned char* bench_decode(const char *path, const bench_config *cfg,
+                            int *w, int *h, int *ch, double *samples) {
+    unsigned char *img = NULL;
+
+    for (int i = 0; i < cfg->warmup + cfg->reps; i++) {
+        stbi_image_free(img);
+
+        double start = now_seconds();
+        img = stbi_load(path, w, h, ch, 3);
+        double end = now_seconds();
+
+        if (!img) break;
+        if (i >= cfg->warmup) samples[i - cfg->warmup] = end - start;
+    }
+
+    *ch = 3;
+    return img;
+}
+
+// Decodes an image file, or generates a "synth:..." image without timing a
+// decode. *decoded tells which one happened
+unsigned char* bench_load(const char *spec, const bench_config *cfg,
+                          int *w, int *h, int *ch, double *samples, int *decoded) {
+    imgf_pattern pattern;
+    unsigned int seed;
+
+    if (imgf_parse_synth(spec, &pattern, w, h, ch, &seed)) {
+        *decoded = 0;
+        return imgf_synthesize(pattern, *w, *h, *ch, seed, IMGF_THREADS);
+    }
+
+    *decoded = 1;
+    return bench_decode(spec, cfg, w, h, ch, samples);
+}
+
+// mpi_filter reads files: synthetic RGB images are handed over as a PPM.
+// Returns the path to pass to mpi_filter, NULL if it cannot take the image
+const char* mpi_input_path(const char *spec, int decoded, const unsigned char *img,
+                           int w, int h, int ch) {
+    const char *synth_input = "../output/distributed/synth_input.ppm";
+
+    if (decoded) return spec;
+    if (ch != 3) return NULL;   // mpi_filter always works on RGB
+    return write_ppm(synth_input, img, w, h) ? synth_input : NULL;
+}
+
+// Runs one filter on a decoded image; the plan (kernel) is built once.
+// Hardware counters, when enabled, cover the timed runs only
+void bench_filter(const imgf_stage *stage, const unsigned char *img,
+                  unsigned char *out, int w, int h, int ch,
+                  imgf_backend be, const bench_config *cfg, double *samples) {
+    if (cfg->counters) imgf_counters_reset(cfg->counters);
+
+    for (int i = 0; i < cfg->warmup + cfg->reps; i++) {
+        int timed = i >= cfg->warmup;
+        if (timed && cfg->counters) imgf_counters_start(cfg->counters);
+
+        double start = now_seconds();
+        imgf_apply_chain(stage, 1, img, out, w, h, ch, be);
+        double end = now_seconds();
+
+        if (timed && cfg->counters) imgf_counters_stop(cfg->counters);
+        if (timed) samples[i - cfg->warmup] = end - start;
+    }
+}
+
+// Adds the counters of the last bench_filter() call to a record and the report
+void report_counters(FILE *report, const char *label, const bench_config *cfg,
+                     bench_record *r) {
+    if (!cfg->counters) return;
+
+    double pixels = (double)r->width * r->height * cfg->reps;
+    imgf_counters_summary(cfg->counters, pixels, &r->counters);
+    r->has_counters = 1;
+    imgf_counters_print(report, label, cfg->counters, pixels);
+}
+
+// Sets a filter record against the machine peaks of its backend (--roofline)
+void report_roofline(FILE *report, const char *label, const imgf_stage *stage,
+                     const imgf_machine_peaks *peaks, bench_record *r) {
+    if (!peaks) return;
+
+    double pixels = (double)r->width * r->height;
+    r->roof_fraction = imgf_roof_fraction(stage, 1, pixels, r->channels,
+                                          r->st.median, peaks);
+    imgf_roofline_print(report, label, stage, 1, pixels, r->channels,
+                        r->st.median, peaks);
+}
+
+// PNG encode into a byte counter, so disk writes stay out of the timing
+static void count_bytes(void *context, void *data, int size) {
+    (void)data;
+    *(size_t*)context += size;
+}
+
+void bench_encode(const unsigned char *out, int w, int h, int ch,
+                  const bench_config *cfg, double *samples) {
+    for (int i = 0; i < cfg->warmup + cfg->reps; i++) {
+        size_t bytes = 0;
+
+        double start = now_seconds();
+        stbi_write_png_to_func(count_bytes, &bytes, w, h, ch, out, w * ch);
+        double end = now_seconds();
+
+        if (i >= cfg->warmup) samples[i - cfg->warmup] = end - start;
+    }
+}
+
+/* ============================================================
+ * DISTRIBUTED RUNS (mpi_filter is a separate MPI program)
+ *
+ * mpi_filter reports its own per-phase times with --timing-json,
+ * so the launcher and process startup are not part of the numbers.
+ * ============================================================ */
+
+// Value of 'field' in the phase object named 'phase', -1 if not found
+double json_phase_value(const char *text, const char *phase, const char *field) {
+    char key[64];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", phase);
+    const char *p = strstr(text, key);
+    if (!p) return -1.0;
+
+    snprintf(key, sizeof(key), "\"%s\": ", field);
+    p = strstr(p, key);
+    if (!p) return -1.0;
+    return atof(p + strlen(key));
+}
+
+// Fills the compute (slowest rank) and total samples; 0 when mpi_filter failed
+int bench_distributed(const char *img, const char *out_path, const char *filter,
+                      const char *params, const bench_config *cfg,
+                      double *compute, double *total) {
+    const char *json_path = "../output/distributed/timing.json";
+    size_t len = strlen(out_path);
+    // mpi_filter only writes .ppm when it streams the output
+    const char *write_mode = (len > 4 && strcmp(out_path + len - 4, ".ppm") == 0)
+                           ? "--write=stream" : "";
+    char cmd[1024];
+
+#ifdef _WIN32
+    snprintf(cmd, sizeof(cmd),
+             "mpiexec -n %d mpi_filter%s %s %s %s %s %s --timing-json=%s >nul",
+             cfg->ranks, EXE_SUFFIX, img, out_path, filter, params, write_mode,
+             json_path);
+#else
+    snprintf(cmd, sizeof(cmd),
+             "mpirun -np %d ./mpi_filter%s %s %s %s %s %s --timing-json=%s >/dev/null",
+             cfg->ranks, EXE_SUFFIX, img, out_path, filter, params, write_mode,
+             json_path);
+#endif
+
+    for (int i = 0; i < cfg->warmup + cfg->reps; i++) {
+        remove(json_path);
+        if (system(cmd) != 0) {
+            fprintf(stderr, "Command failed: %s\n", cmd);
+            return 0;
+        }
+
+        char *text = read_text_file(json_path);
+        if (!text) return 0;
+
+        if (i >= cfg->warmup) {
+            // Compute is local work, so the slowest rank sets its cost
+            compute[i - cfg->warmup] = json_phase_value(text, "compute", "max");
+            total[i - cfg->warmup] = json_get_number(text, "total_seconds");
+        }
+        free(text);
+    }
+
+    return 1;
+}
+
+/* ============================================================
+ * STANDARD BENCHMARK OF ONE IMAGE
+ * ============================================================ */
+void bench_image(const char *img_path, const char *img_tag, const bench_config *cfg,
+                 record_list *results, FILE *report,
+                 double *samples, double *samples2) {
+    int w, h, ch, decoded;
+    unsigned char *img = bench_load(img_path, cfg, &w, &h, &ch, samples, &decoded);
+    if (!img) {
+        printf("Skipping %s: could not load image.\n", img_path);
+        fprintf(report, "Image: %s (could not load, skipped)\n\n", img_path);
+        return;
+    }
+
+    double pixel_bytes = (double)w * h * ch;
+    bench_record *r;
+
+    fprintf(report, "Image: %s (%dx%d, %d channels)\n", img_path, w, h, ch);
+    if (decoded) {
+        r = add_record(results, img_path, w, h, ch, "-", "", "stb", 1, 1, "decode",
+                       samples, cfg->reps, pixel_bytes, 0.0);
+        print_record(report, "Decode", r);
+    }
+    else {
+        fprintf(report, "Synthetic image: generated in memory, no decode\n");
+    }
+    fprintf(report, "\n");
+
+    const char *mpi_input = cfg->ranks > 0
+                          ? mpi_input_path(img_path, decoded, img, w, h, ch) : NULL;
+    if (cfg->ranks > 0 && !mpi_input)
+        fprintf(report, "Distributed: skipped, mpi_filter only takes RGB images\n\n");
+
+    unsigned char *out = malloc((size_t)w * h * ch);
+    if (!out) {
+        printf("Skipping %s: cannot allocate the output image.\n", img_path);
+        fprintf(report, "Cannot allocate the output image, skipped\n\n");
+        if (mpi_input && !decoded) remove(mpi_input);
+        imgf_buffer_free(img);
+        return;
+    }
+
+    for (int f = 0; f < NUM_FILTERS; f++) {
+
+        const char *filter = filters[f];
+        int is_gaussian = (strcmp(filter, "gaussian") == 0);
+        const char *params = is_gaussian ? "5 1.0" : "";
+        char label[128];
+        char out_path[512];
+
+        imgf_stage stage;
+        imgf_stage_init(&stage, filter, 5, 1.0);
+        if (!imgf_stage_build(&stage)) {
+            printf("  %s: cannot allocate the kernel, skipped\n", filter);
+            fprintf(report, "%s: cannot allocate the kernel, skipped\n\n", filter);
+            continue;
+        }
+        double pixel_flops = imgf_chain_flops_per_pixel(&stage, 1, ch) * w * h;
+
+        printf("  %s\n", filter);
+
+        /* ---------------- SERIAL ---------------- */
+        bench_filter(&stage, img, out, w, h, ch, IMGF_SERIAL, cfg, samples);
+        r = add_record(results, img_path, w, h, ch, filter, params, "serial",
+                       1, 1, "filter", samples, cfg->reps, 2 * pixel_bytes, pixel_flops);
+        double serial_median = r->st.median;
+        snprintf(label, sizeof(label), "Serial - %s - filter", filter);
+        print_record(report, label, r);
+        snprintf(label, sizeof(label), "Serial - %s - roofline", filter);
+        report_roofline(report, label, &stage, cfg->serial_peaks, r);
+        snprintf(label, sizeof(label), "Serial - %s - counters", filter);
+        report_counters(report, label, cfg, r);
+
+        bench_encode(out, w, h, ch, cfg, samples);
+        r = add_record(results, img_path, w, h, ch, filter, params, "stb",
+                       1, 1, "encode", samples, cfg->reps, pixel_bytes, 0.0);
+        snprintf(label, sizeof(label), "Serial - %s - encode", filter);
+        print_record(report, label, r);
+
+        snprintf(out_path, sizeof(out_path), "../output/serial/output_%s_%s.png",
+                 filter, img_tag);
+        stbi_write_png(out_path, w, h, ch, out, w * ch);
+
+        /* ---------------- OPENMP ---------------- */
+        bench_filter(&stage, img, out, w, h, ch, IMGF_THREADS, cfg, samples);
+        r = add_record(results, img_path, w, h, ch, filter, params, "openmp",
+                       cfg->threads, 1, "filter", samples, cfg->reps, 2 * pixel_bytes, pixel_flops);
+        snprintf(label, sizeof(label), "Parallel - %s - filter", filter);
+        print_record(report, label, r);
+        snprintf(label, sizeof(label), "Parallel - %s - roofline", filter);
+        report_roofline(report, label, &stage, cfg->thread_peaks, r);
+        snprintf(label, sizeof(label), "Parallel - %s - counters", filter);
+        report_counters(report, label, cfg, r);
+        fprintf(report, "Parallel - %s - speedup over serial: %.2fx\n", filter,
+                r->st.median > 0.0 ? serial_median / r->st.median : 0.0);
+
+        snprintf(out_path, sizeof(out_path), "../output/parallel/output_%s_%s.png",
+                 filter, img_tag);
+        stbi_write_png(out_path, w, h, ch, out, w * ch);
+
+        /* ---------------- MPI ---------------- */
+        if (mpi_input) {
+            snprintf(out_path, sizeof(out_path),
+                     "../output/distributed/output_%s_%s.png", filter, img_tag);
+
+            if (bench_distributed(mpi_input, out_path, filter, params, cfg,
+                                  samples, samples2)) {
+                r = add_record(results, img_path, w, h, ch, filter, params, "mpi",
+                               1, cfg->ranks, "compute", samples, cfg->reps,
+                               2 * pixel_bytes, pixel_flops);
+                snprintf(label, sizeof(label), "Distributed - %s - compute", filter);
+                print_record(report, label, r);
+                r = add_record(results, img_path, w, h, ch, filter, params, "mpi",
+                               1, cfg->ranks, "total", samples2, cfg->reps,
+                               2 * pixel_bytes, pixel_flops);
+                snprintf(label, sizeof(label), "Distributed - %s - total", filter);
+                print_record(report, label, r);
+            }
+            else {
+                fprintf(report, "Distributed - %s: mpi_filter failed\n", filter);
+            }
+        }
+
+        imgf_stage_free(&stage);
+        fprintf(report, "\n");
+    }
+
+    if (mpi_input && !decoded) remove(mpi_input);
+    free(out);
+    imgf_buffer_free(img);
+    fprintf(report, "-------------------------------------\n\n");
+}
+
+/* ============================================================
+ * SCALING SWEEP
+ *
+ * Strong scaling keeps the image fixed while the worker count grows;
+ * weak scaling stacks one copy of the image per worker, so every
+ * worker keeps the same number of rows. The one-worker run of the
+ * same backend is the baseline (T1):
+ *
+ *   speedup S = T1 / Tp           (weak: scaled speedup p * T1 / Tp)
+ *   efficiency E = S / p
+ *   Karp-Flatt serial fraction e = (1/S - 1/p) / (1 - 1/p)
+ *
+ * A Karp-Flatt fraction that grows with p points at parallel overhead
+ * (synchronisation, halo traffic) rather than inherently serial work.
+ * ============================================================ */
+#define MAX_SWEEP_POINTS 32
+
+// 1, 2, 4, ... and finally 'max' itself
+int worker_counts(int max, int *counts) {
+    int n = 0;
+    for (int p = 1; p < max && n < MAX_SWEEP_POINTS - 1; p *= 2) counts[n++] = p;
+    counts[n++] = max;
+    return n;
+}
+
+void print_scaling_table(FILE *fp, const char *title, int weak, int w,
+                         const int *workers, const int *heights,
+                         const double *median, const double *total, int n) {
+    fprintf(fp, "%s\n", title);
+    fprintf(fp, "  %7s %12s %12s %9s %11s %11s", "workers", "image",
+            "median (s)", weak ? "scaled S" : "speedup", "efficiency", "Karp-Flatt");
+    if (total) fprintf(fp, " %12s", "total (s)");
+    fprintf(fp, "\n");
+
+    double t1 = median[0];
+    for (int i = 0; i < n; i++) {
+        int p = workers[i];
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", w, heights[i]);
+
+        if (median[i] <= 0.0 || t1 <= 0.0) {
+            fprintf(fp, "  %7d %12s %12s\n", p, size, "failed");
+            continue;
+        }
+
+        double s = weak ? p * t1 / median[i] : t1 / median[i];
+        double e = s / p;
+        char kf[16] = "-";
+        if (p > 1) snprintf(kf, sizeof(kf), "%.4f", (1.0 / s - 1.0 / p) / (1.0 - 1.0 / p));
+
+        fprintf(fp, "  %7d %12s %12.6f %9.2f %10.1f%% %11s", p, size, median[i],
+                s, 100.0 * e, kf);
+        if (total) fprintf(fp, " %12.6f", total[i]);
+        fprintf(fp, "\n");
+    }
+    fprintf(fp, "\n");
+}
+
+// Stacks 'copies' copies of the image vertically; NULL if it does not fit
+unsigned char* stack_image(const unsigned char *img, int w, int h, int ch, int copies) {
+    size_t bytes = (size_t)w * h * ch;
+    unsigned char *big = malloc(bytes * copies);
+    if (!big) return NULL;
+    for (int i = 0; i < copies; i++) memcpy(big + i * bytes, img, bytes);
+    return big;
+}
+
+void sweep_image(const char *img_path, const bench_config *cfg, record_list *results,
+                 FILE *report, double *samples, double *samples2) {
+    int w, h, ch, decoded;
+    unsigned char *img = bench_load(img_path, cfg, &w, &h, &ch, samples, &decoded);
+    if (!img) {
+        printf("Skipping %s: could not load image.\n", img_path);
+        fprintf(report, "Image: %s (could not load, skipped)\n\n", img_path);
+        return;
+    }
+    fprintf(report, "Image: %s (%dx%d, %d channels)\n\n", img_path, w, h, ch);
+
+    const char *mpi_input = cfg->ranks > 0
+                          ? mpi_input_path(img_path, decoded, img, w, h, ch) : NULL;
+    if (cfg->ranks > 0 && !mpi_input)
+        fprintf(report, "Distributed: skipped, mpi_filter only takes RGB images\n\n");
+    int threads[MAX_SWEEP_POINTS], ranks[MAX_SWEEP_POINTS];
+    int nthreads = worker_counts(cfg->threads, threads);
+    int nranks = mpi_input ? worker_counts(cfg->ranks, ranks) : 0;
+    double median[MAX_SWEEP_POINTS], total[MAX_SWEEP_POINTS];
+    int heights[MAX_SWEEP_POINTS];
+    const char *weak_input = "../output/distributed/weak_input.ppm";
+    const char *sweep_output = "../output/distributed/sweep_output.ppm";
+    char title[256];
+
+    for (int f = 0; f < NUM_FILTERS; f++) {
+        const char *filter = filters[f];
+        const char *params = strcmp(filter, "gaussian") == 0 ? "5 1.0" : "";
+        bench_record *r;
+
+        imgf_stage stage;
+        imgf_stage_init(&stage, filter, 5, 1.0);
+        if (!imgf_stage_build(&stage)) {
+            printf("  %s: cannot allocate the kernel, skipped\n", filter);
+            fprintf(report, "%s: cannot allocate the kernel, skipped\n\n", filter);
+            continue;
+        }
+        double flops_per_pixel = imgf_chain_flops_per_pixel(&stage, 1, ch);
+
+        printf("  %s\n", filter);
+
+        /* ---------------- OPENMP, STRONG ---------------- */
+        unsigned char *out = malloc((size_t)w * h * ch);
+        if (!out) {
+            printf("  %s: cannot allocate the output image, skipped\n", filter);
+            fprintf(report, "%s: cannot allocate the output image, skipped\n\n", filter);
+            imgf_stage_free(&stage);
+            continue;
+        }
+        for (int i = 0; i < nthreads; i++) {
+            omp_set_num_threads(threads[i]);
+            bench_filter(&stage, img, out, w, h, ch, IMGF_THREADS, cfg, samples);
+            r = add_record(results, img_path, w, h, ch, filter, params, "openmp",
+                           threads[i], 1, "filter", samples, cfg->reps,
+                           2.0 * w * h * ch, flops_per_pixel * w * h);
+            median[i] = r->st.median;
+            heights[i] = h;
+        }
+        free(out);
+        snprintf(title, sizeof(title), "Strong scaling - %s - OpenMP threads", filter);
+        print_scaling_table(stdout, title, 0, w, threads, heights, median, NULL, nthreads);
+        print_scaling_table(report, title, 0, w, threads, heights, median, NULL, nthreads);
+
+        /* ---------------- OPENMP, WEAK ---------------- */
+        for (int i = 0; i < nthreads; i++) {
+            int p = threads[i];
+            unsigned char *big = stack_image(img, w, h, ch, p);
+            unsigned char *big_out = big ? malloc((size_t)w * h * ch * p) : NULL;
+            heights[i] = h * p;
+            median[i] = -1.0;
+
+            if (big && big_out) {
+                omp_set_num_threads(p);
+                bench_filter(&stage, big, big_out, w, h * p, ch, IMGF_THREADS, cfg,
+                             samples);
+                r = add_record(results, img_path, w, h * p, ch, filter, params,
+                               "openmp", p, 1, "filter", samples, cfg->reps,
+                               2.0 * w * h * ch * p, flops_per_pixel * w * h * p);
+                median[i] = r->st.median;
+            }
+            free(big);
+            free(big_out);
+        }
+        snprintf(title, sizeof(title), "Weak scaling - %s - OpenMP threads", filter);
+        print_scaling_table(stdout, title, 1, w, threads, heights, median, NULL, nthreads);
+        print_scaling_table(report, title, 1, w, threads, heights, median, NULL, nthreads);
+
+        omp_set_num_threads(cfg->threads);
+
+        /* ---------------- MPI, STRONG AND WEAK ---------------- */
+        for (int weak = 0; weak < 2 && nranks > 0; weak++) {
+            for (int i = 0; i < nranks; i++) {
+                int p = ranks[i];
+                bench_config c = *cfg;
+                c.ranks = p;
+                const char *input = mpi_input;
+                heights[i] = weak ? h * p : h;
+                median[i] = total[i] = -1.0;
+
+                if (weak) {
+                    unsigned char *big = stack_image(img, w, h, ch, p);
+                    int ok = big && write_ppm(weak_input, big, w, h * p);
+                    free(big);
+                    if (!ok) continue;
+                    input = weak_input;
+                }
+
+                if (!bench_distributed(input, sweep_output, filter, params, &c,
+                                       samples, samples2))
+                    continue;
+
+                r = add_record(results, img_path, w, heights[i], ch, filter, params,
+                               "mpi", 1, p, "compute", samples, cfg->reps,
+                               2.0 * w * heights[i] * ch,
+                               flops_per_pixel * w * heights[i]);
+                median[i] = r->st.median;
+                r = add_record(results, img_path, w, heights[i], ch, filter, params,
+                               "mpi", 1, p, "total", samples2, cfg->reps,
+                               2.0 * w * heights[i] * ch,
+                               flops_per_pixel * w * heights[i]);
+                total[i] = r->st.median;
+            }
+
+            snprintf(title, sizeof(title), "%s scaling - %s - MPI ranks (compute = slowest rank)",
+                     weak ? "Weak" : "Strong", filter);
+            print_scaling_table(stdout, title, weak, w, ranks, heights, median, total, nranks);
+            print_scaling_table(report, title, weak, w, ranks, heights, median, total, nranks);
+        }
+
+        imgf_stage_free(&stage);
+    }
+
+    remove(weak_input);
+    remove(sweep_output);
+    if (mpi_input && !decoded) remove(mpi_input);
+    imgf_buffer_free(img);
+    fprintf(report, "-------------------------------------\n\n");
 }
 
 /* ============================================================
  * MAIN BENCHMARK DRIVER
  * ============================================================ */
-int main(void) {
+void print_usage(const char *prog) {
+    printf("Usage: %s [--warmup=N] [--reps=N] [--threads=N] [--ranks=N] [--sweep]\n"
+           "          [--counters] [--roofline] [--json=FILE] [--csv=FILE] [image.png ...]\n", prog);
+    printf("       %s --compare BASE.json NEW.json [--threshold=PCT] [--alpha=P]\n",
+           prog);
+    printf("  images are files or synth:PATTERN:WxH[xCH][:SEED] with PATTERN one of\n"
+           "  noise, gradient, edges, fractal (generated in memory, no decode)\n");
+    printf("  --ranks=0 skips mpi_filter\n");
+    printf("  --sweep runs 1..--threads threads and 1..--ranks ranks (strong and weak)\n");
+    printf("  --roofline measures FLOP/s and memory bandwidth peaks and reports each\n"
+           "  filter's share of them\n");
+    printf("  --compare exits with status 2 when it finds a regression\n");
+}
+
+int main(int argc, char **argv) {
+
+    bench_config cfg = { 1, 5, omp_get_num_procs(), 4, NULL, NULL, NULL, NULL, NULL };
+    imgf_counters counters;
+    imgf_machine_peaks serial_peaks, thread_peaks;
+    int use_counters = 0, use_roofline = 0;
+    const char **image_list = images;
+    int num_images = NUM_IMAGES;
+    const char **args_images = malloc(argc * sizeof(char*));
+    int num_args_images = 0;
+    int compare = 0, sweep = 0;
+    double threshold = 5.0, alpha = 0.05;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--warmup=", 9) == 0) cfg.warmup = atoi(argv[i] + 9);
+        else if (strncmp(argv[i], "--reps=", 7) == 0) cfg.reps = atoi(argv[i] + 7);
+        else if (strncmp(argv[i], "--threads=", 10) == 0) cfg.threads = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--ranks=", 8) == 0) cfg.ranks = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--json=", 7) == 0) cfg.json_path = argv[i] + 7;
+        else if (strncmp(argv[i], "--csv=", 6) == 0) cfg.csv_path = argv[i] + 6;
+        else if (strcmp(argv[i], "--sweep") == 0) sweep = 1;
+        else if (strcmp(argv[i], "--counters") == 0) use_counters = 1;
+        else if (strcmp(argv[i], "--roofline") == 0) use_roofline = 1;
+        else if (strcmp(argv[i], "--compare") == 0) compare = 1;
+        else if (strncmp(argv[i], "--threshold=", 12) == 0) threshold = atof(argv[i] + 12);
+        else if (strncmp(argv[i], "--alpha=", 8) == 0) alpha = atof(argv[i] + 8);
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        else args_images[num_args_images++] = argv[i];
+    }
+
+    if (compare) {
+        if (num_args_images != 2) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        int regressions = compare_results(args_images[0], args_images[1],
+                                          threshold, alpha);
+        free(args_images);
+        return regressions < 0 ? 1 : (regressions > 0 ? 2 : 0);
+    }
+
+    if (cfg.warmup < 0 || cfg.reps < 1 || cfg.threads < 1 || cfg.ranks < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (num_args_images > 0) {
+        image_list = args_images;
+        num_images = num_args_images;
+    }
+
+    // Opened before any OpenMP region so the worker threads are counted too
+    if (use_counters) {
+        if (imgf_counters_open(&counters)) cfg.counters = &counters;
+        else printf("Hardware counters not available on this system.\n");
+    }
 
     /* Create output directories */
 #ifdef _WIN32
@@ -93,6 +1168,9 @@ int main(void) {
 #endif
 
     printf("=== Image Filtering Benchmark ===\n");
+    printf("warm-up %d, repetitions %d, %s%d OpenMP thread(s), %s%d MPI rank(s)\n",
+           cfg.warmup, cfg.reps, sweep ? "up to " : "", cfg.threads,
+           sweep ? "up to " : "", cfg.ranks);
 
     FILE *report = fopen("../performance_report.txt", "w");
     if (!report) {
@@ -100,83 +1178,60 @@ int main(void) {
         return 1;
     }
 
-    fprintf(report, "Image Filtering Performance Report\n\n");
-
-    for (int i = 0; i < NUM_IMAGES; i++) {
-
-        const char *img = images[i];
-        const char *img_tag = (i == 0) ? "normal" : "8k";
-
-        printf("\nProcessing Image: %s\n", img);
-        fprintf(report, "Image: %s\n", img);
-
-        for (int f = 0; f < NUM_FILTERS; f++) {
-
-            const char *filter = filters[f];
-            int is_gaussian = (strcmp(filter, "gaussian") == 0);
-
-            /* ---------------- SERIAL ---------------- */
-            char serial_cmd[512];
-            snprintf(
-                serial_cmd, sizeof(serial_cmd),
-                "%simage_filter_serial%s %s ../output/serial/output_%s_%s.png %s %s",
-                EXE_PREFIX, EXE_SUFFIX,
-                img, filter, img_tag,
-                filter,
-                is_gaussian ? "5 1.0" : ""
-            );
-
-            double t_serial = time_command(serial_cmd);
-            fprintf(report, "Serial - %s: %.6f s\n", filter, t_serial);
+    fprintf(report, "Image Filtering %s Report\n\n", sweep ? "Scaling" : "Performance");
+    fprintf(report, "Kernels timed in-process: %d warm-up run(s), %d timed run(s) each.\n",
+            cfg.warmup, cfg.reps);
+    fprintf(report, "Parallel uses %s%d OpenMP thread(s); Distributed uses %s%d MPI rank(s)\n",
+            sweep ? "up to " : "", cfg.threads, sweep ? "up to " : "", cfg.ranks);
+    fprintf(report, "(compute = slowest rank, total = mpi_filter's own timer).\n\n");
 
-            /* ---------------- OPENMP ---------------- */
-            char parallel_cmd[512];
-            snprintf(
-                parallel_cmd, sizeof(parallel_cmd),
-                "%simage_filter_parallel%s %s ../output/parallel/output_%s_%s.png 4 %s %s",
-                EXE_PREFIX, EXE_SUFFIX,
-                img, filter, img_tag,
-                filter,
-                is_gaussian ? "5 1.0" : ""
-            );
+    omp_set_num_threads(cfg.threads);
 
-            double t_parallel = time_command(parallel_cmd);
-            fprintf(report, "Parallel - %s: %.6f s\n", filter, t_parallel);
+    if (use_roofline) {
+        printf("Measuring machine peaks...\n");
+        imgf_measure_peaks(&serial_peaks, IMGF_SERIAL);
+        imgf_measure_peaks(&thread_peaks, IMGF_THREADS);
+        cfg.serial_peaks = &serial_peaks;
+        cfg.thread_peaks = &thread_peaks;
+        fprintf(report, "Machine peaks: %.2f GFLOP/s, %.2f GB/s on 1 thread; "
+                "%.2f GFLOP/s, %.2f GB/s on %d thread(s)\n\n",
+                serial_peaks.flops / 1e9, serial_peaks.bandwidth / 1e9,
+                thread_peaks.flops / 1e9, thread_peaks.bandwidth / 1e9,
+                thread_peaks.threads);
+    }
 
-            /* ---------------- MPI ---------------- */
-            char mpi_cmd[512];
+    record_list results = {0};
+    double *samples = malloc(cfg.reps * sizeof(double));
+    double *samples2 = malloc(cfg.reps * sizeof(double));
 
-#ifdef _WIN32
-            snprintf(
-                mpi_cmd, sizeof(mpi_cmd),
-                "mpiexec -n 4 mpi_filter%s %s ../output/distributed/output_%s_%s.png %s %s",
-                EXE_SUFFIX,
-                img, filter, img_tag,
-                filter,
-                is_gaussian ? "5 1.0" : ""
-            );
-#else
-            snprintf(
-                mpi_cmd, sizeof(mpi_cmd),
-                "mpirun -np 4 ./mpi_filter%s %s ../output/distributed/output_%s_%s.png %s %s",
-                EXE_SUFFIX,
-                img, filter, img_tag,
-                filter,
-                is_gaussian ? "5 1.0" : ""
-            );
-#endif
+    for (int i = 0; i < num_images; i++) {
 
-            double t_distributed = time_command(mpi_cmd);
-            fprintf(report, "Distributed - %s: %.6f s\n", filter, t_distributed);
+        const char *img_path = image_list[i];
+        char img_tag[32];
+        snprintf(img_tag, sizeof(img_tag), "img%d", i + 1);
+        if (num_args_images == 0) strcpy(img_tag, (i == 0) ? "normal" : "8k");
 
-            fprintf(report, "\n");
-        }
+        printf("\nProcessing Image: %s\n", img_path);
 
-        fprintf(report, "-------------------------------------\n\n");
+        if (sweep)
+            sweep_image(img_path, &cfg, &results, report, samples, samples2);
+        else
+            bench_image(img_path, img_tag, &cfg, &results, report, samples, samples2);
     }
 
     fclose(report);
 
+    if (cfg.json_path && !write_json(cfg.json_path, &results, &cfg))
+        fprintf(stderr, "Could not write %s\n", cfg.json_path);
+    if (cfg.csv_path && !write_csv(cfg.csv_path, &results))
+        fprintf(stderr, "Could not write %s\n", cfg.csv_path);
+
+    if (cfg.counters) imgf_counters_close(cfg.counters);
+    free_records(&results);
+    free(samples);
+    free(samples2);
+    free(args_images);
+
     printf("\nBenchmark complete. See ../performance_report.txt for results.\n");
     return 0;
 }
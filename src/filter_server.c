@@ -0,0 +1,844 @@
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include "imgfilter.h"
+
+// Decoded and synthetic images both come from the libimgfilter pool, so
+// either kind is released with imgf_buffer_free
+#define STBI_MALLOC(sz) imgf_buffer_alloc(sz)
+#define STBI_REALLOC(p, newsz) imgf_buffer_realloc(p, newsz)
+#define STBI_FREE(p) imgf_buffer_free(p)
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <signal.h>
+    #include <stdint.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+/*******************************************************************************
+ * PERSISTENT FILTER SERVER
+ *
+ * One long-lived process accepts filter jobs over a Unix domain socket, so a
+ * job costs only decode, filter and encode: the OpenMP thread pool stays up,
+ * built filter chains are cached and the output buffer is reused.
+ *
+ * Protocol: one request line, one reply line, any number per connection.
+ *   FILTER input.png output.png FILTER [params]   (as image_filter_parallel)
+ *       -> OK width height channels filter_seconds job_seconds
+ *   STATS -> OK jobs N shm_jobs N plan_hits N plan_misses N buffer_reuses N
+ *               filter_seconds S uptime S
+ *   PING  -> OK
+ *   QUIT  -> OK, then the server exits
+ *   ATTACH /shm-name, RUN job, DETACH   (shared memory, see below)
+ * Failures reply "ERR message". Paths cannot contain whitespace.
+ * Connections are served one after another; every job already uses all
+ * threads.
+ ******************************************************************************/
+#ifndef _WIN32
+
+#define MAX_LINE 4096
+#define MAX_TOKENS 16
+#define MAX_PLANS 16
+
+/*******************************************************************************
+ * LINE I/O
+ ******************************************************************************/
+typedef struct {
+    int fd;
+    char buf[MAX_LINE];
+    size_t len;
+} line_reader;
+
+// Next line without its '\n'; 0 at end of stream, on errors or if too long
+static int read_line(line_reader *r, char *line, size_t max)
+{
+    for (;;) {
+        char *nl = (char*)memchr(r->buf, '\n', r->len);
+        if (nl) {
+            size_t n = nl - r->buf;
+            if (n >= max) return 0;
+            memcpy(line, r->buf, n);
+            line[n] = '\0';
+            if (n > 0 && line[n - 1] == '\r') line[n - 1] = '\0';
+            memmove(r->buf, nl + 1, r->len - n - 1);
+            r->len -= n + 1;
+            return 1;
+        }
+        if (r->len == sizeof(r->buf)) return 0;
+
+        ssize_t got = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 0;
+        r->len += got;
+    }
+}
+
+static int write_all(int fd, const char *data, size_t n)
+{
+    while (n > 0) {
+        ssize_t put = write(fd, data, n);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return 0;
+        data += put;
+        n -= put;
+    }
+    return 1;
+}
+
+static int split_tokens(char *line, char **tok, int max)
+{
+    int n = 0;
+    for (char *p = strtok(line, " \t"); p && n < max; p = strtok(NULL, " \t"))
+        tok[n++] = p;
+    return n;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        printf("Socket path too long: %s\n", path);
+        return 0;
+    }
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+static int connect_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*******************************************************************************
+ * WARM STATE
+ *
+ * Built chains are cached under their request text (filter and parameters)
+ * and the least recently used one is evicted. The output buffer only grows.
+ ******************************************************************************/
+typedef struct {
+    char key[256];
+    imgf_stage stages[IMGF_MAX_STAGES];
+    int nstages;
+    unsigned long last_used;
+} filter_plan;
+
+static filter_plan plans[MAX_PLANS];
+static int num_plans = 0;
+static unsigned long plan_clock = 0;
+
+static unsigned char *out_buf = NULL;
+static size_t out_capacity = 0;
+
+static struct {
+    unsigned long jobs;
+    unsigned long shm_jobs;
+    unsigned long plan_hits, plan_misses;
+    unsigned long buffer_reuses;
+    double filter_seconds;
+    double start;
+} stats;
+
+// NULL if the filter is invalid or its kernels cannot be allocated
+static filter_plan* get_plan(char **args, int nargs)
+{
+    char key[256] = "";
+    for (int i = 0; i < nargs; i++) {
+        if (strlen(key) + strlen(args[i]) + 2 > sizeof(key)) return NULL;
+        if (i) strcat(key, " ");
+        strcat(key, args[i]);
+    }
+
+    plan_clock++;
+    for (int i = 0; i < num_plans; i++) {
+        if (strcmp(plans[i].key, key) == 0) {
+            plans[i].last_used = plan_clock;
+            stats.plan_hits++;
+            return &plans[i];
+        }
+    }
+
+    imgf_stage stages[IMGF_MAX_STAGES];
+    int nstages = imgf_parse_filter(args[0], nargs > 1 ? args[1] : NULL,
+                                    nargs > 2 ? args[2] : NULL,
+                                    stages, IMGF_MAX_STAGES);
+    if (nstages == 0) return NULL;
+    // Built before a cache entry is taken, so a failure leaves the cache as it was
+    if (!imgf_chain_build(stages, nstages)) return NULL;
+
+    filter_plan *p = &plans[num_plans];
+    if (num_plans == MAX_PLANS) {
+        p = &plans[0];
+        for (int i = 1; i < MAX_PLANS; i++)
+            if (plans[i].last_used < p->last_used) p = &plans[i];
+        for (int s = 0; s < p->nstages; s++) imgf_stage_free(&p->stages[s]);
+    }
+    else {
+        num_plans++;
+    }
+
+    strcpy(p->key, key);
+    memcpy(p->stages, stages, sizeof(stages));
+    p->nstages = nstages;
+    p->last_used = plan_clock;
+    stats.plan_misses++;
+    return p;
+}
+
+static unsigned char* output_buffer(size_t bytes)
+{
+    if (bytes <= out_capacity) {
+        stats.buffer_reuses++;
+        return out_buf;
+    }
+    unsigned char *grown = (unsigned char*)realloc(out_buf, bytes);
+    if (!grown) return NULL;
+    out_buf = grown;
+    out_capacity = bytes;
+    return out_buf;
+}
+
+/*******************************************************************************
+ * SHARED-MEMORY JOBS
+ *
+ * For raw pixels no image data has to cross the socket. The client creates a
+ * POSIX shared-memory object laid out as
+ *
+ *   shm_header   magic, sizes, then 'num_jobs' job descriptors (the ring)
+ *   slots        'num_slots' buffers of 'slot_bytes', from 'slot_offset'
+ *                (page aligned)
+ *
+ * and sends "ATTACH /name"; the server maps it for the rest of the
+ * connection. To run a job the client writes interleaved 8-bit pixels into
+ * an input slot, fills a descriptor and sends "RUN index". The server filters
+ * straight from the input slot into the output slot, sets the descriptor's
+ * status and replies "OK width height channels filter_seconds job_seconds",
+ * which is the completion signal. Several descriptors may be in flight;
+ * they complete in the order they were sent. Nothing is decoded or encoded.
+ ******************************************************************************/
+#define SHM_MAGIC 0x46474d49u   // "IMGF"
+#define SHM_VERSION 1
+#define SHM_FILTER_LEN 128
+
+enum { JOB_PENDING = 0, JOB_DONE = 1, JOB_FAILED = -1 };
+
+typedef struct {
+    int32_t width, height, channels;
+    int32_t in_slot, out_slot;
+    int32_t status;                 // JOB_*, written by the server
+    char filter[SHM_FILTER_LEN];    // e.g. "gaussian 5 1.0" or a chain
+    double filter_seconds;          // written by the server
+} shm_job;
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t num_jobs, num_slots;
+    uint64_t slot_bytes;
+    uint64_t slot_offset;
+    shm_job jobs[];
+} shm_header;
+
+// The layout fields are copied at ATTACH, once validated: the client can
+// still write the header, so it is never read for them again
+typedef struct {
+    shm_header *hdr;   // NULL when nothing is attached
+    size_t size;
+    uint32_t num_jobs, num_slots;
+    uint64_t slot_bytes;
+    uint64_t slot_offset;
+} shm_segment;
+
+static void shm_detach(shm_segment *seg)
+{
+    if (seg->hdr) munmap(seg->hdr, seg->size);
+    memset(seg, 0, sizeof(*seg));
+}
+
+static const char* shm_attach(shm_segment *seg, const char *name)
+{
+    shm_detach(seg);
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return "cannot open shared memory";
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(shm_header)) {
+        close(fd);
+        return "shared memory too small";
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return "cannot map shared memory";
+
+    // Everything the header claims must lie inside the mapping. Checked on a
+    // copy, so the client cannot change it between the check and the use
+    shm_header hd = *(shm_header*)base;
+    size_t size = st.st_size;
+    size_t ring_end = sizeof(shm_header) + (size_t)hd.num_jobs * sizeof(shm_job);
+    int valid = hd.magic == SHM_MAGIC && hd.version == SHM_VERSION &&
+                hd.num_jobs > 0 && hd.num_jobs <= 1024 &&
+                ring_end <= hd.slot_offset && hd.slot_offset <= size &&
+                hd.slot_bytes > 0 &&
+                hd.num_slots <= (size - hd.slot_offset) / hd.slot_bytes;
+    if (!valid) {
+        munmap(base, size);
+        return "not an image job segment";
+    }
+
+    seg->hdr = (shm_header*)base;
+    seg->size = size;
+    seg->num_jobs = hd.num_jobs;
+    seg->num_slots = hd.num_slots;
+    seg->slot_bytes = hd.slot_bytes;
+    seg->slot_offset = hd.slot_offset;
+    return NULL;
+}
+
+static unsigned char* shm_slot(const shm_segment *seg, int32_t slot)
+{
+    if (slot < 0 || (uint32_t)slot >= seg->num_slots) return NULL;
+    return (unsigned char*)seg->hdr + seg->slot_offset + (size_t)slot * seg->slot_bytes;
+}
+
+static void run_shm_job(shm_segment *seg, const char *index, char *reply, size_t max)
+{
+    double job_start = omp_get_wtime();
+
+    if (!seg->hdr) {
+        snprintf(reply, max, "ERR no shared memory attached");
+        return;
+    }
+    char *end;
+    long j = strtol(index, &end, 10);
+    if (*end != '\0' || j < 0 || j >= (long)seg->num_jobs) {
+        snprintf(reply, max, "ERR bad job index");
+        return;
+    }
+
+    // Copy the descriptor so the client cannot change it while we work
+    shm_job *job = &seg->hdr->jobs[j];
+    shm_job d = *job;
+    d.filter[SHM_FILTER_LEN - 1] = '\0';
+
+    unsigned char *in = shm_slot(seg, d.in_slot);
+    unsigned char *out = shm_slot(seg, d.out_slot);
+    if (d.width < 1 || d.height < 1 || d.channels < 1 || d.channels > 4 ||
+        (double)d.width * d.height * d.channels > (double)seg->slot_bytes ||
+        !in || !out || in == out) {
+        job->status = JOB_FAILED;
+        snprintf(reply, max, "ERR bad job descriptor");
+        return;
+    }
+
+    char *tok[MAX_TOKENS];
+    int ntok = split_tokens(d.filter, tok, MAX_TOKENS);
+    filter_plan *p = ntok > 0 ? get_plan(tok, ntok) : NULL;
+    if (!p) {
+        job->status = JOB_FAILED;
+        snprintf(reply, max, "ERR unknown filter");
+        return;
+    }
+
+    double t0 = omp_get_wtime();
+    if (!imgf_apply_chain(p->stages, p->nstages, in, out, d.width, d.height,
+                          d.channels, IMGF_THREADS)) {
+        job->status = JOB_FAILED;
+        snprintf(reply, max, "ERR out of memory");
+        return;
+    }
+    double filter_seconds = omp_get_wtime() - t0;
+
+    job->filter_seconds = filter_seconds;
+    __atomic_store_n(&job->status, JOB_DONE, __ATOMIC_RELEASE);
+
+    stats.jobs++;
+    stats.shm_jobs++;
+    stats.filter_seconds += filter_seconds;
+    snprintf(reply, max, "OK %d %d %d %.6f %.6f", d.width, d.height, d.channels,
+             filter_seconds, omp_get_wtime() - job_start);
+}
+
+/*******************************************************************************
+ * REQUESTS
+ ******************************************************************************/
+static void run_filter_job(char **tok, int ntok, char *reply, size_t max)
+{
+    double job_start = omp_get_wtime();
+
+    if (ntok < 4) {
+        snprintf(reply, max, "ERR usage: FILTER input.png output.png FILTER [params]");
+        return;
+    }
+    if (strcmp(tok[3], "gaussian") == 0 && ntok < 6) {
+        snprintf(reply, max, "ERR gaussian needs ksize sigma");
+        return;
+    }
+
+    filter_plan *p = get_plan(tok + 3, ntok - 3);
+    if (!p) {
+        snprintf(reply, max, "ERR unknown filter");
+        return;
+    }
+
+    int w, h, ch;
+    unsigned char *img = stbi_load(tok[1], &w, &h, &ch, 3);
+    if (!img) {
+        snprintf(reply, max, "ERR cannot load %s", tok[1]);
+        return;
+    }
+    ch = 3;
+
+    unsigned char *out = output_buffer((size_t)w * h * ch);
+    if (!out) {
+        stbi_image_free(img);
+        snprintf(reply, max, "ERR out of memory");
+        return;
+    }
+
+    double t0 = omp_get_wtime();
+    int filtered = imgf_apply_chain(p->stages, p->nstages, img, out, w, h, ch, IMGF_THREADS);
+    double filter_seconds = omp_get_wtime() - t0;
+    stbi_image_free(img);
+    if (!filtered) {
+        snprintf(reply, max, "ERR out of memory");
+        return;
+    }
+
+    if (!stbi_write_png(tok[2], w, h, ch, out, w * ch)) {
+        snprintf(reply, max, "ERR cannot write %s", tok[2]);
+        return;
+    }
+
+    stats.jobs++;
+    stats.filter_seconds += filter_seconds;
+    snprintf(reply, max, "OK %d %d %d %.6f %.6f", w, h, ch, filter_seconds,
+             omp_get_wtime() - job_start);
+}
+
+// Returns 0 when the server should shut down
+static int handle_request(char *line, char *reply, size_t max, shm_segment *seg)
+{
+    char *tok[MAX_TOKENS];
+    int ntok = split_tokens(line, tok, MAX_TOKENS);
+
+    if (ntok == 0) {
+        snprintf(reply, max, "ERR empty request");
+    }
+    else if (strcmp(tok[0], "FILTER") == 0) {
+        run_filter_job(tok, ntok, reply, max);
+    }
+    else if (strcmp(tok[0], "RUN") == 0 && ntok == 2) {
+        run_shm_job(seg, tok[1], reply, max);
+    }
+    else if (strcmp(tok[0], "ATTACH") == 0 && ntok == 2) {
+        const char *err = shm_attach(seg, tok[1]);
+        if (err) snprintf(reply, max, "ERR %s", err);
+        else snprintf(reply, max, "OK %u %u", seg->num_jobs, seg->num_slots);
+    }
+    else if (strcmp(tok[0], "DETACH") == 0) {
+        shm_detach(seg);
+        snprintf(reply, max, "OK");
+    }
+    else if (strcmp(tok[0], "STATS") == 0) {
+        snprintf(reply, max, "OK jobs %lu shm_jobs %lu plan_hits %lu plan_misses %lu "
+                 "buffer_reuses %lu filter_seconds %.6f uptime %.3f",
+                 stats.jobs, stats.shm_jobs, stats.plan_hits, stats.plan_misses,
+                 stats.buffer_reuses, stats.filter_seconds,
+                 omp_get_wtime() - stats.start);
+    }
+    else if (strcmp(tok[0], "PING") == 0) {
+        snprintf(reply, max, "OK");
+    }
+    else if (strcmp(tok[0], "QUIT") == 0) {
+        snprintf(reply, max, "OK");
+        return 0;
+    }
+    else {
+        snprintf(reply, max, "ERR unknown request %.64s", tok[0]);
+    }
+    return 1;
+}
+
+/*******************************************************************************
+ * SERVER
+ ******************************************************************************/
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+static int serve(const char *path)
+{
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) return 1;
+
+    // A socket file nobody answers on is left over from a crashed server
+    int probe = connect_socket(path);
+    if (probe >= 0) {
+        close(probe);
+        printf("A server is already listening on %s\n", path);
+        return 1;
+    }
+    unlink(path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 16) != 0) {
+        perror("filter_server");
+        if (listen_fd >= 0) close(listen_fd);
+        return 1;
+    }
+
+    // No SA_RESTART: a signal interrupts accept() so the loop can stop
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Start the OpenMP worker threads now rather than in the first job
+    #pragma omp parallel
+    {
+        (void)0;
+    }
+
+    stats.start = omp_get_wtime();
+    printf("Listening on %s with %d thread(s)\n", path, omp_get_max_threads());
+    fflush(stdout);
+
+    char line[MAX_LINE];
+    char reply[MAX_LINE];
+    int running = 1;
+
+    while (running && !stop_requested) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+
+        line_reader reader = { fd, {0}, 0 };
+        shm_segment seg = { 0 };
+        while (running && read_line(&reader, line, sizeof(line))) {
+            // Leave room for the newline however long the reply gets
+            running = handle_request(line, reply, sizeof(reply) - 1, &seg);
+            strcat(reply, "\n");
+            if (!write_all(fd, reply, strlen(reply))) break;
+        }
+        shm_detach(&seg);
+        close(fd);
+    }
+
+    close(listen_fd);
+    unlink(path);
+    for (int i = 0; i < num_plans; i++)
+        for (int s = 0; s < plans[i].nstages; s++)
+            imgf_stage_free(&plans[i].stages[s]);
+    free(out_buf);
+
+    printf("Served %lu job(s); stopped\n", stats.jobs);
+    return 0;
+}
+
+/*******************************************************************************
+ * CLIENT
+ ******************************************************************************/
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Sends 'request' 'repeat' times over one connection and prints the last
+// reply with the round-trip latency
+static int submit(const char *path, const char *request, int repeat)
+{
+    int fd = connect_socket(path);
+    if (fd < 0) {
+        printf("Cannot connect to %s\n", path);
+        return 1;
+    }
+
+    char line[MAX_LINE];
+    snprintf(line, sizeof(line), "%s\n", request);
+    line_reader reader = { fd, {0}, 0 };
+    char reply[MAX_LINE] = "";
+    double *latency = (double*)malloc(repeat * sizeof(double));
+    int ok = 1;
+
+    for (int i = 0; i < repeat && ok; i++) {
+        double t0 = omp_get_wtime();
+        ok = write_all(fd, line, strlen(line)) &&
+             read_line(&reader, reply, sizeof(reply));
+        latency[i] = omp_get_wtime() - t0;
+        if (ok && strncmp(reply, "OK", 2) != 0) ok = 0;
+    }
+    close(fd);
+
+    printf("%s\n", reply[0] ? reply : "ERR no reply");
+    if (ok && repeat > 1) {
+        qsort(latency, repeat, sizeof(double), compare_doubles);
+        printf("Round trip over %d request(s): min %.6f s, median %.6f s, max %.6f s\n",
+               repeat, latency[0], latency[repeat / 2], latency[repeat - 1]);
+    }
+    else if (ok) {
+        printf("Round trip: %.6f seconds\n", latency[0]);
+    }
+
+    free(latency);
+    return ok ? 0 : 1;
+}
+
+// Round trip of one request line on an open connection; 0 unless "OK ..."
+static int request(int fd, line_reader *reader, const char *req, char *reply,
+                   size_t max)
+{
+    char line[MAX_LINE];
+    snprintf(line, sizeof(line), "%s\n", req);
+    if (!write_all(fd, line, strlen(line)) || !read_line(reader, reply, max)) {
+        snprintf(reply, max, "ERR no reply");
+        return 0;
+    }
+    return strncmp(reply, "OK", 2) == 0;
+}
+
+// Places one raw image in shared memory and has the server filter it
+// 'repeat' times; only the RUN line and the reply cross the socket
+static int submit_shm(const char *path, const char *input, const char *filter,
+                      const char *output, int repeat)
+{
+    int w, h, ch;
+    unsigned char *img;
+    imgf_pattern pattern;
+    unsigned int seed;
+    if (imgf_parse_synth(input, &pattern, &w, &h, &ch, &seed)) {
+        img = imgf_synthesize(pattern, w, h, ch, seed, IMGF_THREADS);
+    }
+    else {
+        img = stbi_load(input, &w, &h, &ch, 3);
+        ch = 3;
+    }
+    if (!img) {
+        printf("Cannot load %s\n", input);
+        return 1;
+    }
+    if (strlen(filter) >= SHM_FILTER_LEN) {
+        printf("Filter text too long\n");
+        imgf_buffer_free(img);
+        return 1;
+    }
+
+    // One descriptor and two slots (input, output) are enough for a client
+    // with one job in flight
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t bytes = (size_t)w * h * ch;
+    size_t slot_bytes = (bytes + page - 1) / page * page;
+    size_t slot_offset = (sizeof(shm_header) + sizeof(shm_job) + page - 1) / page * page;
+    size_t size = slot_offset + 2 * slot_bytes;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/imgfilter-%ld", (long)getpid());
+    int shm_fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (shm_fd < 0 || ftruncate(shm_fd, size) != 0) {
+        perror("shm_open");
+        if (shm_fd >= 0) {
+            close(shm_fd);
+            shm_unlink(name);
+        }
+        imgf_buffer_free(img);
+        return 1;
+    }
+    shm_header *hdr = (shm_header*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (hdr == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(name);
+        imgf_buffer_free(img);
+        return 1;
+    }
+
+    hdr->magic = SHM_MAGIC;
+    hdr->version = SHM_VERSION;
+    hdr->num_jobs = 1;
+    hdr->num_slots = 2;
+    hdr->slot_bytes = slot_bytes;
+    hdr->slot_offset = slot_offset;
+    unsigned char *in_slot = (unsigned char*)hdr + slot_offset;
+    unsigned char *out_slot = in_slot + slot_bytes;
+    memcpy(in_slot, img, bytes);
+    imgf_buffer_free(img);
+
+    shm_job *job = &hdr->jobs[0];
+    job->width = w;
+    job->height = h;
+    job->channels = ch;
+    job->in_slot = 0;
+    job->out_slot = 1;
+    strcpy(job->filter, filter);
+
+    int fd = connect_socket(path);
+    if (fd < 0) {
+        printf("Cannot connect to %s\n", path);
+        munmap(hdr, size);
+        shm_unlink(name);
+        return 1;
+    }
+
+    line_reader reader = { fd, {0}, 0 };
+    char req[MAX_LINE], reply[MAX_LINE];
+    snprintf(req, sizeof(req), "ATTACH %s", name);
+    int ok = request(fd, &reader, req, reply, sizeof(reply));
+    // The server has it mapped now; the name is no longer needed
+    shm_unlink(name);
+
+    double *latency = (double*)malloc(repeat * sizeof(double));
+    for (int i = 0; i < repeat && ok; i++) {
+        job->status = JOB_PENDING;
+        double t0 = omp_get_wtime();
+        ok = request(fd, &reader, "RUN 0", reply, sizeof(reply)) &&
+             __atomic_load_n(&job->status, __ATOMIC_ACQUIRE) == JOB_DONE;
+        latency[i] = omp_get_wtime() - t0;
+    }
+    close(fd);
+
+    printf("%s\n", reply);
+    if (ok) {
+        qsort(latency, repeat, sizeof(double), compare_doubles);
+        printf("Shared memory: %dx%dx%d, %.2f MB per frame stay in place\n",
+               w, h, ch, bytes / 1e6);
+        printf("Round trip over %d request(s): min %.6f s, median %.6f s, max %.6f s\n",
+               repeat, latency[0], latency[repeat / 2], latency[repeat - 1]);
+        if (output && !stbi_write_png(output, w, h, ch, out_slot, w * ch)) {
+            printf("Cannot write %s\n", output);
+            ok = 0;
+        }
+    }
+
+    free(latency);
+    munmap(hdr, size);
+    return ok ? 0 : 1;
+}
+
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s serve SOCKET [thread_count]\n", prog);
+    printf("       %s submit SOCKET input.png output.png FILTER [params] [--repeat=N]\n", prog);
+    printf("       %s submit-shm SOCKET input FILTER [params] [--repeat=N] [--out=output.png]\n", prog);
+    printf("       %s stats SOCKET\n", prog);
+    printf("       %s stop SOCKET\n", prog);
+    printf("  FILTER as for image_filter_parallel: sobel, gaussian ksize sigma,\n"
+           "  laplacian, sharpen, or a chain such as gaussian:5:1.0,sobel\n");
+    printf("  submit-shm passes raw pixels through shared memory; input is a file or\n"
+           "  synth:PATTERN:WxH[xCH][:SEED]\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char *cmd = argv[1];
+    const char *path = argv[2];
+
+    if (strcmp(cmd, "serve") == 0) {
+        if (argc > 3) omp_set_num_threads(strtol(argv[3], NULL, 10));
+        return serve(path);
+    }
+
+    if (strcmp(cmd, "submit") == 0) {
+        int repeat = 1;
+        char request[MAX_LINE] = "FILTER";
+        for (int i = 3; i < argc; i++) {
+            if (strncmp(argv[i], "--repeat=", 9) == 0) {
+                repeat = atoi(argv[i] + 9);
+                continue;
+            }
+            if (strlen(request) + strlen(argv[i]) + 2 > sizeof(request)) {
+                printf("Request too long\n");
+                return 1;
+            }
+            strcat(request, " ");
+            strcat(request, argv[i]);
+        }
+        if (argc < 6 || repeat < 1) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return submit(path, request, repeat);
+    }
+
+    if (strcmp(cmd, "submit-shm") == 0) {
+        int repeat = 1;
+        const char *output = NULL;
+        char filter[MAX_LINE] = "";
+        for (int i = 4; i < argc; i++) {
+            if (strncmp(argv[i], "--repeat=", 9) == 0) {
+                repeat = atoi(argv[i] + 9);
+                continue;
+            }
+            if (strncmp(argv[i], "--out=", 6) == 0) {
+                output = argv[i] + 6;
+                continue;
+            }
+            if (strlen(filter) + strlen(argv[i]) + 2 > sizeof(filter)) {
+                printf("Request too long\n");
+                return 1;
+            }
+            if (filter[0]) strcat(filter, " ");
+            strcat(filter, argv[i]);
+        }
+        if (argc < 5 || !filter[0] || repeat < 1) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return submit_shm(path, argv[3], filter, output, repeat);
+    }
+
+    if (strcmp(cmd, "stats") == 0) return submit(path, "STATS", 1);
+    if (strcmp(cmd, "stop") == 0) return submit(path, "QUIT", 1);
+
+    print_usage(argv[0]);
+    return 1;
+}
+
+#else
+
+int main(void)
+{
+    printf("filter_server needs Unix domain sockets (Linux or macOS)\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,462 @@
+#include "imgfilter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*******************************************************************************
+ * UTILITY FUNCTIONS
+ ******************************************************************************/
+
+static inline unsigned char clamp255(int v) {
+    if (v < 0) return 0;
+    if (v > 255) return 255;
+    return (unsigned char)v;
+}
+
+/*******************************************************************************
+ * BUILD GAUSSIAN KERNEL
+ ******************************************************************************/
+double* imgf_build_gaussian(int ksize, double sigma) {
+    if (ksize < 1 || ksize > IMGF_MAX_KSIZE) return NULL;
+    double *k = (double*)imgf_buffer_alloc((size_t)ksize * ksize * sizeof(double));
+    if (!k) return NULL;
+    int half = ksize / 2;
+    double sum = 0.0;
+
+    for (int y = -half; y <= half; y++) {
+        for (int x = -half; x <= half; x++) {
+            double v = exp(-(x*x + y*y) / (2.0 * sigma * sigma));
+            k[(y + half) * ksize + (x + half)] = v;
+            sum += v;
+        }
+    }
+
+    // Normalize
+    for (int i = 0; i < ksize * ksize; i++) {
+        k[i] /= sum;
+    }
+
+    return k;
+}
+
+/*******************************************************************************
+ * GRAYSCALE (used for Sobel)
+ ******************************************************************************/
+// Packed w*h luma of rows 'pitch' bytes apart; NULL if it cannot be allocated
+static unsigned char* grayscale_rows(const unsigned char *img, size_t pitch,
+                                     int w, int h, int ch, imgf_backend be)
+{
+    long n = (long)w * h;
+    unsigned char *g = (unsigned char*)imgf_buffer_alloc(n > 0 ? n : 1);
+    if (!g) return NULL;
+
+    if (ch < 3) {
+        // Gray or gray+alpha input: the first channel already is the luma
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                g[(long)y * w + x] = img[y * pitch + (size_t)x * ch];
+        return g;
+    }
+
+    #pragma omp parallel for if(be == IMGF_THREADS)
+    for (int y = 0; y < h; y++) {
+        const unsigned char *row = img + y * pitch;
+        for (int x = 0; x < w; x++) {
+            int r = row[x * ch + 0];
+            int g1 = row[x * ch + 1];
+            int b = row[x * ch + 2];
+            g[(long)y * w + x] = (unsigned char)(0.299 * r + 0.587 * g1 + 0.114 * b);
+        }
+    }
+    return g;
+}
+
+unsigned char* imgf_to_grayscale(const unsigned char *img, int w, int h,
+                                 int ch, imgf_backend be)
+{
+    return grayscale_rows(img, (size_t)w * ch, w, h, ch, be);
+}
+
+/*******************************************************************************
+ * BAND CONVOLUTION (Gaussian, Laplacian, Sharpen)
+ *
+ * The kernels read from 'src', 'src_rows' rows 'pitch' bytes apart that hold
+ * global rows first_row, first_row + 1, ...; the band API passes its
+ * extended buffer as rows y0 - halo .. y0 + rows + halo - 1 of pitch w*ch.
+ ******************************************************************************/
+static void convolve_rows(const unsigned char *src, size_t pitch,
+                          int first_row, int src_rows, unsigned char *out,
+                          int w, int rows, int ch,
+                          const double *kernel, int ksize,
+                          int y0, int global_h, imgf_backend be)
+{
+    int half = ksize / 2;
+
+    // One span per thread: its share of the band
+    #pragma omp parallel if(be == IMGF_THREADS)
+    {
+        imgf_trace_begin("convolve band");
+        #pragma omp for collapse(2) schedule(guided) nowait
+        for (int y = 0; y < rows; y++) {
+            for (int x = 0; x < w; x++) {
+                int global_y = y0 + y;
+
+                for (int c = 0; c < ch; c++) {
+                    double acc = 0.0;
+
+                    for (int ky = -half; ky <= half; ky++) {
+                        for (int kx = -half; kx <= half; kx++) {
+                            // Global coordinates, clamped to the image
+                            int gx = x + kx;
+                            int gy = global_y + ky;
+
+                            if (gx < 0) gx = 0;
+                            if (gx >= w) gx = w - 1;
+                            if (gy < 0) gy = 0;
+                            if (gy >= global_h) gy = global_h - 1;
+
+                            // The source starts at global row first_row
+                            int src_y = gy - first_row;
+                            if (src_y < 0) src_y = 0;
+                            if (src_y >= src_rows) src_y = src_rows - 1;
+
+                            size_t idx = src_y * pitch + (size_t)gx * ch + c;
+                            int kidx = (ky + half) * ksize + (kx + half);
+
+                            acc += src[idx] * kernel[kidx];
+                        }
+                    }
+
+                    out[((size_t)y * w + x) * ch + c] = clamp255((int)acc);
+                }
+            }
+        }
+        imgf_trace_end();
+    }
+}
+
+void imgf_convolve_band(const unsigned char *extended, unsigned char *out,
+                        int w, int rows, int ch,
+                        const double *kernel, int ksize, int halo,
+                        int y0, int global_h, imgf_backend be)
+{
+    convolve_rows(extended, (size_t)w * ch, y0 - halo, rows + 2 * halo, out,
+                  w, rows, ch, kernel, ksize, y0, global_h, be);
+}
+
+/*******************************************************************************
+ * BAND SOBEL (gradient magnitude of the luma, written to all channels)
+ ******************************************************************************/
+// 0 if the luma plane cannot be allocated
+static int sobel_rows(const unsigned char *src, size_t pitch,
+                      int first_row, int src_rows, unsigned char *out,
+                      int w, int rows, int ch,
+                      int y0, int global_h, imgf_backend be)
+{
+    unsigned char *gray = grayscale_rows(src, pitch, w, src_rows, ch, be);
+    if (!gray) return 0;
+
+    static const int gx[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+    static const int gy[9] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+
+    // One span per thread: its share of the band
+    #pragma omp parallel if(be == IMGF_THREADS)
+    {
+        imgf_trace_begin("sobel band");
+        #pragma omp for collapse(2) nowait
+        for (int y = 0; y < rows; y++) {
+            for (int x = 0; x < w; x++) {
+                int global_y = y0 + y;
+                double sx = 0.0, sy = 0.0;
+
+                for (int ky = -1; ky <= 1; ky++) {
+                    for (int kx = -1; kx <= 1; kx++) {
+                        int gxx = x + kx;
+                        int gyy = global_y + ky;
+
+                        if (gxx < 0) gxx = 0;
+                        if (gxx >= w) gxx = w - 1;
+                        if (gyy < 0) gyy = 0;
+                        if (gyy >= global_h) gyy = global_h - 1;
+
+                        int src_y = gyy - first_row;
+                        if (src_y < 0) src_y = 0;
+                        if (src_y >= src_rows) src_y = src_rows - 1;
+
+                        int val = gray[(size_t)src_y * w + gxx];
+                        int kidx = (ky + 1) * 3 + (kx + 1);
+
+                        sx += val * gx[kidx];
+                        sy += val * gy[kidx];
+                    }
+                }
+
+                int mag = (int)sqrt(sx * sx + sy * sy);
+                if (mag > 255) mag = 255;
+
+                for (int c = 0; c < ch; c++)
+                    out[((size_t)y * w + x) * ch + c] = (unsigned char)mag;
+            }
+        }
+        imgf_trace_end();
+    }
+
+    imgf_buffer_free(gray);
+    return 1;
+}
+
+int imgf_sobel_band(const unsigned char *extended, unsigned char *out,
+                    int w, int rows, int ch, int halo,
+                    int y0, int global_h, imgf_backend be)
+{
+    return sobel_rows(extended, (size_t)w * ch, y0 - halo, rows + 2 * halo, out,
+                      w, rows, ch, y0, global_h, be);
+}
+
+/*******************************************************************************
+ * WHOLE-IMAGE WRAPPERS
+ ******************************************************************************/
+void imgf_convolve(const unsigned char *in, unsigned char *out,
+                   int w, int h, int ch, const double *kernel, int ksize,
+                   imgf_backend be)
+{
+    imgf_convolve_band(in, out, w, h, ch, kernel, ksize, 0, 0, h, be);
+}
+
+int imgf_sobel(const unsigned char *in, unsigned char *out,
+               int w, int h, int ch, imgf_backend be)
+{
+    return imgf_sobel_band(in, out, w, h, ch, 0, 0, h, be);
+}
+
+/*******************************************************************************
+ * FILTER STAGES
+ ******************************************************************************/
+int imgf_stage_init(imgf_stage *st, const char *name, int ksize, double sigma)
+{
+    memset(st, 0, sizeof(*st));
+    if (strlen(name) >= sizeof(st->name)) return 0;
+    strcpy(st->name, name);
+
+    if (strcmp(name, "gaussian") == 0) {
+        // Even sizes have no centre tap
+        if (ksize < 1 || ksize > IMGF_MAX_KSIZE || ksize % 2 == 0 || sigma <= 0.0)
+            return 0;
+        st->ksize = ksize;
+        st->sigma = sigma;
+    }
+    else if (strcmp(name, "sobel") == 0 ||
+             strcmp(name, "laplacian") == 0 ||
+             strcmp(name, "sharpen") == 0) {
+        st->ksize = 3;
+    }
+    else {
+        return 0;
+    }
+
+    st->halo = st->ksize / 2;
+    return 1;
+}
+
+int imgf_parse_chain(const char *spec, imgf_stage *stages, int max_stages)
+{
+    int n = 0;
+    const char *p = spec;
+
+    while (*p) {
+        if (n == max_stages) return 0;
+
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        char item[64];
+        if (len >= sizeof(item)) return 0;
+        memcpy(item, p, len);
+        item[len] = '\0';
+
+        int ksize = 0;
+        double sigma = 0.0;
+        char *colon = strchr(item, ':');
+        if (colon) {
+            *colon = '\0';
+            if (sscanf(colon + 1, "%d:%lf", &ksize, &sigma) != 2) return 0;
+        }
+        if (!imgf_stage_init(&stages[n], item, ksize, sigma)) return 0;
+        n++;
+
+        p += len;
+        if (*p == ',') p++;
+    }
+    return n;
+}
+
+int imgf_parse_filter(const char *mode, const char *ksize_arg,
+                      const char *sigma_arg, imgf_stage *stages,
+                      int max_stages)
+{
+    if (strchr(mode, ',') || strchr(mode, ':'))
+        return imgf_parse_chain(mode, stages, max_stages);
+
+    if (max_stages < 1) return 0;
+    int ksize = ksize_arg ? atoi(ksize_arg) : 0;
+    double sigma = sigma_arg ? atof(sigma_arg) : 0.0;
+    return imgf_stage_init(&stages[0], mode, ksize, sigma);
+}
+
+int imgf_stage_build(imgf_stage *st)
+{
+    st->kernel = NULL;
+
+    if (strcmp(st->name, "gaussian") == 0) {
+        st->kernel = imgf_build_gaussian(st->ksize, st->sigma);
+        return st->kernel != NULL;
+    }
+    else if (strcmp(st->name, "laplacian") == 0) {
+        static const double lap[9] = {0, 1, 0, 1, -4, 1, 0, 1, 0};
+        st->kernel = (double*)imgf_buffer_alloc(9 * sizeof(double));
+        if (!st->kernel) return 0;
+        memcpy(st->kernel, lap, 9 * sizeof(double));
+    }
+    else if (strcmp(st->name, "sharpen") == 0) {
+        static const double sh[9] = {0, -1, 0, -1, 5, -1, 0, -1, 0};
+        st->kernel = (double*)imgf_buffer_alloc(9 * sizeof(double));
+        if (!st->kernel) return 0;
+        memcpy(st->kernel, sh, 9 * sizeof(double));
+    }
+    return 1;
+}
+
+void imgf_stage_free(imgf_stage *st)
+{
+    imgf_buffer_free(st->kernel);
+    st->kernel = NULL;
+}
+
+int imgf_chain_build(imgf_stage *stages, int nstages)
+{
+    for (int s = 0; s < nstages; s++) {
+        if (!imgf_stage_build(&stages[s])) {
+            for (int t = 0; t <= s; t++) imgf_stage_free(&stages[t]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int imgf_chain_halo(const imgf_stage *stages, int nstages)
+{
+    int halo = 0;
+    for (int s = 0; s < nstages; s++)
+        if (stages[s].halo > halo) halo = stages[s].halo;
+    return halo;
+}
+
+int imgf_apply_band(const imgf_stage *st, const unsigned char *extended,
+                    unsigned char *out, int w, int rows, int ch, int halo,
+                    int y0, int global_h, imgf_backend be)
+{
+    return imgf_apply_rows(st, extended, (size_t)w * ch, y0 - halo, rows + 2 * halo,
+                           out, w, rows, ch, y0, global_h, be);
+}
+
+int imgf_apply_rows(const imgf_stage *st, const unsigned char *src,
+                    size_t pitch, int first_row, int src_rows,
+                    unsigned char *out, int w, int rows, int ch,
+                    int y0, int global_h, imgf_backend be)
+{
+    if (rows <= 0) return 1;
+
+    if (strcmp(st->name, "sobel") == 0) {
+        return sobel_rows(src, pitch, first_row, src_rows, out, w, rows, ch,
+                          y0, global_h, be);
+    }
+    convolve_rows(src, pitch, first_row, src_rows, out, w, rows, ch,
+                  st->kernel, st->ksize, y0, global_h, be);
+    return 1;
+}
+
+int imgf_apply_chain(const imgf_stage *stages, int nstages,
+                     const unsigned char *in, unsigned char *out,
+                     int w, int h, int ch, imgf_backend be)
+{
+    return imgf_apply_chain_pitch(stages, nstages, in, (size_t)w * ch, out, w, h, ch, be);
+}
+
+int imgf_apply_chain_pitch(const imgf_stage *stages, int nstages,
+                           const unsigned char *in, size_t pitch,
+                           unsigned char *out, int w, int h, int ch,
+                           imgf_backend be)
+{
+    // A whole image needs no halo rows: the kernels clamp to the image.
+    // Only the first stage reads 'in'; the rest read packed rows
+    size_t bytes = (size_t)w * h * ch;
+    unsigned char *tmp = NULL;
+    if (nstages > 1) {
+        tmp = (unsigned char*)imgf_buffer_alloc(bytes);
+        if (!tmp) return 0;
+    }
+    const unsigned char *src = in;
+    int ok = 1;
+
+    for (int s = 0; s < nstages && ok; s++) {
+        // Alternate so that the last stage lands in 'out'
+        unsigned char *dst = ((nstages - 1 - s) % 2 == 0) ? out : tmp;
+        ok = imgf_apply_rows(&stages[s], src, s == 0 ? pitch : (size_t)w * ch, 0, h,
+                             dst, w, h, ch, 0, h, be);
+        src = dst;
+    }
+
+    imgf_buffer_free(tmp);
+    return ok;
+}
+
+/*******************************************************************************
+ * OUTPUT NAMES
+ ******************************************************************************/
+void imgf_output_path(char *out, size_t size, const char *outdir,
+                      const char *input)
+{
+    const char *name = input;
+    for (const char *p = input; *p; p++)
+        if (*p == '/' || *p == '\\') name = p + 1;
+    const char *dot = strrchr(name, '.');
+    int len = dot && dot != name ? (int)(dot - name) : (int)strlen(name);
+    snprintf(out, size, "%s/%.*s.png", outdir, len, name);
+}
+
+typedef struct {
+    char path[1024];
+    int index;
+} output_name;
+
+static int compare_output_names(const void *a, const void *b)
+{
+    const output_name *x = (const output_name*)a, *y = (const output_name*)b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : x->index - y->index;
+}
+
+int imgf_output_collision(const char *outdir, const char *const *inputs,
+                          int n, int *earlier)
+{
+    if (n < 2) return -1;
+    output_name *names = (output_name*)malloc((size_t)n * sizeof(output_name));
+    if (!names) return -1;
+    for (int i = 0; i < n; i++) {
+        imgf_output_path(names[i].path, sizeof(names[i].path), outdir, inputs[i]);
+        names[i].index = i;
+    }
+
+    // Equal paths end up next to each other, lower index first
+    qsort(names, n, sizeof(output_name), compare_output_names);
+    int found = -1;
+    for (int i = 1; i < n && found < 0; i++) {
+        if (strcmp(names[i - 1].path, names[i].path) == 0) {
+            found = names[i].index;
+            *earlier = names[i - 1].index;
+        }
+    }
+    free(names);
+    return found;
+}
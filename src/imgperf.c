@@ -0,0 +1,198 @@
+#include "imgfilter.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+/*******************************************************************************
+ * HARDWARE PERFORMANCE COUNTERS (perf_event_open, Linux only)
+ *
+ * Each event is opened on its own for the calling thread with 'inherit' set,
+ * so threads created afterwards (the OpenMP pool) are counted too. Events are
+ * read as value/time-enabled/time-running and deltas are scaled by
+ * enabled/running, which corrects for the kernel multiplexing more events
+ * than the PMU has counters.
+ ******************************************************************************/
+
+static const char *counter_names[IMGF_NUM_COUNTERS] = {
+    "cycles", "instructions", "branches", "branch-misses",
+    "L1d-loads", "L1d-misses", "LLC-refs", "LLC-misses",
+    "dTLB-loads", "dTLB-misses"
+};
+
+#ifdef __linux__
+
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+static const struct { unsigned int type; unsigned long long config; }
+counter_events[IMGF_NUM_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+                                      PERF_COUNT_HW_CACHE_OP_READ,
+                                      PERF_COUNT_HW_CACHE_RESULT_ACCESS) },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+                                      PERF_COUNT_HW_CACHE_OP_READ,
+                                      PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+                                      PERF_COUNT_HW_CACHE_OP_READ,
+                                      PERF_COUNT_HW_CACHE_RESULT_ACCESS) },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+                                      PERF_COUNT_HW_CACHE_OP_READ,
+                                      PERF_COUNT_HW_CACHE_RESULT_MISS) }
+};
+
+// Scaled event count, -1 if the read failed
+static double read_scaled(int fd)
+{
+    unsigned long long v[3];   // value, time enabled, time running
+    if (read(fd, v, sizeof(v)) != (ssize_t)sizeof(v)) return -1.0;
+    if (v[2] == 0) return 0.0;
+    return (double)v[0] * ((double)v[1] / (double)v[2]);
+}
+
+int imgf_counters_open(imgf_counters *pc)
+{
+    int opened = 0;
+    memset(pc, 0, sizeof(*pc));
+
+    for (int i = 0; i < IMGF_NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_events[i].type;
+        attr.config = counter_events[i].config;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;   // allowed with perf_event_paranoid <= 2
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        pc->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (pc->fd[i] >= 0) opened++;
+    }
+
+    if (opened == 0) return 0;
+    pc->enabled = 1;
+    return opened;
+}
+
+void imgf_counters_start(imgf_counters *pc)
+{
+    if (!pc->enabled) return;
+    for (int i = 0; i < IMGF_NUM_COUNTERS; i++)
+        if (pc->fd[i] >= 0) pc->start[i] = read_scaled(pc->fd[i]);
+}
+
+void imgf_counters_stop(imgf_counters *pc)
+{
+    if (!pc->enabled) return;
+    for (int i = 0; i < IMGF_NUM_COUNTERS; i++) {
+        if (pc->fd[i] < 0) continue;
+        double now = read_scaled(pc->fd[i]);
+        if (now >= 0.0 && pc->start[i] >= 0.0) pc->value[i] += now - pc->start[i];
+    }
+}
+
+void imgf_counters_close(imgf_counters *pc)
+{
+    if (!pc->enabled) return;
+    for (int i = 0; i < IMGF_NUM_COUNTERS; i++)
+        if (pc->fd[i] >= 0) close(pc->fd[i]);
+    pc->enabled = 0;
+}
+
+#else
+
+int imgf_counters_open(imgf_counters *pc)
+{
+    memset(pc, 0, sizeof(*pc));
+    return 0;
+}
+
+void imgf_counters_start(imgf_counters *pc) { (void)pc; }
+void imgf_counters_stop(imgf_counters *pc) { (void)pc; }
+void imgf_counters_close(imgf_counters *pc) { (void)pc; }
+
+#endif
+
+void imgf_counters_reset(imgf_counters *pc)
+{
+    memset(pc->value, 0, sizeof(pc->value));
+}
+
+int imgf_counter_available(const imgf_counters *pc, int counter)
+{
+    return pc->enabled && pc->fd[counter] >= 0;
+}
+
+static double ratio(const imgf_counters *pc, int num, int den)
+{
+    if (!imgf_counter_available(pc, num) || !imgf_counter_available(pc, den) ||
+        pc->value[den] <= 0.0)
+        return -1.0;
+    return pc->value[num] / pc->value[den];
+}
+
+void imgf_counters_summary(const imgf_counters *pc, double pixels,
+                           imgf_counter_summary *sum)
+{
+    sum->ipc = ratio(pc, IMGF_CNT_INSTRUCTIONS, IMGF_CNT_CYCLES);
+    sum->branch_miss_rate = ratio(pc, IMGF_CNT_BRANCH_MISSES, IMGF_CNT_BRANCHES);
+    sum->l1_miss_rate = ratio(pc, IMGF_CNT_L1D_MISSES, IMGF_CNT_L1D_LOADS);
+    sum->llc_miss_rate = ratio(pc, IMGF_CNT_LLC_MISSES, IMGF_CNT_LLC_REFS);
+    sum->dtlb_miss_rate = ratio(pc, IMGF_CNT_DTLB_MISSES, IMGF_CNT_DTLB_LOADS);
+
+    // Every last-level miss brings in one 64-byte line from DRAM
+    sum->dram_bytes_per_pixel = -1.0;
+    if (imgf_counter_available(pc, IMGF_CNT_LLC_MISSES) && pixels > 0.0)
+        sum->dram_bytes_per_pixel = pc->value[IMGF_CNT_LLC_MISSES] * 64.0 / pixels;
+}
+
+static void print_metric(FILE *fp, const char *name, double v, int percent)
+{
+    if (v < 0.0) fprintf(fp, " %s n/a", name);
+    else if (percent) fprintf(fp, " %s %.2f%%", name, 100.0 * v);
+    else fprintf(fp, " %s %.2f", name, v);
+}
+
+void imgf_counters_print(FILE *fp, const char *label, const imgf_counters *pc,
+                         double pixels)
+{
+    if (!pc->enabled) {
+        fprintf(fp, "%s: hardware counters not available\n", label);
+        return;
+    }
+
+    imgf_counter_summary sum;
+    imgf_counters_summary(pc, pixels, &sum);
+
+    fprintf(fp, "%s:", label);
+    print_metric(fp, "IPC", sum.ipc, 0);
+    print_metric(fp, "L1d miss", sum.l1_miss_rate, 1);
+    print_metric(fp, "LLC miss", sum.llc_miss_rate, 1);
+    print_metric(fp, "branch miss", sum.branch_miss_rate, 1);
+    print_metric(fp, "dTLB miss", sum.dtlb_miss_rate, 1);
+    print_metric(fp, "DRAM bytes/pixel", sum.dram_bytes_per_pixel, 0);
+    fprintf(fp, "\n");
+
+    fprintf(fp, "%*s", (int)strlen(label) + 1, "");
+    for (int i = 0; i < IMGF_NUM_COUNTERS; i++) {
+        if (imgf_counter_available(pc, i))
+            fprintf(fp, " %s=%.0f", counter_names[i], pc->value[i]);
+        else
+            fprintf(fp, " %s=n/a", counter_names[i]);
+    }
+    fprintf(fp, "\n");
+}
@@ -0,0 +1,286 @@
+#include "imgfilter.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+    #include <sys/mman.h>
+#endif
+
+/*******************************************************************************
+ * BUFFER POOL
+ *
+ * Blocks are rounded up to a size class, four classes per power of two from
+ * 256 bytes (at most 25% slack). A freed block goes onto its class's list
+ * instead of back to malloc; the next request of that class takes it. Each
+ * block starts with a header that records its class. One spin lock guards
+ * the lists: a pool operation is a few pointer moves, and requests come per
+ * image or frame, not per pixel. At most POOL_KEEP blocks per class and
+ * POOL_CACHE_BYTES in all are cached; a freed block beyond either limit goes
+ * back to the system, so a run over large images does not keep several of
+ * each large size mapped for the life of the process.
+ *
+ * With huge pages, blocks of HUGE_BYTES and more are mapped on their own.
+ * For THP the data starts on a 2 MiB boundary, so every 2 MiB of the image
+ * can be one huge page, and madvise(MADV_HUGEPAGE) asks the kernel for them
+ * even when THP is set to "madvise". MAP_HUGETLB takes pages reserved in
+ * hugetlbfs (vm.nr_hugepages); when none are left the block falls back to
+ * THP.
+ ******************************************************************************/
+#define POOL_MIN_SHIFT 8      // smallest class: 256 bytes
+#define POOL_CLASSES 160      // up to 2^48 bytes
+#define POOL_KEEP 8           // blocks cached per class
+#define POOL_CACHE_BYTES ((size_t)256 << 20)   // bytes cached over all classes
+#define POOL_HEADER 64        // keeps the data cache-line aligned after the header
+#define POOL_MAGIC 0x504d4749u
+#define PAGE_BYTES 4096
+#define HUGE_BYTES ((size_t)2 << 20)
+
+typedef struct pool_block {
+    struct pool_block *next;  // while cached
+    int cls;
+    unsigned magic;
+    void *map;                // mmap base, NULL for malloc'd blocks
+    size_t map_bytes;
+} pool_block;
+
+static pool_block *free_list[POOL_CLASSES];
+static int free_count[POOL_CLASSES];
+static atomic_flag lock = ATOMIC_FLAG_INIT;
+static int prefault = 0;
+static imgf_page_mode page_mode = IMGF_PAGES_DEFAULT;
+static imgf_pool_stats stats;
+static size_t in_use_bytes;
+
+static void pool_lock(void)
+{
+    while (atomic_flag_test_and_set_explicit(&lock, memory_order_acquire)) { }
+}
+
+static void pool_unlock(void)
+{
+    atomic_flag_clear_explicit(&lock, memory_order_release);
+}
+
+static size_t class_size(int cls)
+{
+    size_t base = (size_t)1 << (POOL_MIN_SHIFT + cls / 4);
+    return base + (base / 4) * (cls % 4);
+}
+
+// Smallest class holding 'bytes'; -1 if too large
+static int size_class(size_t bytes)
+{
+    int cls = 0;
+    // Skip whole powers of two first
+    while (cls + 4 < POOL_CLASSES && class_size(cls + 4) < bytes) cls += 4;
+    while (cls < POOL_CLASSES && class_size(cls) < bytes) cls++;
+    return cls < POOL_CLASSES ? cls : -1;
+}
+
+#ifdef __linux__
+// A block on huge pages, NULL if the mapping fails
+static pool_block* map_block(size_t size, imgf_page_mode mode)
+{
+    if (mode == IMGF_PAGES_HUGETLB) {
+        // Every page is 2 MiB, so the header only has to fit in front
+        size_t len = (POOL_HEADER + size + HUGE_BYTES - 1) & ~(HUGE_BYTES - 1);
+        void *base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            pool_block *b = (pool_block*)base;
+            b->map = base;
+            b->map_bytes = len;
+            return b;
+        }
+    }
+
+    // THP: over-allocate so the data can start on a 2 MiB boundary
+    size_t len = size + HUGE_BYTES + POOL_HEADER;
+    void *base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    uintptr_t data = ((uintptr_t)base + POOL_HEADER + HUGE_BYTES - 1) & ~(uintptr_t)(HUGE_BYTES - 1);
+    size_t advise = (size + PAGE_BYTES - 1) & ~(size_t)(PAGE_BYTES - 1);
+    madvise((void*)data, advise, MADV_HUGEPAGE);
+
+    pool_block *b = (pool_block*)(data - POOL_HEADER);
+    b->map = base;
+    b->map_bytes = len;
+    return b;
+}
+#endif
+
+static void release_block(pool_block *b)
+{
+#ifdef __linux__
+    if (b->map) {
+        munmap(b->map, b->map_bytes);
+        return;
+    }
+#endif
+    free(b);
+}
+
+void* imgf_buffer_alloc(size_t bytes)
+{
+    int cls = size_class(bytes > 0 ? bytes : 1);
+    if (cls < 0) return NULL;
+    size_t size = class_size(cls);
+
+    pool_lock();
+    stats.requests++;
+    pool_block *b = free_list[cls];
+    if (b) {
+        free_list[cls] = b->next;
+        free_count[cls]--;
+        stats.reused++;
+        stats.cached_bytes -= size;
+        in_use_bytes += size;
+    }
+    int touch = prefault;
+    imgf_page_mode mode = page_mode;
+    pool_unlock();
+
+    if (!b) {
+        int huge = 0;
+#ifdef __linux__
+        if (mode != IMGF_PAGES_DEFAULT && size >= HUGE_BYTES) {
+            b = map_block(size, mode);
+            huge = b != NULL;
+        }
+#endif
+        if (!b) {
+            b = (pool_block*)malloc(POOL_HEADER + size);
+            if (!b) return NULL;
+            b->map = NULL;
+        }
+        b->cls = cls;
+        b->magic = POOL_MAGIC;
+
+        // Take the page faults now rather than in the first kernel to write
+        if (touch) {
+            volatile unsigned char *data = (unsigned char*)b + POOL_HEADER;
+            for (size_t i = 0; i < size; i += PAGE_BYTES) data[i] = 0;
+        }
+
+        pool_lock();
+        stats.allocated++;
+        stats.huge += huge;
+        in_use_bytes += size;
+        if (in_use_bytes + stats.cached_bytes > stats.peak_bytes)
+            stats.peak_bytes = in_use_bytes + stats.cached_bytes;
+        pool_unlock();
+    }
+    return (unsigned char*)b + POOL_HEADER;
+}
+
+void imgf_buffer_free(void *p)
+{
+    if (!p) return;
+    pool_block *b = (pool_block*)((unsigned char*)p - POOL_HEADER);
+    if (b->magic != POOL_MAGIC) {
+        fprintf(stderr, "imgf_buffer_free: not a pool buffer\n");
+        abort();
+    }
+    size_t size = class_size(b->cls);
+
+    pool_lock();
+    in_use_bytes -= size;
+    int keep = free_count[b->cls] < POOL_KEEP &&
+               stats.cached_bytes + size <= POOL_CACHE_BYTES;
+    if (keep) {
+        b->next = free_list[b->cls];
+        free_list[b->cls] = b;
+        free_count[b->cls]++;
+        stats.cached_bytes += size;
+    }
+    pool_unlock();
+
+    if (!keep) release_block(b);
+}
+
+void* imgf_buffer_realloc(void *p, size_t bytes)
+{
+    if (!p) return imgf_buffer_alloc(bytes);
+    pool_block *b = (pool_block*)((unsigned char*)p - POOL_HEADER);
+    size_t size = class_size(b->cls);
+    if (bytes <= size) return p;
+
+    void *grown = imgf_buffer_alloc(bytes);
+    if (!grown) return NULL;
+    memcpy(grown, p, size);
+    imgf_buffer_free(p);
+    return grown;
+}
+
+void imgf_pool_pages(imgf_page_mode mode)
+{
+    pool_lock();
+    page_mode = mode;
+    pool_unlock();
+}
+
+int imgf_page_mode_from_name(const char *name, imgf_page_mode *mode)
+{
+    if (strcmp(name, "") == 0 || strcmp(name, "default") == 0) *mode = IMGF_PAGES_DEFAULT;
+    else if (strcmp(name, "thp") == 0) *mode = IMGF_PAGES_THP;
+    else if (strcmp(name, "hugetlb") == 0) *mode = IMGF_PAGES_HUGETLB;
+    else return 0;
+    return 1;
+}
+
+void imgf_pool_prefault(int enable)
+{
+    prefault = enable;
+}
+
+void imgf_pool_trim(void)
+{
+    pool_lock();
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        while (free_list[c]) {
+            pool_block *b = free_list[c];
+            free_list[c] = b->next;
+            release_block(b);
+        }
+        free_count[c] = 0;
+    }
+    stats.cached_bytes = 0;
+    pool_unlock();
+}
+
+void imgf_pool_get_stats(imgf_pool_stats *st)
+{
+    pool_lock();
+    *st = stats;
+    pool_unlock();
+}
+
+void imgf_pool_print(FILE *fp, const char *label)
+{
+    imgf_pool_stats st;
+    imgf_pool_get_stats(&st);
+    fprintf(fp, "%s: %lu buffer request(s), %lu reused (allocations avoided), "
+            "%lu allocated, %.1f MiB peak\n", label, st.requests, st.reused,
+            st.allocated, st.peak_bytes / (1024.0 * 1024.0));
+    if (page_mode == IMGF_PAGES_DEFAULT) return;
+
+    // What the kernel actually gave us: THP in use by the whole process
+    double thp_kb = -1.0;
+#ifdef __linux__
+    FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+    if (smaps) {
+        char line[256];
+        while (fgets(line, sizeof(line), smaps))
+            if (sscanf(line, "AnonHugePages: %lf kB", &thp_kb) == 1) break;
+        fclose(smaps);
+    }
+#endif
+    fprintf(fp, "%*s %lu block(s) mapped for huge pages", (int)strlen(label), "", st.huge);
+    if (thp_kb >= 0.0) fprintf(fp, ", %.1f MiB on transparent huge pages now", thp_kb / 1024.0);
+    fprintf(fp, "\n");
+}
@@ -0,0 +1,248 @@
+#include "imgfilter.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+/*******************************************************************************
+ * RAW IMAGE FILES
+ *
+ * The pixels are stored in units: one row each for row-ordered files, one
+ * row of tiles each for tiled files. Units are a whole number of padded
+ * rows, so a range of image rows is one contiguous range of the file and
+ * can be mapped without touching the rest. The header is written in the
+ * byte order of the machine; a file from the other byte order is refused.
+ ******************************************************************************/
+#define RAW_MAGIC "IMGFRAW1"
+#define RAW_BYTE_ORDER 0x01020304u
+#define RAW_HEADER 4096       // pixel data starts on a page boundary
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t width, height, channels;
+    uint32_t tile;            // 0: rows in order
+    uint64_t pitch;           // bytes per stored row
+    uint64_t data_offset;
+    uint64_t data_bytes;
+} raw_header;
+
+typedef struct {
+    int unit_rows;            // image rows per unit
+    int tiles_x;
+    size_t unit_bytes;
+    int units;
+} raw_layout;
+
+static void layout(const raw_header *hd, raw_layout *lo)
+{
+    lo->unit_rows = hd->tile ? (int)hd->tile : 1;
+    lo->tiles_x = hd->tile ? (int)((hd->width + hd->tile - 1) / hd->tile) : 1;
+    lo->unit_bytes = (size_t)lo->tiles_x * lo->unit_rows * hd->pitch;
+    lo->units = (int)((hd->height + lo->unit_rows - 1) / lo->unit_rows);
+}
+
+static int read_header(FILE *fp, raw_header *hd)
+{
+    if (fread(hd, sizeof(*hd), 1, fp) != 1) return 0;
+    if (memcmp(hd->magic, RAW_MAGIC, 8) != 0 || hd->byte_order != RAW_BYTE_ORDER)
+        return 0;
+    if (hd->width == 0 || hd->height == 0 || hd->channels < 1 || hd->channels > 4)
+        return 0;
+
+    size_t row = (size_t)(hd->tile ? hd->tile : hd->width) * hd->channels;
+    raw_layout lo;
+    layout(hd, &lo);
+    return hd->pitch >= row && hd->data_offset >= sizeof(*hd) &&
+           hd->data_bytes == (uint64_t)lo.units * lo.unit_bytes;
+}
+
+int imgf_raw_info(const char *path, int *w, int *h, int *ch)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    raw_header hd;
+    int ok = read_header(fp, &hd);
+    fclose(fp);
+    if (!ok) return 0;
+    *w = (int)hd.width;
+    *h = (int)hd.height;
+    *ch = (int)hd.channels;
+    return 1;
+}
+
+int imgf_raw_write(const char *path, const unsigned char *pixels,
+                   int w, int h, int ch, int tile)
+{
+    if (w <= 0 || h <= 0 || ch < 1 || ch > 4 || tile < 0) return 0;
+
+    raw_header hd;
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, RAW_MAGIC, 8);
+    hd.byte_order = RAW_BYTE_ORDER;
+    hd.width = w;
+    hd.height = h;
+    hd.channels = ch;
+    hd.tile = tile;
+    size_t row = (size_t)(tile ? tile : w) * ch;
+    hd.pitch = (row + IMGF_RAW_ALIGN - 1) / IMGF_RAW_ALIGN * IMGF_RAW_ALIGN;
+    hd.data_offset = RAW_HEADER;
+    raw_layout lo;
+    layout(&hd, &lo);
+    hd.data_bytes = (uint64_t)lo.units * lo.unit_bytes;
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return 0;
+    unsigned char *unit = (unsigned char*)imgf_buffer_alloc(lo.unit_bytes > RAW_HEADER ?
+                                                            lo.unit_bytes : RAW_HEADER);
+    if (!unit) {
+        fclose(fp);
+        return 0;
+    }
+
+    memset(unit, 0, RAW_HEADER);
+    memcpy(unit, &hd, sizeof(hd));
+    int ok = fwrite(unit, 1, RAW_HEADER, fp) == RAW_HEADER;
+
+    // Padding bytes (row ends, tiles past the right and bottom edges) are 0
+    for (int u = 0; ok && u < lo.units; u++) {
+        memset(unit, 0, lo.unit_bytes);
+        for (int t = 0; t < lo.tiles_x; t++) {
+            int x0 = t * (tile ? tile : w);
+            int cols = tile ? (x0 + tile <= w ? tile : w - x0) : w;
+            for (int r = 0; r < lo.unit_rows; r++) {
+                int y = u * lo.unit_rows + r;
+                if (y >= h) break;
+                memcpy(unit + ((size_t)t * lo.unit_rows + r) * hd.pitch,
+                       pixels + ((size_t)y * w + x0) * ch, (size_t)cols * ch);
+            }
+        }
+        ok = fwrite(unit, 1, lo.unit_bytes, fp) == lo.unit_bytes;
+    }
+
+    imgf_buffer_free(unit);
+    if (fclose(fp) != 0) ok = 0;
+    return ok;
+}
+
+int imgf_raw_map(const char *path, int y0, int rows, imgf_raw *img)
+{
+    memset(img, 0, sizeof(*img));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    raw_header hd;
+    if (!read_header(fp, &hd)) {
+        fclose(fp);
+        return 0;
+    }
+
+    // Whole units around the requested rows
+    raw_layout lo;
+    layout(&hd, &lo);
+    int h = (int)hd.height;
+    if (rows < 0) { y0 = 0; rows = h; }
+    if (y0 < 0) { rows += y0; y0 = 0; }
+    if (y0 + rows > h) rows = h - y0;
+    if (rows <= 0) {
+        fclose(fp);
+        return 0;
+    }
+    int u0 = y0 / lo.unit_rows;
+    int u1 = (y0 + rows + lo.unit_rows - 1) / lo.unit_rows;
+    uint64_t offset = hd.data_offset + (uint64_t)u0 * lo.unit_bytes;
+    size_t bytes = (size_t)(u1 - u0) * lo.unit_bytes;
+
+#ifndef _WIN32
+    // A truncated file would fault inside the filter instead of failing here
+    struct stat st;
+    int fd = fileno(fp);
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < hd.data_offset + hd.data_bytes) {
+        fclose(fp);
+        return 0;
+    }
+
+    // mmap offsets must be page-aligned
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset / page * page;
+    size_t len = bytes + (size_t)(offset - start);
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, (off_t)start);
+    fclose(fp);   // the mapping keeps the file
+    if (map == MAP_FAILED) return 0;
+    #ifdef MADV_WILLNEED
+    // Start reading the range ahead of the first filter pass
+    madvise(map, len, MADV_WILLNEED);
+    #endif
+    img->map = map;
+    img->map_bytes = len;
+    img->pixels = (const unsigned char*)map + (offset - start);
+#else
+    unsigned char *buf = (unsigned char*)imgf_buffer_alloc(bytes);
+    int ok = buf && _fseeki64(fp, (long long)offset, SEEK_SET) == 0 &&
+             fread(buf, 1, bytes, fp) == bytes;
+    fclose(fp);
+    if (!ok) {
+        imgf_buffer_free(buf);
+        return 0;
+    }
+    img->map = buf;
+    img->map_bytes = bytes;
+    img->pixels = buf;
+#endif
+
+    img->w = (int)hd.width;
+    img->h = h;
+    img->ch = (int)hd.channels;
+    img->tile = (int)hd.tile;
+    img->pitch = (size_t)hd.pitch;
+    img->first_row = u0 * lo.unit_rows;
+    img->rows = (u1 * lo.unit_rows < h ? u1 * lo.unit_rows : h) - img->first_row;
+    return 1;
+}
+
+void imgf_raw_unmap(imgf_raw *img)
+{
+    if (!img->map) return;
+#ifndef _WIN32
+    munmap(img->map, img->map_bytes);
+#else
+    imgf_buffer_free(img->map);
+#endif
+    imgf_buffer_free(img->untiled);
+    memset(img, 0, sizeof(*img));
+}
+
+const unsigned char* imgf_raw_rows(imgf_raw *img, size_t *pitch)
+{
+    if (!img->tile) {
+        *pitch = img->pitch;
+        return img->pixels;
+    }
+
+    size_t row_bytes = (size_t)img->w * img->ch;
+    *pitch = row_bytes;
+    if (img->untiled) return img->untiled;
+
+    img->untiled = (unsigned char*)imgf_buffer_alloc(row_bytes * img->rows);
+    if (!img->untiled) return NULL;
+    int tiles_x = (img->w + img->tile - 1) / img->tile;
+    size_t unit_bytes = (size_t)tiles_x * img->tile * img->pitch;
+    for (int r = 0; r < img->rows; r++) {
+        const unsigned char *unit = img->pixels + (size_t)(r / img->tile) * unit_bytes;
+        for (int t = 0; t < tiles_x; t++) {
+            int x0 = t * img->tile;
+            int cols = x0 + img->tile <= img->w ? img->tile : img->w - x0;
+            memcpy(img->untiled + r * row_bytes + (size_t)x0 * img->ch,
+                   unit + ((size_t)t * img->tile + r % img->tile) * img->pitch,
+                   (size_t)cols * img->ch);
+        }
+    }
+    return img->untiled;
+}
@@ -0,0 +1,231 @@
+#include "imgfilter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+    #include <omp.h>
+#else
+    #include <time.h>
+#endif
+
+/*******************************************************************************
+ * THROUGHPUT AND ROOFLINE
+ *
+ * Work per output pixel, per stage:
+ *   convolution  ksize^2 multiply-adds per channel = 2 * ksize^2 * ch FLOP;
+ *                reads ch bytes and writes ch bytes
+ *   sobel        luma (3 mul + 2 add), two 3x3 gradients (2 * 2 * 9),
+ *                magnitude (2 mul + 1 add + sqrt) = 44 FLOP;
+ *                reads ch bytes, writes and reads back the luma byte,
+ *                writes ch bytes
+ * Bytes are the compulsory traffic (each pixel read and written once); the
+ * kernels reuse neighbouring rows from cache, so DRAM traffic above this
+ * means the rows did not stay cached.
+ ******************************************************************************/
+
+static double now_seconds(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+double imgf_chain_flops_per_pixel(const imgf_stage *stages, int nstages, int ch)
+{
+    double flops = 0.0;
+    for (int s = 0; s < nstages; s++) {
+        if (strcmp(stages[s].name, "sobel") == 0)
+            flops += 44.0;
+        else
+            flops += 2.0 * stages[s].ksize * stages[s].ksize * ch;
+    }
+    return flops;
+}
+
+double imgf_chain_bytes_per_pixel(const imgf_stage *stages, int nstages, int ch)
+{
+    double bytes = 0.0;
+    for (int s = 0; s < nstages; s++) {
+        bytes += 2.0 * ch;
+        if (strcmp(stages[s].name, "sobel") == 0) bytes += 2.0;
+    }
+    return bytes;
+}
+
+/*******************************************************************************
+ * MACHINE PEAKS
+ *
+ * Bandwidth: STREAM triad a[i] = b[i] + s * c[i] over arrays much larger than
+ * the last-level cache, counted as 24 bytes per element like STREAM.
+ * Compute: 16 independent multiply-add chains per thread in double precision.
+ * Both are built with the same compiler flags as the kernels, so they give
+ * the roof this build can reach, not the vendor's theoretical peak.
+ * Each figure is the best of several runs.
+ ******************************************************************************/
+#define STREAM_ELEMS (4L * 1024 * 1024)   // 3 x 32 MiB
+#define PEAK_RUNS 5
+
+static double stream_triad(imgf_backend be)
+{
+    double *a = (double*)malloc(STREAM_ELEMS * sizeof(double));
+    double *b = (double*)malloc(STREAM_ELEMS * sizeof(double));
+    double *c = (double*)malloc(STREAM_ELEMS * sizeof(double));
+    if (!a || !b || !c) {
+        free(a);
+        free(b);
+        free(c);
+        return 0.0;
+    }
+
+    // First touch by the threads that use the data (NUMA placement)
+    #pragma omp parallel for schedule(static) if(be == IMGF_THREADS)
+    for (long i = 0; i < STREAM_ELEMS; i++) {
+        a[i] = 0.0;
+        b[i] = 1.0;
+        c[i] = 2.0;
+    }
+
+    double best = 0.0;
+    for (int run = 0; run < PEAK_RUNS; run++) {
+        double t0 = now_seconds();
+        #pragma omp parallel for schedule(static) if(be == IMGF_THREADS)
+        for (long i = 0; i < STREAM_ELEMS; i++)
+            a[i] = b[i] + 3.0 * c[i];
+        double t = now_seconds() - t0;
+
+        double bw = t > 0.0 ? 24.0 * STREAM_ELEMS / t : 0.0;
+        if (bw > best) best = bw;
+    }
+
+    // Keep the stores observable
+    volatile double sink = a[STREAM_ELEMS / 2];
+    (void)sink;
+
+    free(a);
+    free(b);
+    free(c);
+    return best;
+}
+
+static double fma_chains(long iters)
+{
+    // Volatile loads keep the compiler from treating this as a pure function
+    // and hoisting or merging calls out of the timed region
+    static volatile double vx = 0.999999, vy = 1e-7;
+    double acc[16];
+    const double x = vx, y = vy;
+    for (int i = 0; i < 16; i++) acc[i] = i * 1e-3;
+
+    for (long n = 0; n < iters; n++)
+        for (int i = 0; i < 16; i++)
+            acc[i] = acc[i] * x + y;
+
+    double sum = 0.0;
+    for (int i = 0; i < 16; i++) sum += acc[i];
+    return sum;
+}
+
+static double fma_peak(imgf_backend be, int *threads_used)
+{
+    // Size the loop to take roughly 50 ms on one thread
+    long iters = 1 << 16;
+    for (;;) {
+        double t0 = now_seconds();
+        volatile double r = fma_chains(iters);
+        (void)r;
+        if (now_seconds() - t0 > 0.05 || iters > (1L << 30)) break;
+        iters *= 2;
+    }
+
+    double best = 0.0;
+    int threads = 1;
+    for (int run = 0; run < PEAK_RUNS; run++) {
+        double t0 = now_seconds();
+        #pragma omp parallel if(be == IMGF_THREADS)
+        {
+            volatile double r = fma_chains(iters);
+            (void)r;
+            #ifdef _OPENMP
+            #pragma omp single
+            threads = omp_get_num_threads();
+            #endif
+        }
+        double t = now_seconds() - t0;
+
+        double flops = t > 0.0 ? 2.0 * 16.0 * iters * threads / t : 0.0;
+        if (flops > best) best = flops;
+    }
+
+    *threads_used = threads;
+    return best;
+}
+
+void imgf_measure_peaks(imgf_machine_peaks *pk, imgf_backend be)
+{
+    pk->flops = fma_peak(be, &pk->threads);
+    pk->bandwidth = stream_triad(be);
+}
+
+/*******************************************************************************
+ * REPORTING
+ ******************************************************************************/
+void imgf_throughput_print(FILE *fp, const char *label,
+                           const imgf_stage *stages, int nstages,
+                           double pixels, int ch, double seconds)
+{
+    if (seconds <= 0.0) return;
+
+    double fpp = imgf_chain_flops_per_pixel(stages, nstages, ch);
+    double bpp = imgf_chain_bytes_per_pixel(stages, nstages, ch);
+
+    fprintf(fp, "%s: %.2f MPixels/s, %.3f GFLOP/s (%.0f FLOP/pixel), "
+            "%.3f GB/s effective (%.0f bytes/pixel)\n", label,
+            pixels / seconds / 1e6, pixels * fpp / seconds / 1e9, fpp,
+            pixels * bpp / seconds / 1e9, bpp);
+}
+
+// Attainable performance = min(compute peak, intensity * bandwidth)
+static double roof_flops(double intensity, const imgf_machine_peaks *pk)
+{
+    double memory_roof = intensity * pk->bandwidth;
+    return memory_roof < pk->flops ? memory_roof : pk->flops;
+}
+
+double imgf_roof_fraction(const imgf_stage *stages, int nstages,
+                          double pixels, int ch, double seconds,
+                          const imgf_machine_peaks *pk)
+{
+    if (seconds <= 0.0 || pk->flops <= 0.0 || pk->bandwidth <= 0.0) return -1.0;
+
+    double fpp = imgf_chain_flops_per_pixel(stages, nstages, ch);
+    double bpp = imgf_chain_bytes_per_pixel(stages, nstages, ch);
+    return pixels * fpp / seconds / roof_flops(fpp / bpp, pk);
+}
+
+void imgf_roofline_print(FILE *fp, const char *label,
+                         const imgf_stage *stages, int nstages,
+                         double pixels, int ch, double seconds,
+                         const imgf_machine_peaks *pk)
+{
+    double fraction = imgf_roof_fraction(stages, nstages, pixels, ch, seconds, pk);
+    if (fraction < 0.0) return;
+
+    double fpp = imgf_chain_flops_per_pixel(stages, nstages, ch);
+    double bpp = imgf_chain_bytes_per_pixel(stages, nstages, ch);
+    double intensity = fpp / bpp;   // FLOP per byte
+    double roof = roof_flops(intensity, pk);
+
+    fprintf(fp, "%s: peaks %.2f GFLOP/s, %.2f GB/s (%d thread(s)); "
+            "intensity %.2f FLOP/byte -> %s-bound, roof %.2f GFLOP/s, "
+            "achieved %.1f%% of roof (%.1f%% of compute, %.1f%% of bandwidth)\n",
+            label, pk->flops / 1e9, pk->bandwidth / 1e9, pk->threads, intensity,
+            roof < pk->flops ? "memory" : "compute", roof / 1e9,
+            100.0 * fraction, 100.0 * pixels * fpp / seconds / pk->flops,
+            100.0 * pixels * bpp / seconds / pk->bandwidth);
+}
@@ -0,0 +1,175 @@
+#include "imgfilter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*******************************************************************************
+ * SYNTHETIC TEST IMAGES
+ *
+ * Every pixel is a pure function of (x, y, channel, seed), so the image is
+ * the same for any thread count and can be generated in parallel.
+ ******************************************************************************/
+
+// Integer hash of a lattice point (lowbias32 finaliser)
+static inline unsigned int hash3(unsigned int x, unsigned int y, unsigned int seed)
+{
+    unsigned int h = seed * 0x9E3779B9u ^ x * 0x85EBCA6Bu ^ y * 0xC2B2AE35u;
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return h;
+}
+
+// Smoothly interpolated lattice noise in [0, 1]
+static double value_noise(double x, double y, unsigned int seed)
+{
+    unsigned int xi = (unsigned int)x, yi = (unsigned int)y;
+    double fx = x - xi, fy = y - yi;
+    fx = fx * fx * (3.0 - 2.0 * fx);
+    fy = fy * fy * (3.0 - 2.0 * fy);
+
+    double v00 = hash3(xi,     yi,     seed) * (1.0 / 4294967295.0);
+    double v10 = hash3(xi + 1, yi,     seed) * (1.0 / 4294967295.0);
+    double v01 = hash3(xi,     yi + 1, seed) * (1.0 / 4294967295.0);
+    double v11 = hash3(xi + 1, yi + 1, seed) * (1.0 / 4294967295.0);
+
+    double top = v00 + (v10 - v00) * fx;
+    double bottom = v01 + (v11 - v01) * fx;
+    return top + (bottom - top) * fy;
+}
+
+// Fractal Brownian motion: octaves of value noise, 1/f-like spectrum
+static double fbm(double x, double y, int octaves, unsigned int seed)
+{
+    double sum = 0.0, amp = 0.5, norm = 0.0;
+    for (int o = 0; o < octaves; o++) {
+        sum += amp * value_noise(x, y, seed + o * 1013u);
+        norm += amp;
+        x *= 2.0;
+        y *= 2.0;
+        amp *= 0.5;
+    }
+    return sum / norm;
+}
+
+static inline unsigned char to_byte(double v)
+{
+    if (v <= 0.0) return 0;
+    if (v >= 1.0) return 255;
+    return (unsigned char)(v * 255.0 + 0.5);
+}
+
+static void synth_row(unsigned char *row, imgf_pattern pattern, int y,
+                      int w, int h, int ch, unsigned int seed)
+{
+    for (int x = 0; x < w; x++) {
+        unsigned char *px = row + (size_t)x * ch;
+
+        switch (pattern) {
+        case IMGF_PATTERN_NOISE:
+            for (int c = 0; c < ch; c++)
+                px[c] = (unsigned char)hash3(x * ch + c, y, seed);
+            break;
+
+        case IMGF_PATTERN_GRADIENT: {
+            // Horizontal, vertical and diagonal ramps, cycling over channels
+            double gx = w > 1 ? (double)x / (w - 1) : 0.0;
+            double gy = h > 1 ? (double)y / (h - 1) : 0.0;
+            double ramps[3] = { gx, gy, 0.5 * (gx + gy) };
+            for (int c = 0; c < ch; c++)
+                px[c] = to_byte(ramps[c % 3]);
+            break;
+        }
+
+        case IMGF_PATTERN_EDGES: {
+            // 32-pixel checkerboard, a ring and a diagonal line: hard edges
+            // in every direction
+            int checker = ((x >> 5) ^ (y >> 5)) & 1;
+            double dx = x - 0.5 * w, dy = y - 0.5 * h;
+            double r = sqrt(dx * dx + dy * dy);
+            double rmax = 0.35 * (w < h ? w : h);
+            int ring = r < rmax && r > 0.6 * rmax;
+            int line = abs(x - y) < 2;
+            int v = checker ? 200 : 40;
+            if (ring) v = 255 - v;
+            if (line) v = 255;
+            for (int c = 0; c < ch; c++)
+                px[c] = (unsigned char)(c == 1 ? 255 - v : v);
+            break;
+        }
+
+        case IMGF_PATTERN_FRACTAL:
+        default: {
+            // Luminance detail from 7 octaves, plus a low-frequency tint per
+            // channel so colours vary slowly like in a photograph
+            double scale = 1.0 / 256.0;
+            double lum = fbm(x * scale, y * scale, 7, seed);
+            for (int c = 0; c < ch; c++) {
+                double tint = value_noise(x * scale * 0.5, y * scale * 0.5,
+                                          seed + 7919u * (c + 1));
+                px[c] = to_byte(0.8 * lum + 0.4 * tint - 0.1);
+            }
+            break;
+        }
+        }
+    }
+}
+
+unsigned char* imgf_synthesize(imgf_pattern pattern, int w, int h, int ch,
+                               unsigned int seed, imgf_backend be)
+{
+    if (w < 1 || h < 1 || ch < 1 || ch > 4) return NULL;
+
+    size_t row_bytes = (size_t)w * ch;
+    unsigned char *img = (unsigned char*)imgf_buffer_alloc(row_bytes * h);
+    if (!img) return NULL;
+
+    #pragma omp parallel for schedule(dynamic, 16) if(be == IMGF_THREADS)
+    for (int y = 0; y < h; y++)
+        synth_row(img + row_bytes * y, pattern, y, w, h, ch, seed);
+
+    return img;
+}
+
+int imgf_pattern_from_name(const char *name, imgf_pattern *pattern)
+{
+    static const char *names[] = { "noise", "gradient", "edges", "fractal" };
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *pattern = (imgf_pattern)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int imgf_parse_synth(const char *spec, imgf_pattern *pattern,
+                     int *w, int *h, int *ch, unsigned int *seed)
+{
+    char name[16];
+    int n = 0;
+
+    if (strncmp(spec, "synth:", 6) != 0) return 0;
+    if (sscanf(spec + 6, "%15[a-z]:%dx%d%n", name, w, h, &n) != 3) return 0;
+    if (!imgf_pattern_from_name(name, pattern)) return 0;
+
+    const char *p = spec + 6 + n;
+    *ch = 3;
+    *seed = 1;
+    if (*p == 'x') {
+        int used = 0;
+        if (sscanf(p + 1, "%d%n", ch, &used) != 1) return 0;
+        p += 1 + used;
+    }
+    if (*p == ':') {
+        int used = 0;
+        if (sscanf(p + 1, "%u%n", seed, &used) != 1) return 0;
+        p += 1 + used;
+    }
+
+    return *p == '\0' && *w > 0 && *h > 0 && *ch >= 1 && *ch <= 4;
+}
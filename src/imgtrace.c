@@ -0,0 +1,210 @@
+#include "imgfilter.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+    #include <omp.h>
+#else
+    #include <time.h>
+#endif
+
+/*******************************************************************************
+ * TIMELINE TRACING (Chrome trace event format)
+ *
+ * Every thread records into its own ring buffer, reached through a
+ * thread-local pointer, so begin/end take no lock and touch no shared cache
+ * line. A buffer is linked into a global list with one compare-and-swap the
+ * first time its thread records an event. When a ring is full the oldest
+ * events are overwritten. Spans are stored as complete ("X") events when they
+ * end, so an overwritten span never leaves an unmatched begin or end.
+ ******************************************************************************/
+#define TRACE_RING 65536   // events kept per thread
+#define TRACE_DEPTH 32     // nesting depth of open spans per thread
+
+typedef struct {
+    const char *name;
+    double ts;    // microseconds since imgf_trace_start()
+    double dur;
+} trace_event;
+
+typedef struct trace_buffer {
+    struct trace_buffer *next;
+    int tid;
+    unsigned long count;   // events recorded; the ring holds the last TRACE_RING
+    int depth;
+    const char *open_name[TRACE_DEPTH];
+    double open_ts[TRACE_DEPTH];
+    trace_event events[TRACE_RING];
+} trace_buffer;
+
+static _Atomic(trace_buffer*) buffers = NULL;
+static atomic_int next_tid = 0;
+static volatile int active = 0;
+static int trace_pid = 0;
+static char process_name[64];
+static double epoch = 0.0;
+static _Thread_local trace_buffer *mine = NULL;
+
+static double now_us(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime() * 1e6;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+#endif
+}
+
+// This thread's buffer, created and published on first use; NULL if out of memory
+static trace_buffer* thread_buffer(void)
+{
+    if (mine) return mine;
+
+    trace_buffer *b = (trace_buffer*)calloc(1, sizeof(trace_buffer));
+    if (!b) return NULL;
+    b->tid = atomic_fetch_add(&next_tid, 1);
+
+    trace_buffer *head = atomic_load(&buffers);
+    do {
+        b->next = head;
+    } while (!atomic_compare_exchange_weak(&buffers, &head, b));
+
+    mine = b;
+    return b;
+}
+
+void imgf_trace_start(int pid, const char *name)
+{
+    trace_pid = pid;
+    snprintf(process_name, sizeof(process_name), "%s", name);
+    epoch = now_us();
+    active = 1;
+}
+
+int imgf_trace_active(void)
+{
+    return active;
+}
+
+void imgf_trace_begin(const char *name)
+{
+    if (!active) return;
+    trace_buffer *b = thread_buffer();
+    if (!b) return;
+
+    // Spans nested deeper than TRACE_DEPTH are counted but not recorded
+    if (b->depth < TRACE_DEPTH) {
+        b->open_name[b->depth] = name;
+        b->open_ts[b->depth] = now_us() - epoch;
+    }
+    b->depth++;
+}
+
+void imgf_trace_end(void)
+{
+    if (!active) return;
+    trace_buffer *b = mine;
+    if (!b || b->depth == 0) return;
+
+    b->depth--;
+    if (b->depth >= TRACE_DEPTH) return;
+
+    trace_event *e = &b->events[b->count % TRACE_RING];
+    e->name = b->open_name[b->depth];
+    e->ts = b->open_ts[b->depth];
+    e->dur = now_us() - epoch - e->ts;
+    b->count++;
+}
+
+/*******************************************************************************
+ * SERIALISATION
+ ******************************************************************************/
+typedef struct {
+    char *data;
+    size_t len, cap;
+    int failed;
+} text_buffer;
+
+static void append(text_buffer *t, const char *fmt, ...)
+{
+    if (t->failed) return;
+
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(t->data + t->len, t->cap - t->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            t->failed = 1;
+            return;
+        }
+        if (t->len + n < t->cap) {
+            t->len += n;
+            return;
+        }
+
+        size_t cap = 2 * t->cap + n + 1;
+        char *grown = (char*)realloc(t->data, cap);
+        if (!grown) {
+            t->failed = 1;
+            return;
+        }
+        t->data = grown;
+        t->cap = cap;
+    }
+}
+
+char* imgf_trace_events(size_t *len)
+{
+    text_buffer t = { (char*)malloc(4096), 0, 4096, 0 };
+    if (!t.data) return NULL;
+    t.data[0] = '\0';
+
+    append(&t, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+           "\"args\": {\"name\": \"%s\"}}", trace_pid, process_name);
+
+    for (trace_buffer *b = atomic_load(&buffers); b; b = b->next) {
+        append(&t, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+               "\"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+               trace_pid, b->tid, b->tid);
+
+        unsigned long n = b->count < TRACE_RING ? b->count : TRACE_RING;
+        for (unsigned long i = b->count - n; i < b->count; i++) {
+            const trace_event *e = &b->events[i % TRACE_RING];
+            append(&t, ",\n{\"name\": \"%s\", \"cat\": \"imgf\", \"ph\": \"X\", "
+                   "\"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                   e->name, trace_pid, b->tid, e->ts, e->dur);
+        }
+    }
+
+    if (t.failed) {
+        free(t.data);
+        return NULL;
+    }
+    *len = t.len;
+    return t.data;
+}
+
+int imgf_trace_write_events(const char *path, const char *events)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) return 0;
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n%s\n]}\n", events);
+    return fclose(fp) == 0;
+}
+
+int imgf_trace_write(const char *path)
+{
+    size_t len;
+    char *events = imgf_trace_events(&len);
+    if (!events) return 0;
+
+    int ok = imgf_trace_write_events(path, events);
+    free(events);
+    return ok;
+}
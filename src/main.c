@@ -1,6 +1,13 @@
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
+#include "imgfilter.h"
+
+// Decoded images come from the libimgfilter pool as well, so --hugepages
+// covers the input buffer and not just the output
+#define STBI_MALLOC(sz) imgf_buffer_alloc(sz)
+#define STBI_REALLOC(p, newsz) imgf_buffer_realloc(p, newsz)
+#define STBI_FREE(p) imgf_buffer_free(p)
 #include "stb_image.h"
 #include "stb_image_write.h"
 
@@ -8,190 +15,170 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 
-static inline unsigned char clamp255(int v) {
-    if(v < 0) return 0;
-    if(v > 255) return 255;
-    return (unsigned char)v;
+// "--name" or "--name=value", but not "--namefoo"
+static int is_option(const char *arg, const char *name)
+{
+    size_t n = strlen(name);
+    return strncmp(arg, name, n)==0 && (arg[n] == '\0' || arg[n] == '=');
 }
 
-// Laplacian+Sharpen filter
-void convolve_rgb(unsigned char *in, unsigned char *out,
-                  int w, int h, int channels,
-                  double *kernel, int ksize)
+int main(int argc, char **argv)
 {
-    int half = ksize / 2;
-
-    for(int y = 0; y < h; y++) {
-        for(int x = 0; x < w; x++) {
-            for(int c = 0; c < channels; c++) {
-
-                double acc = 0.0;
-
-                for(int ky = -half; ky <= half; ky++) {
-                    for(int kx = -half; kx <= half; kx++) {
-
-                        int xx = x + kx;
-                        int yy = y + ky;
-
-                        if(xx < 0) xx = 0;
-                        if(xx >= w) xx = w-1;
-                        if(yy < 0) yy = 0;
-                        if(yy >= h) yy = h-1;
-
-                        int idx = (yy * w + xx) * channels + c;
-                        int kidx = (ky + half)*ksize + (kx + half);
-
-                        acc += in[idx] * kernel[kidx];
-                    }
-                }
-
-                int out_index = (y * w + x) * channels + c;
-                out[out_index] = clamp255((int)acc);
-            }
+    // --counters / --roofline / --prefault / --hugepages[=thp|hugetlb] /
+    // --trace=FILE may appear anywhere; drop them from the positional arguments
+    int use_counters = 0, use_roofline = 0, use_prefault = 0;
+    const char *trace_path = NULL, *pages_arg = NULL;
+    for(int i=1; i<argc; i++) {
+        int *flag = strcmp(argv[i], "--counters")==0 ? &use_counters :
+                    strcmp(argv[i], "--roofline")==0 ? &use_roofline :
+                    strcmp(argv[i], "--prefault")==0 ? &use_prefault : NULL;
+        if(flag || strncmp(argv[i], "--trace=", 8)==0 || is_option(argv[i], "--hugepages")) {
+            if(flag) *flag = 1;
+            else if(argv[i][2] == 't') trace_path = argv[i] + 8;
+            else pages_arg = argv[i] + 11;
+            memmove(&argv[i], &argv[i+1], (argc-i) * sizeof(char*));
+            argc--;
+            i--;
         }
     }
-}
 
-// Used for Sobel
-unsigned char* to_grayscale(unsigned char *img, int w, int h, int ch) {
-    unsigned char *g = malloc(w * h);
-    for(int i=0;i<w*h;i++) {
-        int r = img[i*ch + 0];
-        int g1 = img[i*ch + 1];
-        int b = img[i*ch + 2];
-
-        g[i] = (unsigned char)(0.299*r + 0.587*g1 + 0.114*b);
+    if(argc < 4) {
+        printf("Usage: %s input.png output.png [sobel|gaussian|laplacian|sharpen] [params] [--counters] [--roofline] [--prefault] [--hugepages[=thp|hugetlb]] [--trace=FILE]\n", argv[0]);
+        printf("       %s input.png output.png stage,stage,...   (e.g. gaussian:5:1.0,sobel) [--counters] [--roofline] [--prefault] [--hugepages[=thp|hugetlb]] [--trace=FILE]\n", argv[0]);
+        return 1;
     }
-    return g;
-}
 
-// Sobel filter
-void sobel(unsigned char *img, unsigned char *out, int w, int h, int ch)
-{
-    unsigned char *g = to_grayscale(img, w, h, ch);
-
-    int gx[9] = {-1,0,1,-2,0,2,-1,0,1};
-    int gy[9] = {-1,-2,-1,0,0,0,1,2,1};
-
-    for(int y=0; y<h; y++) {
-        for(int x=0; x<w; x++) {
-            double sx=0, sy=0;
-
-            for(int ky=-1; ky<=1; ky++) {
-                for(int kx=-1; kx<=1; kx++) {
-                    int xx = x + kx;
-                    int yy = y + ky;
-
-                    if(xx<0) xx=0;
-                    if(xx>=w) xx=w-1;
-                    if(yy<0) yy=0;
-                    if(yy>=h) yy=h-1;
-
-                    int val = g[yy*w + xx];
-                    int idx = (ky+1)*3 + (kx+1);
-
-                    sx += val * gx[idx];
-                    sy += val * gy[idx];
-                }
-            }
-
-            int mag = (int)sqrt(sx*sx + sy*sy);
-            if(mag > 255) mag = 255;
+    char *infile = argv[1];
+    char *outfile = argv[2];
+    char *mode = argv[3];
 
-            // write as grayscale PNG (all channels equal)
-            for(int c=0;c<ch;c++)
-                out[(y*w + x)*ch + c] = (unsigned char)mag;
-        }
+    if(strcmp(mode,"gaussian")==0 && argc < 6) {
+        printf("Usage: gaussian ksize sigma\n");
+        return 1;
     }
 
-    free(g);
-}
-
-// Gaussian filter
-double* build_gaussian(int ksize, double sigma) {
-    double *k = malloc(ksize * ksize * sizeof(double));
-    int half = ksize/2;
-    double sum = 0.0;
-
-    for(int y=-half;y<=half;y++){
-        for(int x=-half;x<=half;x++){
-            double v = exp(-(x*x + y*y)/(2*sigma*sigma));
-            k[(y+half)*ksize + (x+half)] = v;
-            sum += v;
-        }
+    imgf_stage stages[IMGF_MAX_STAGES];
+    int nstages = imgf_parse_filter(mode, argc > 4 ? argv[4] : NULL,
+                                    argc > 5 ? argv[5] : NULL,
+                                    stages, IMGF_MAX_STAGES);
+    if(nstages == 0) {
+        printf("Unknown mode.\n");
+        return 1;
     }
-    // Normalize
-    for(int i=0;i<ksize*ksize;i++) k[i] /= sum;
-
-    return k;
-}
 
-int main(int argc, char **argv)
-{
-    if(argc < 4) {
-        printf("Usage: %s input.png output.png [sobel|gaussian|laplacian|sharpen] [params]\n", argv[0]);
+    // Hardware counters around the filter call (--counters)
+    imgf_counters counters = {0};
+    if(use_counters && !imgf_counters_open(&counters))
+        printf("Hardware counters not available on this system.\n");
+
+    // Image and scratch buffers come from the libimgfilter pool (--prefault
+    // touches their pages when they are first allocated, --hugepages puts
+    // the large ones on 2 MiB pages)
+    imgf_page_mode pages = IMGF_PAGES_DEFAULT;
+    if(pages_arg && !imgf_page_mode_from_name(*pages_arg == '=' ? pages_arg + 1 : "thp", &pages)) {
+        printf("Unknown page mode %s (thp or hugetlb)\n", pages_arg + 1);
         return 1;
     }
-
-    char *infile = argv[1];
-    char *outfile = argv[2];
-    char *mode = argv[3];
+    imgf_pool_prefault(use_prefault);
+    imgf_pool_pages(pages);
 
     int w, h, ch;
 
+    // Timeline of load, filter bands and write (--trace)
+    if(trace_path) imgf_trace_start(0, "image_filter_serial");
+
     double start = omp_get_wtime();
-    unsigned char *img = stbi_load(infile, &w, &h, &ch, 3);
+
+    // A raw image (.imgf, written by raw_convert) is mapped, not decoded:
+    // the filter reads its rows straight from the page cache
+    imgf_raw raw;
+    unsigned char *decoded = NULL;
+    const unsigned char *img = NULL;
+    size_t pitch = 0;
+    imgf_trace_begin("imgf_raw_map");
+    int mapped = imgf_raw_map(infile, 0, -1, &raw);
+    imgf_trace_end();
+    if(mapped) {
+        w = raw.w;
+        h = raw.h;
+        ch = raw.ch;
+        img = imgf_raw_rows(&raw, &pitch);
+        printf("Mapped %s: %d x %d, %d channels, no decode\n", infile, w, h, ch);
+    }
+    else {
+        imgf_trace_begin("stbi_load");
+        decoded = stbi_load(infile, &w, &h, &ch, 3);
+        imgf_trace_end();
+        ch = 3; // force RGB
+        img = decoded;
+        pitch = (size_t)w * ch;
+    }
     if(!img) {
         printf("Error loading image.\n");
+        imgf_raw_unmap(&raw);
         return 1;
     }
 
-    ch = 3; // force RGB
-    unsigned char *out = malloc(w*h*ch);
+    unsigned char *out = imgf_buffer_alloc((size_t)w*h*ch);
 
-    if(strcmp(mode,"sobel")==0) {
-        sobel(img, out, w, h, ch);
-    }
-    else if(strcmp(mode,"gaussian")==0) {
-        if(argc < 6) {
-            printf("Usage: gaussian ksize sigma\n");
-            return 1;
-        }
-        int ksize = atoi(argv[4]);
-        double sigma = atof(argv[5]);
-
-        double *g = build_gaussian(ksize, sigma);
-        convolve_rgb(img, out, w, h, ch, g, ksize);
-        free(g);
-    }
-    else if(strcmp(mode,"laplacian")==0) {
-        double lap[9] = {0,1,0,
-                         1,-4,1,
-                         0,1,0};
-        convolve_rgb(img, out, w, h, ch, lap, 3);
-    }
-    else if(strcmp(mode,"sharpen")==0) {
-        double sh[9] = {0,-1,0,
-                        -1,5,-1,
-                        0,-1,0};
-        convolve_rgb(img, out, w, h, ch, sh, 3);
+    if(!imgf_chain_build(stages, nstages)) {
+        printf("Cannot allocate the filter kernels\n");
+        stbi_image_free(decoded);
+        imgf_raw_unmap(&raw);
+        imgf_buffer_free(out);
+        return 1;
     }
-    else {
-        printf("Unknown mode.\n");
+    imgf_counters_start(&counters);
+    double filter_start = omp_get_wtime();
+    imgf_trace_begin("filter");
+    int filtered = imgf_apply_chain_pitch(stages, nstages, img, pitch, out, w, h, ch, IMGF_SERIAL);
+    imgf_trace_end();
+    double filter_time = omp_get_wtime() - filter_start;
+    imgf_counters_stop(&counters);
+    for(int s=0; s<nstages; s++) imgf_stage_free(&stages[s]);
+    if(!filtered) {
+        printf("Out of memory while filtering\n");
+        stbi_image_free(decoded);
+        imgf_raw_unmap(&raw);
+        imgf_buffer_free(out);
         return 1;
     }
+
      /* ----------- END TIMER ----------- */
     double end = omp_get_wtime();
 
     printf("Execution time: %.6f seconds\n", end - start);
 
+    if(counters.enabled) {
+        imgf_counters_print(stdout, "Counters", &counters, (double)w * h * nstages);
+        imgf_counters_close(&counters);
+    }
+
+    // Filter throughput, and against the machine peaks (--roofline)
+    imgf_throughput_print(stdout, "Throughput", stages, nstages,
+                          (double)w * h, ch, filter_time);
+    if(use_roofline) {
+        imgf_machine_peaks peaks;
+        imgf_measure_peaks(&peaks, IMGF_SERIAL);
+        imgf_roofline_print(stdout, "Roofline", stages, nstages,
+                            (double)w * h, ch, filter_time, &peaks);
+    }
+    imgf_pool_print(stdout, "Buffers");
+
     // Write PNG
+    imgf_trace_begin("stbi_write_png");
     stbi_write_png(outfile, w, h, ch, out, w*ch);
+    imgf_trace_end();
+
+    if(trace_path) {
+        if(imgf_trace_write(trace_path)) printf("Trace written to %s\n", trace_path);
+        else printf("Could not write trace %s\n", trace_path);
+    }
 
-    free(img);
-    free(out);
+    stbi_image_free(decoded);
+    imgf_raw_unmap(&raw);
+    imgf_buffer_free(out);
 
     return 0;
 }
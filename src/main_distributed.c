@@ -1,176 +1,2325 @@
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
+#include "imgfilter.h"
+
+// Decoded images come from the libimgfilter pool as well, so --hugepages
+// covers the input buffers and not just the bands and output
+#define STBI_MALLOC(sz) imgf_buffer_alloc(sz)
+#define STBI_REALLOC(p, newsz) imgf_buffer_realloc(p, newsz)
+#define STBI_FREE(p) imgf_buffer_free(p)
 #include "stb_image.h"
 #include "stb_image_write.h"
 
-#include <mpi.h>  // Requires MPI installation (e.g., OpenMPI, MPICH)
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <math.h>
+#include <mpi.h>  // Requires MPI installation (e.g., OpenMPI, MPICH)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <dirent.h>
+#endif
+
+/*******************************************************************************
+ * COMMAND-LINE OPTIONS
+ *
+ * Optional switches ("--name" or "--name=value") may appear anywhere after
+ * the program name. They are removed from argv so the positional arguments
+ * keep their usual meaning.
+ ******************************************************************************/
+static int take_flag(int *argc, char **argv, const char *name)
+{
+    for (int i = 1; i < *argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0 && strcmp(argv[i] + 2, name) == 0) {
+            memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(char*));
+            (*argc)--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const char* take_option(int *argc, char **argv, const char *name)
+{
+    size_t n = strlen(name);
+    for (int i = 1; i < *argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0 && strncmp(argv[i] + 2, name, n) == 0 &&
+            argv[i][2 + n] == '=') {
+            const char *value = argv[i] + 3 + n;
+            memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(char*));
+            (*argc)--;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * STREAMING PNG WRITER
+ *
+ * Writes a PNG band by band so the full image never has to sit in memory.
+ * Each call emits one IDAT chunk holding the rows as stored (uncompressed)
+ * deflate blocks, so encoding is a straight copy; the file is larger than a
+ * compressed PNG but any PNG reader accepts it.
+ ******************************************************************************/
+typedef struct {
+    FILE *fp;
+    int w, ch;
+    int rows_left;           // rows still to be written
+    int first;               // zlib header not written yet
+    unsigned long crc;       // CRC-32 of the chunk being written
+    unsigned long adler_a;   // Adler-32 of the uncompressed stream
+    unsigned long adler_b;
+} png_stream;
+
+static unsigned long crc_table[256];
+
+static void crc_init(void)
+{
+    for (unsigned long n = 0; n < 256; n++) {
+        unsigned long c = n;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+static void png_put(png_stream *ps, const unsigned char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        ps->crc = crc_table[(ps->crc ^ buf[i]) & 0xff] ^ (ps->crc >> 8);
+    fwrite(buf, 1, len, ps->fp);
+}
+
+// Uncompressed payload: feeds the Adler-32 checksum as well as the CRC
+static void png_put_data(png_stream *ps, const unsigned char *buf, size_t len)
+{
+    unsigned long a = ps->adler_a, b = ps->adler_b;
+    for (size_t i = 0; i < len; i++) {
+        a = (a + buf[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    ps->adler_a = a;
+    ps->adler_b = b;
+    png_put(ps, buf, len);
+}
+
+static void png_be32(unsigned char *p, unsigned long v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void png_chunk_begin(png_stream *ps, unsigned long len, const char *type)
+{
+    unsigned char hdr[4];
+    png_be32(hdr, len);
+    fwrite(hdr, 1, 4, ps->fp);
+    ps->crc = 0xffffffffUL;
+    png_put(ps, (const unsigned char*)type, 4);
+}
+
+static void png_chunk_end(png_stream *ps)
+{
+    unsigned char c[4];
+    png_be32(c, ps->crc ^ 0xffffffffUL);
+    fwrite(c, 1, 4, ps->fp);
+}
+
+static int png_stream_open(png_stream *ps, const char *path, int w, int h, int ch)
+{
+    static const unsigned char sig[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+    static const unsigned char color_type[5] = {0, 0, 4, 2, 6};
+
+    if (crc_table[1] == 0) crc_init();
+
+    ps->fp = fopen(path, "wb");
+    if (!ps->fp) return 0;
+    ps->w = w;
+    ps->ch = ch;
+    ps->rows_left = h;
+    ps->first = 1;
+    ps->adler_a = 1;
+    ps->adler_b = 0;
+
+    fwrite(sig, 1, 8, ps->fp);
+
+    unsigned char ihdr[13];
+    png_be32(ihdr, w);
+    png_be32(ihdr + 4, h);
+    ihdr[8] = 8;                  // bit depth
+    ihdr[9] = color_type[ch];
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    png_chunk_begin(ps, 13, "IHDR");
+    png_put(ps, ihdr, 13);
+    png_chunk_end(ps);
+    return 1;
+}
+
+static void png_stream_rows(png_stream *ps, const unsigned char *rows, int nrows)
+{
+    if (nrows <= 0) return;
+
+    size_t line = (size_t)ps->w * ps->ch + 1;   // filter byte + pixels
+
+    // Keep every chunk well below the 2^31 byte PNG chunk limit
+    int max_rows = (int)((1UL << 30) / line);
+    if (max_rows < 1) max_rows = 1;
+    while (nrows > max_rows) {
+        png_stream_rows(ps, rows, max_rows);
+        rows += (size_t)max_rows * (line - 1);
+        nrows -= max_rows;
+    }
+    size_t raw = line * nrows;
+    size_t blocks = (raw + 65534) / 65535;
+    int last = (nrows >= ps->rows_left);
+
+    unsigned long len = (unsigned long)(raw + 5 * blocks);
+    if (ps->first) len += 2;
+    if (last) len += 4;
+
+    png_chunk_begin(ps, len, "IDAT");
+
+    if (ps->first) {
+        static const unsigned char zhdr[2] = {0x78, 0x01};
+        png_put(ps, zhdr, 2);
+        ps->first = 0;
+    }
+
+    // Walk the virtual stream of scanlines (filter byte 0 + row) in blocks
+    int r = 0;
+    size_t col = 0;    // 0 = filter byte, 1..line-1 = pixel bytes
+    size_t left = raw;
+    while (left > 0) {
+        size_t n = left < 65535 ? left : 65535;
+        unsigned char bh[5];
+        bh[0] = (last && n == left) ? 1 : 0;    // BFINAL, BTYPE=00
+        bh[1] = (unsigned char)(n & 0xff);
+        bh[2] = (unsigned char)(n >> 8);
+        bh[3] = (unsigned char)(~n & 0xff);
+        bh[4] = (unsigned char)((~n >> 8) & 0xff);
+        png_put(ps, bh, 5);
+
+        size_t todo = n;
+        while (todo > 0) {
+            if (col == 0) {
+                static const unsigned char none = 0;
+                png_put_data(ps, &none, 1);
+                col = 1;
+                todo--;
+                continue;
+            }
+            size_t span = line - col;
+            if (span > todo) span = todo;
+            png_put_data(ps, rows + (size_t)r * (line - 1) + (col - 1), span);
+            col += span;
+            todo -= span;
+            if (col == line) {
+                col = 0;
+                r++;
+            }
+        }
+        left -= n;
+    }
+
+    if (last) {
+        unsigned char ad[4];
+        png_be32(ad, (ps->adler_b << 16) | ps->adler_a);
+        png_put(ps, ad, 4);
+    }
+    png_chunk_end(ps);
+    ps->rows_left -= nrows;
+}
+
+static void png_stream_close(png_stream *ps)
+{
+    png_chunk_begin(ps, 0, "IEND");
+    png_chunk_end(ps);
+    fclose(ps->fp);
+}
+
+/*******************************************************************************
+ * BAND COMPRESSION
+ *
+ * Optional lossless compression of the pixel rows sent over the network.
+ * Rows first go through a per-row horizontal delta (each byte minus the same
+ * channel of the pixel to its left), which turns smooth areas and flat
+ * filter output into runs of small values. A small LZ77 coder in the style
+ * of LZ4 then packs the result:
+ *
+ *   sequence = token | [literal length bytes] | literals |
+ *              offset (2 bytes LE) | [match length bytes]
+ *
+ * The token's high nibble is the literal count and the low nibble the match
+ * length minus 4; a nibble of 15 continues in extra bytes (255 = keep going).
+ * The last sequence carries only literals.
+ ******************************************************************************/
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+
+// Bytes sent and the bytes they would have been uncompressed, per rank
+static double comp_raw_bytes = 0.0;
+static double comp_sent_bytes = 0.0;
+
+static int lz_bound(int n)
+{
+    return n + n / 255 + 16;
+}
+
+static unsigned int lz_read32(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static void lz_put_len(unsigned char **op, int len)
+{
+    while (len >= 255) {
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    *(*op)++ = (unsigned char)len;
+}
+
+static void lz_put_sequence(unsigned char **op, const unsigned char *lit,
+                            int nlit, int offset, int match_len)
+{
+    unsigned char *token = (*op)++;
+    int ml = match_len - LZ_MIN_MATCH;
+
+    *token = (unsigned char)(((nlit >= 15) ? 15 : nlit) << 4);
+    if (nlit >= 15) lz_put_len(op, nlit - 15);
+    memcpy(*op, lit, nlit);
+    *op += nlit;
+
+    if (offset == 0) return;   // last sequence: literals only
+
+    *(*op)++ = (unsigned char)(offset & 0xff);
+    *(*op)++ = (unsigned char)(offset >> 8);
+    *token |= (unsigned char)((ml >= 15) ? 15 : ml);
+    if (ml >= 15) lz_put_len(op, ml - 15);
+}
+
+// Returns the compressed size; 'dst' must hold lz_bound(n) bytes
+static int lz_compress(const unsigned char *src, int n, unsigned char *dst)
+{
+    static int table[1 << LZ_HASH_BITS];
+    unsigned char *op = dst;
+    int pos = 0, anchor = 0;
+
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) table[i] = -1;
+
+    while (pos + LZ_MIN_MATCH <= n) {
+        unsigned int seq = lz_read32(src + pos);
+        unsigned int hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[hash];
+        table[hash] = pos;
+
+        if (ref >= 0 && pos - ref <= 65535 && lz_read32(src + ref) == seq) {
+            int len = LZ_MIN_MATCH;
+            while (pos + len < n && src[ref + len] == src[pos + len]) len++;
+
+            lz_put_sequence(&op, src + anchor, pos - anchor, pos - ref, len);
+            pos += len;
+            anchor = pos;
+        }
+        else {
+            pos++;
+        }
+    }
+
+    lz_put_sequence(&op, src + anchor, n - anchor, 0, 0);
+    return (int)(op - dst);
+}
+
+// Returns the decompressed size, or -1 on malformed input
+static int lz_decompress(const unsigned char *src, int n, unsigned char *dst,
+                         int cap)
+{
+    const unsigned char *ip = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    while (ip < end) {
+        int token = *ip++;
+        int nlit = token >> 4;
+        if (nlit == 15) {
+            int b;
+            do {
+                if (ip >= end) return -1;
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if (nlit > end - ip || nlit > oend - op) return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == end) break;   // last sequence
+
+        if (end - ip < 2) return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int len = (token & 15);
+        if (len == 15) {
+            int b;
+            do {
+                if (ip >= end) return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op - dst || len > oend - op) return -1;
+        const unsigned char *match = op - offset;
+        for (int i = 0; i < len; i++) op[i] = match[i];   // may overlap
+        op += len;
+    }
+    return (int)(op - dst);
+}
+
+// Delta-filters and compresses 'rows' rows; returns the packed size
+static int pack_rows(const unsigned char *src, int rows, int row_bytes, int ch,
+                     unsigned char *dst)
+{
+    int n = rows * row_bytes;
+    unsigned char *tmp = (unsigned char*)malloc(n > 0 ? n : 1);
+    if (!tmp) {
+        printf("Out of memory compressing %d row(s)\n", rows);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    for (int r = 0; r < rows; r++) {
+        const unsigned char *in = src + r * row_bytes;
+        unsigned char *d = tmp + r * row_bytes;
+        memcpy(d, in, ch < row_bytes ? ch : row_bytes);
+        for (int x = ch; x < row_bytes; x++)
+            d[x] = (unsigned char)(in[x] - in[x - ch]);
+    }
+
+    int packed = lz_compress(tmp, n, dst);
+    free(tmp);
+
+    comp_raw_bytes += n;
+    comp_sent_bytes += packed;
+    return packed;
+}
+
+// Inverse of pack_rows(); returns the rows decoded (at most 'max_rows'),
+// or -1 on malformed input
+static int unpack_rows(const unsigned char *src, int len, unsigned char *dst,
+                       int max_rows, int row_bytes, int ch)
+{
+    int got = lz_decompress(src, len, dst, max_rows * row_bytes);
+    if (got < 0 || got % row_bytes != 0) return -1;
+
+    int rows = got / row_bytes;
+    for (int r = 0; r < rows; r++) {
+        unsigned char *d = dst + r * row_bytes;
+        for (int x = ch; x < row_bytes; x++)
+            d[x] = (unsigned char)(d[x] + d[x - ch]);
+    }
+    return rows;
+}
+
+static void unpack_or_abort(const unsigned char *src, int len,
+                            unsigned char *dst, int rows, int row_bytes, int ch)
+{
+    if (unpack_rows(src, len, dst, rows, row_bytes, ch) != rows) {
+        printf("Corrupt compressed band received\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+/*******************************************************************************
+ * AUTOMATIC COMPRESSION DECISION
+ *
+ * Collective. Measures the link bandwidth between rank 0 and the last rank
+ * with a short ping-pong, and the compression ratio and codec speed on a
+ * sample of the image at root. Root compresses every outgoing band and
+ * decompresses every incoming one, so per byte the transfer costs
+ *     raw:        1 / bandwidth
+ *     compressed: 1 / pack_speed + ratio / bandwidth + 1 / unpack_speed
+ * Compression is enabled when that saves at least 10%.
+ ******************************************************************************/
+static int decide_compression(const unsigned char *img, int w, int h, int ch,
+                              int rank, int size)
+{
+    if (size < 2) return 0;
+
+    // Link bandwidth probe
+    const int probe_bytes = 1 << 20;
+    const int reps = 4;
+    double bandwidth = 0.0;
+
+    if (rank == 0 || rank == size - 1) {
+        unsigned char *buf = (unsigned char*)calloc(probe_bytes, 1);
+        int peer = (rank == 0) ? size - 1 : 0;
+        double t0 = 0.0;
+        for (int i = 0; i <= reps; i++) {
+            if (i == 1) t0 = MPI_Wtime();   // first round is a warm-up
+            if (rank == 0) {
+                MPI_Send(buf, probe_bytes, MPI_UNSIGNED_CHAR, peer, 20, MPI_COMM_WORLD);
+                MPI_Recv(buf, probe_bytes, MPI_UNSIGNED_CHAR, peer, 21, MPI_COMM_WORLD,
+                         MPI_STATUS_IGNORE);
+            }
+            else {
+                MPI_Recv(buf, probe_bytes, MPI_UNSIGNED_CHAR, peer, 20, MPI_COMM_WORLD,
+                         MPI_STATUS_IGNORE);
+                MPI_Send(buf, probe_bytes, MPI_UNSIGNED_CHAR, peer, 21, MPI_COMM_WORLD);
+            }
+        }
+        double elapsed = MPI_Wtime() - t0;
+        bandwidth = (elapsed > 0.0) ? 2.0 * probe_bytes * reps / elapsed : 1e12;
+        free(buf);
+    }
+
+    int enable = 0;
+    if (rank == 0) {
+        // Codec probe on up to 64 rows from the middle of the image
+        int row_bytes = w * ch;
+        int rows = (h < 64) ? h : 64;
+        int y0 = (h - rows) / 2;
+        int n = rows * row_bytes;
+        unsigned char *packed = (unsigned char*)malloc(lz_bound(n));
+        unsigned char *back = (unsigned char*)malloc(n);
+
+        double t0 = MPI_Wtime();
+        int len = pack_rows(img + (size_t)y0 * row_bytes, rows, row_bytes, ch, packed);
+        double t1 = MPI_Wtime();
+        unpack_rows(packed, len, back, rows, row_bytes, ch);
+        double t2 = MPI_Wtime();
+        comp_raw_bytes -= n;        // probe traffic is not real traffic
+        comp_sent_bytes -= len;
+
+        double ratio = (double)len / n;
+        double pack_speed = n / ((t1 - t0) > 1e-9 ? (t1 - t0) : 1e-9);
+        double unpack_speed = n / ((t2 - t1) > 1e-9 ? (t2 - t1) : 1e-9);
+        double raw_cost = 1.0 / bandwidth;
+        double comp_cost = 1.0 / pack_speed + ratio / bandwidth + 1.0 / unpack_speed;
+        enable = (comp_cost < 0.9 * raw_cost);
+
+        printf("Compression %s: link %.1f MB/s, ratio %.2f, pack %.1f MB/s, unpack %.1f MB/s\n",
+               enable ? "on" : "off", bandwidth / 1e6, ratio,
+               pack_speed / 1e6, unpack_speed / 1e6);
+        free(packed);
+        free(back);
+    }
+
+    MPI_Bcast(&enable, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    return enable;
+}
+
+/*******************************************************************************
+ * OUTPUT COLLECTION
+ *
+ * Called by every rank of 'comm' with the band it owns. Rank 0 of 'comm' must
+ * be the root that holds 'out'.
+ *   WRITE_GATHER  MPI_Gatherv into 'out'; root encodes the PNG afterwards.
+ *                 With 'compress' set the bands travel packed.
+ *   WRITE_STREAM  root receives bands in rank order (double-buffered) and
+ *                 streams them into the output file; only one band is held
+ *   WRITE_MPIIO   every rank writes its band of a binary PPM directly with
+ *                 MPI_File_write_at_all; nothing is sent to root
+ ******************************************************************************/
+enum { WRITE_GATHER, WRITE_STREAM, WRITE_MPIIO };
+
+static int has_suffix(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static void mpiio_or_abort(int err, const char *what, const char *outfile)
+{
+    if (err == MPI_SUCCESS) return;
+    char msg[MPI_MAX_ERROR_STRING];
+    int len = 0;
+    MPI_Error_string(err, msg, &len);
+    printf("Error %s output %s: %.*s\n", what, outfile, len, msg);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+static void collect_output(unsigned char *band, int band_rows, int band_start,
+                           unsigned char *out, int w, int h, int ch,
+                           int write_mode, const char *outfile, int compress,
+                           MPI_Comm comm)
+{
+    int crank, csize;
+    MPI_Comm_rank(comm, &crank);
+    MPI_Comm_size(comm, &csize);
+    int row_bytes = w * ch;
+
+    if (write_mode == WRITE_MPIIO) {
+        char header[64];
+        int header_len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", w, h);
+
+        // MPI-IO reports errors through return codes (MPI_ERRORS_RETURN)
+        MPI_File fh;
+        int err = MPI_File_open(comm, outfile, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                                MPI_INFO_NULL, &fh);
+        mpiio_or_abort(err, "opening", outfile);
+        err = MPI_File_set_size(fh, (MPI_Offset)header_len + (MPI_Offset)h * row_bytes);
+        mpiio_or_abort(err, "sizing", outfile);
+        if (crank == 0) {
+            err = MPI_File_write_at(fh, 0, header, header_len, MPI_CHAR,
+                                    MPI_STATUS_IGNORE);
+            mpiio_or_abort(err, "writing", outfile);
+        }
+        err = MPI_File_write_at_all(fh, (MPI_Offset)header_len + (MPI_Offset)band_start * row_bytes,
+                                    band, band_rows * row_bytes, MPI_UNSIGNED_CHAR,
+                                    MPI_STATUS_IGNORE);
+        mpiio_or_abort(err, "writing", outfile);
+        err = MPI_File_close(&fh);
+        mpiio_or_abort(err, "closing", outfile);
+        return;
+    }
+
+    int *counts = NULL;
+    int *starts = NULL;
+    if (crank == 0) {
+        counts = (int*)malloc(csize * sizeof(int));
+        starts = (int*)malloc(csize * sizeof(int));
+    }
+    MPI_Gather(&band_rows, 1, MPI_INT, counts, 1, MPI_INT, 0, comm);
+    MPI_Gather(&band_start, 1, MPI_INT, starts, 1, MPI_INT, 0, comm);
+
+    if (write_mode == WRITE_GATHER && compress) {
+        unsigned char *packed = (unsigned char*)malloc(lz_bound(band_rows * row_bytes));
+        int len = pack_rows(band, band_rows, row_bytes, ch, packed);
+
+        int *lens = NULL;
+        int *offs = NULL;
+        unsigned char *all = NULL;
+        if (crank == 0) {
+            lens = (int*)malloc(csize * sizeof(int));
+            offs = (int*)malloc(csize * sizeof(int));
+        }
+        MPI_Gather(&len, 1, MPI_INT, lens, 1, MPI_INT, 0, comm);
+        if (crank == 0) {
+            int total = 0;
+            for (int i = 0; i < csize; i++) {
+                offs[i] = total;
+                total += lens[i];
+            }
+            all = (unsigned char*)malloc(total > 0 ? total : 1);
+        }
+        imgf_trace_begin("MPI_Gatherv");
+        MPI_Gatherv(packed, len, MPI_UNSIGNED_CHAR, all, lens, offs,
+                    MPI_UNSIGNED_CHAR, 0, comm);
+        imgf_trace_end();
+        if (crank == 0) {
+            for (int i = 0; i < csize; i++)
+                unpack_or_abort(all + offs[i], lens[i],
+                                out + (size_t)starts[i] * row_bytes,
+                                counts[i], row_bytes, ch);
+        }
+
+        free(packed);
+        free(all);
+        free(lens);
+        free(offs);
+        free(counts);
+        free(starts);
+        return;
+    }
+
+    if (write_mode == WRITE_GATHER) {
+        if (crank == 0) {
+            for (int i = 0; i < csize; i++) {
+                counts[i] *= row_bytes;
+                starts[i] *= row_bytes;
+            }
+        }
+        imgf_trace_begin("MPI_Gatherv");
+        MPI_Gatherv(band, band_rows * row_bytes, MPI_UNSIGNED_CHAR,
+                    out, counts, starts, MPI_UNSIGNED_CHAR, 0, comm);
+        imgf_trace_end();
+        free(counts);
+        free(starts);
+        return;
+    }
+
+    // WRITE_STREAM
+    if (crank != 0) {
+        MPI_Send(band, band_rows * row_bytes, MPI_UNSIGNED_CHAR, 0, 2, comm);
+        return;
+    }
+
+    int ppm = has_suffix(outfile, ".ppm");
+    png_stream ps;
+    FILE *fp = NULL;
+    int opened;
+    if (ppm) {
+        fp = fopen(outfile, "wb");
+        opened = (fp != NULL);
+        if (fp) fprintf(fp, "P6\n%d %d\n255\n", w, h);
+    }
+    else {
+        opened = png_stream_open(&ps, outfile, w, h, ch);
+    }
+    if (!opened) {
+        printf("Error opening output: %s\n", outfile);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    int max_rows = 0;
+    for (int i = 1; i < csize; i++)
+        if (counts[i] > max_rows) max_rows = counts[i];
+
+    unsigned char *buf[2];
+    buf[0] = (unsigned char*)malloc((size_t)max_rows * row_bytes + 1);
+    buf[1] = (unsigned char*)malloc((size_t)max_rows * row_bytes + 1);
+    MPI_Request req = MPI_REQUEST_NULL;
+
+    // Post the receive for rank 1 before writing our own band
+    if (csize > 1)
+        MPI_Irecv(buf[1], counts[1] * row_bytes, MPI_UNSIGNED_CHAR, 1, 2,
+                  comm, &req);
+
+    for (int i = 0; i < csize; i++) {
+        unsigned char *rows = band;
+        if (i > 0) {
+            MPI_Wait(&req, MPI_STATUS_IGNORE);
+            rows = buf[i & 1];
+            if (i + 1 < csize)
+                MPI_Irecv(buf[(i + 1) & 1], counts[i + 1] * row_bytes,
+                          MPI_UNSIGNED_CHAR, i + 1, 2, comm, &req);
+        }
+        if (ppm) fwrite(rows, 1, (size_t)counts[i] * row_bytes, fp);
+        else png_stream_rows(&ps, rows, counts[i]);
+    }
+
+    if (ppm) fclose(fp);
+    else png_stream_close(&ps);
+
+    free(buf[0]);
+    free(buf[1]);
+    free(counts);
+    free(starts);
+}
+
+/*******************************************************************************
+ * HARDWARE COUNTERS (--counters)
+ *
+ * Every rank counts its own filter calls; rank 0 prints the sums over all
+ * ranks. Counted pixels are output pixels of each stage, so bytes/pixel is
+ * per pixel and stage.
+ ******************************************************************************/
+static imgf_counters band_counters;
+static double counted_pixels = 0.0;
+
+static void report_counters(int rank)
+{
+    double sum[IMGF_NUM_COUNTERS], pixels = 0.0;
+    MPI_Reduce(band_counters.value, sum, IMGF_NUM_COUNTERS, MPI_DOUBLE, MPI_SUM,
+               0, MPI_COMM_WORLD);
+    MPI_Reduce(&counted_pixels, &pixels, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (rank == 0 && band_counters.enabled) {
+        imgf_counters total = band_counters;
+        memcpy(total.value, sum, sizeof(sum));
+        imgf_counters_print(stdout, "Counters (all ranks)", &total, pixels);
+    }
+    imgf_counters_close(&band_counters);
+}
+
+/*******************************************************************************
+ * BUFFER POOL
+ *
+ * Output, band and scratch buffers come from the libimgfilter pool, so
+ * frames and farmed images reuse the previous one's memory. The totals over
+ * all ranks show how many allocations that avoided.
+ ******************************************************************************/
+static void report_buffers(int rank)
+{
+    imgf_pool_stats st;
+    imgf_pool_get_stats(&st);
+    double mine[4] = { (double)st.requests, (double)st.reused, (double)st.allocated,
+                       (double)st.huge };
+    double sum[4];
+    MPI_Reduce(mine, sum, 4, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        printf("Buffers (all ranks): %.0f buffer request(s), %.0f reused "
+               "(allocations avoided), %.0f allocated", sum[0], sum[1], sum[2]);
+        if (sum[3] > 0) printf(", %.0f mapped for huge pages", sum[3]);
+        printf("\n");
+    }
+}
+
+/*******************************************************************************
+ * THROUGHPUT AND ROOFLINE (--roofline)
+ *
+ * The image is finished when the slowest rank finishes, so throughput uses
+ * the largest per-rank compute time. For the roofline every rank runs the
+ * peak microbenchmarks at the same time and the peaks are summed, so ranks
+ * sharing a node also share its memory bandwidth, as they do when filtering.
+ ******************************************************************************/
+static void report_throughput(const imgf_stage *stages, int nstages,
+                              int w, int h, int ch, double compute_seconds,
+                              int use_roofline, int rank, int size)
+{
+    double slowest = 0.0;
+    MPI_Reduce(&compute_seconds, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    imgf_machine_peaks total = {0};
+    if (use_roofline) {
+        imgf_machine_peaks peaks;
+        double mine[2], sum[2];
+        MPI_Barrier(MPI_COMM_WORLD);
+        imgf_measure_peaks(&peaks, IMGF_SERIAL);
+        mine[0] = peaks.flops;
+        mine[1] = peaks.bandwidth;
+        MPI_Reduce(mine, sum, 2, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        total.flops = sum[0];
+        total.bandwidth = sum[1];
+        total.threads = size;
+    }
+
+    if (rank != 0) return;
+    imgf_throughput_print(stdout, "Throughput (slowest rank)", stages, nstages,
+                          (double)w * h, ch, slowest);
+    if (use_roofline)
+        imgf_roofline_print(stdout, "Roofline (all ranks)", stages, nstages,
+                            (double)w * h, ch, slowest, &total);
+}
+
+/*******************************************************************************
+ * TIMELINE TRACE (--trace=FILE)
+ *
+ * Every rank records its own threads (pid = rank). The clocks start together
+ * after a barrier; at the end root gathers the events of all ranks into one
+ * Chrome trace file.
+ ******************************************************************************/
+static void start_trace(int rank)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "rank %d", rank);
+    MPI_Barrier(MPI_COMM_WORLD);
+    imgf_trace_start(rank, name);
+}
+
+static void write_trace(const char *path, int rank, int size)
+{
+    size_t len = 0;
+    char *events = imgf_trace_events(&len);
+    int my_len = events ? (int)len : 0;
+
+    int *lens = NULL;
+    int *offs = NULL;
+    char *all = NULL;
+    if (rank == 0) {
+        lens = (int*)malloc(size * sizeof(int));
+        offs = (int*)malloc(size * sizeof(int));
+    }
+    MPI_Gather(&my_len, 1, MPI_INT, lens, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        // One separator after every rank's events, the last one becomes '\0'
+        int total = 0;
+        for (int i = 0; i < size; i++) {
+            offs[i] = total;
+            total += lens[i] + 2;
+        }
+        all = (char*)malloc(total > 0 ? total : 1);
+    }
+    MPI_Gatherv(events, my_len, MPI_CHAR, all, lens, offs, MPI_CHAR, 0,
+                MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        // Join the non-empty event lists with commas
+        size_t pos = 0;
+        for (int i = 0; i < size; i++) {
+            if (lens[i] == 0) continue;
+            if (pos > 0) {
+                all[pos++] = ',';
+                all[pos++] = '\n';
+            }
+            memmove(all + pos, all + offs[i], lens[i]);
+            pos += lens[i];
+        }
+        all[pos] = '\0';
+
+        if (imgf_trace_write_events(path, all))
+            printf("Trace written to %s\n", path);
+        else
+            printf("Could not write trace %s\n", path);
+    }
+
+    free(events);
+    free(all);
+    free(lens);
+    free(offs);
+}
+
+/*******************************************************************************
+ * APPLY ONE STAGE TO ONE BAND
+ * 'extended' points at the first of st->halo rows above the band.
+ * Returns the time spent filtering in seconds.
+ ******************************************************************************/
+// Filters a band read from rows 'pitch' bytes apart starting at global row
+// 'first_row' (see imgf_apply_rows)
+static double filter_rows(const imgf_stage *st, const unsigned char *src,
+                          size_t pitch, int first_row, int src_rows,
+                          unsigned char *local_out, int w, int local_rows, int ch,
+                          int global_y_start, int global_h)
+{
+    if (local_rows <= 0) return 0.0;
+
+    double t0 = MPI_Wtime();
+    imgf_trace_begin("filter band");
+    imgf_counters_start(&band_counters);
+    if (!imgf_apply_rows(st, src, pitch, first_row, src_rows, local_out, w,
+                         local_rows, ch, global_y_start, global_h, IMGF_SERIAL)) {
+        printf("Out of memory filtering rows %d-%d\n", global_y_start,
+               global_y_start + local_rows - 1);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    imgf_counters_stop(&band_counters);
+    imgf_trace_end();
+    counted_pixels += (double)w * local_rows;
+    return MPI_Wtime() - t0;
+}
+
+static double filter_band(const imgf_stage *st, unsigned char *extended,
+                          unsigned char *local_out, int w, int local_rows, int ch,
+                          int global_y_start, int global_h)
+{
+    return filter_rows(st, extended, (size_t)w * ch, global_y_start - st->halo,
+                       local_rows + 2 * st->halo, local_out, w, local_rows, ch,
+                       global_y_start, global_h);
+}
+
+/*******************************************************************************
+ * ROW DISTRIBUTION
+ *
+ * weights == NULL gives the static equal split. Otherwise every rank gets
+ * rows in proportion to its weight (largest remainder rounding), but never
+ * fewer than 'min_rows' so a band can always serve its neighbours' halos.
+ ******************************************************************************/
+static void compute_row_distribution(int h, int size, const double *weights,
+                                     int min_rows, int *row_counts,
+                                     int *row_starts)
+{
+    if (weights == NULL || h < size * min_rows) {
+        int base_rows = h / size;
+        int extra = h % size;
+        for (int i = 0; i < size; i++)
+            row_counts[i] = base_rows + (i < extra ? 1 : 0);
+    }
+    else {
+        double total = 0.0;
+        for (int i = 0; i < size; i++) total += weights[i];
+
+        int spare = h - size * min_rows;
+        int assigned = 0;
+        double *frac = (double*)malloc(size * sizeof(double));
+
+        for (int i = 0; i < size; i++) {
+            double share = spare * weights[i] / total;
+            row_counts[i] = min_rows + (int)share;
+            frac[i] = share - (int)share;
+            assigned += row_counts[i];
+        }
+
+        // Hand out the rounding remainder to the largest fractions
+        while (assigned < h) {
+            int best = 0;
+            for (int i = 1; i < size; i++)
+                if (frac[i] > frac[best]) best = i;
+            row_counts[best]++;
+            frac[best] = -1.0;
+            assigned++;
+        }
+        free(frac);
+    }
+
+    int offset = 0;
+    for (int i = 0; i < size; i++) {
+        row_starts[i] = offset;
+        offset += row_counts[i];
+    }
+}
+
+/*******************************************************************************
+ * CALIBRATION PASS
+ *
+ * Times the filter chain on a small synthetic band of the real width and
+ * returns this rank's throughput in rows per second.
+ ******************************************************************************/
+static double calibrate_rank(const imgf_stage *stages, int nstages,
+                             int w, int h, int ch)
+{
+    int halo = imgf_chain_halo(stages, nstages);
+    int rows = (h < 16) ? h : 16;
+    int ext_rows = rows + 2 * halo;
+    unsigned char *ext = (unsigned char*)imgf_buffer_alloc((size_t)ext_rows * w * ch);
+    unsigned char *res = (unsigned char*)imgf_buffer_alloc((size_t)rows * w * ch);
+
+    unsigned int seed = 12345;
+    for (int i = 0; i < ext_rows * w * ch; i++) {
+        seed = seed * 1103515245u + 12345u;
+        ext[i] = (unsigned char)(seed >> 16);
+    }
+
+    // Repeat until the measurement is long enough to be meaningful
+    double elapsed = 0.0;
+    int reps = 0;
+    do {
+        for (int s = 0; s < nstages; s++) {
+            int off = halo - stages[s].halo;
+            elapsed += filter_band(&stages[s], ext + off * w * ch, res, w, rows,
+                                   ch, halo, h);
+        }
+        reps++;
+    } while (elapsed < 0.05 && reps < 1000);
+
+    imgf_buffer_free(ext);
+    imgf_buffer_free(res);
+    return (elapsed > 0.0) ? rows * reps / elapsed : 0.0;
+}
+
+/*******************************************************************************
+ * SPEED PROFILE FILE
+ *
+ * One line per host: "<processor name> <relative speed>". Speeds are relative
+ * to the mean rank of the run that wrote them, so they do not depend on the
+ * image size or the filter. Ranks on hosts missing from the file get 1.0.
+ ******************************************************************************/
+typedef struct {
+    char host[MPI_MAX_PROCESSOR_NAME];
+    double speed;
+} host_speed;
+
+static int read_profile(const char *path, host_speed **entries)
+{
+    *entries = NULL;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+
+    int n = 0, cap = 0;
+    char line[MPI_MAX_PROCESSOR_NAME + 64];
+    while (fgets(line, sizeof(line), fp)) {
+        host_speed e;
+        if (line[0] == '#') continue;
+        // MPI_MAX_PROCESSOR_NAME differs between MPI libraries; scan into a
+        // buffer as long as the line and skip names no rank can have
+        char name[sizeof(line)];
+        if (sscanf(line, "%s %lf", name, &e.speed) != 2 || e.speed <= 0.0 ||
+            strlen(name) >= sizeof(e.host))
+            continue;
+        strcpy(e.host, name);
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            *entries = (host_speed*)realloc(*entries, cap * sizeof(host_speed));
+        }
+        (*entries)[n++] = e;
+    }
+    fclose(fp);
+    return n;
+}
+
+static double* profile_lookup(host_speed *entries, int n, const char *host)
+{
+    for (int i = 0; i < n; i++)
+        if (strcmp(entries[i].host, host) == 0) return &entries[i].speed;
+    return NULL;
+}
+
+// Collective: gathers every rank's processor name on root
+static char* gather_hosts(int rank, int size)
+{
+    char host[MPI_MAX_PROCESSOR_NAME] = {0};
+    int len;
+    MPI_Get_processor_name(host, &len);
+
+    char *hosts = NULL;
+    if (rank == 0) hosts = (char*)malloc(size * MPI_MAX_PROCESSOR_NAME);
+    MPI_Gather(host, MPI_MAX_PROCESSOR_NAME, MPI_CHAR,
+               hosts, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0, MPI_COMM_WORLD);
+    return hosts;
+}
+
+// Collective: returns per-rank weights on every rank, or NULL without a profile
+static double* profile_weights(const char *path, int rank, int size)
+{
+    char *hosts = gather_hosts(rank, size);
+    double *weights = (double*)malloc(size * sizeof(double));
+    int found = 0;
+
+    if (rank == 0) {
+        host_speed *entries;
+        int n = read_profile(path, &entries);
+        for (int i = 0; i < size; i++) {
+            double *speed = profile_lookup(entries, n, hosts + i * MPI_MAX_PROCESSOR_NAME);
+            weights[i] = speed ? *speed : 1.0;
+            if (speed) found = 1;
+        }
+        free(entries);
+        free(hosts);
+    }
+
+    MPI_Bcast(&found, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!found) {
+        free(weights);
+        return NULL;
+    }
+    MPI_Bcast(weights, size, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    return weights;
+}
+
+// Collective: folds this run's measured speeds into the profile on root
+static void update_profile(const char *path, double rows_per_sec,
+                           int rank, int size)
+{
+    char *hosts = gather_hosts(rank, size);
+    double *rates = NULL;
+    if (rank == 0) rates = (double*)malloc(size * sizeof(double));
+    MPI_Gather(&rows_per_sec, 1, MPI_DOUBLE, rates, 1, MPI_DOUBLE, 0,
+               MPI_COMM_WORLD);
+    if (rank != 0) return;
+
+    double mean = 0.0;
+    int measured = 0;
+    for (int i = 0; i < size; i++) {
+        if (rates[i] > 0.0) {
+            mean += rates[i];
+            measured++;
+        }
+    }
+
+    if (measured > 0) {
+        mean /= measured;
+
+        host_speed *entries;
+        int n = read_profile(path, &entries);
+        entries = (host_speed*)realloc(entries, (n + size) * sizeof(host_speed));
+
+        // Average the ranks of each host, then blend with the old value
+        for (int i = 0; i < size; i++) {
+            const char *host = hosts + i * MPI_MAX_PROCESSOR_NAME;
+            if (rates[i] <= 0.0) continue;
+
+            double sum = 0.0;
+            int cnt = 0, first = 1;
+            for (int j = 0; j < size; j++) {
+                if (rates[j] <= 0.0) continue;
+                if (strcmp(hosts + j * MPI_MAX_PROCESSOR_NAME, host) != 0) continue;
+                if (j < i) first = 0;
+                sum += rates[j];
+                cnt++;
+            }
+            if (!first) continue;
+
+            double speed = sum / cnt / mean;
+            double *old = profile_lookup(entries, n, host);
+            if (old) {
+                *old = 0.5 * (*old) + 0.5 * speed;
+            }
+            else {
+                strcpy(entries[n].host, host);
+                entries[n].speed = speed;
+                n++;
+            }
+        }
+
+        FILE *fp = fopen(path, "w");
+        if (fp) {
+            fprintf(fp, "# mpi_filter speed profile: <host> <relative speed>\n");
+            for (int i = 0; i < n; i++)
+                fprintf(fp, "%s %.6f\n", entries[i].host, entries[i].speed);
+            fclose(fp);
+        }
+        else {
+            printf("Could not write profile: %s\n", path);
+        }
+        free(entries);
+    }
+
+    free(rates);
+    free(hosts);
+}
+
+/*******************************************************************************
+ * EDGE REPLICATION
+ *
+ * The first and last rank of a band layout fill the halo rows outside the
+ * image by repeating the first/last image row (clamp-to-edge).
+ ******************************************************************************/
+static void replicate_edges(unsigned char *band, int rows, int halo,
+                            int row_bytes, int crank, int csize)
+{
+    if (rows <= 0) return;
+
+    // First rank: fill top halo by replicating the first row
+    if (crank == 0) {
+        for (int i = 1; i <= halo; i++)
+            memcpy(band - i * row_bytes, band, row_bytes);
+    }
+
+    // Last rank: fill bottom halo by replicating the last row
+    if (crank == csize - 1) {
+        for (int i = 0; i < halo; i++)
+            memcpy(band + (rows + i) * row_bytes,
+                   band + (rows - 1) * row_bytes, row_bytes);
+    }
+}
+
+/*******************************************************************************
+ * HALO EXCHANGE
+ *
+ * 'band' points at the first of 'rows' local rows inside a buffer that has
+ * room for at least 'halo' rows above and below. Sends the outer rows to the
+ * neighbouring ranks of 'comm', receives theirs into the halo rows and
+ * replicates the edge rows at the top and bottom of the image.
+ ******************************************************************************/
+static void exchange_halos(unsigned char *band, int rows, int halo,
+                           int row_bytes, MPI_Comm comm)
+{
+    int crank, csize;
+    MPI_Comm_rank(comm, &crank);
+    MPI_Comm_size(comm, &csize);
+
+    if (halo <= 0) return;
+
+    MPI_Request reqs[4];
+    int nreqs = 0;
+
+    // Calculate actual halo sizes to send/receive
+    int send_rows = (rows >= halo) ? halo : rows;
+
+    // Exchange with previous rank (rank - 1)
+    if (crank > 0) {
+        // Send my first rows to previous rank
+        MPI_Isend(band, send_rows * row_bytes, MPI_UNSIGNED_CHAR,
+                  crank - 1, 0, comm, &reqs[nreqs++]);
+
+        // Receive their last rows into my top halo
+        MPI_Irecv(band - halo * row_bytes, halo * row_bytes, MPI_UNSIGNED_CHAR,
+                  crank - 1, 1, comm, &reqs[nreqs++]);
+    }
+
+    // Exchange with next rank (rank + 1)
+    if (crank < csize - 1) {
+        // Send my last rows to next rank
+        MPI_Isend(band + (rows - send_rows) * row_bytes,
+                  send_rows * row_bytes, MPI_UNSIGNED_CHAR,
+                  crank + 1, 1, comm, &reqs[nreqs++]);
+
+        // Receive their first rows into my bottom halo
+        MPI_Irecv(band + rows * row_bytes, halo * row_bytes, MPI_UNSIGNED_CHAR,
+                  crank + 1, 0, comm, &reqs[nreqs++]);
+    }
+
+    MPI_Waitall(nreqs, reqs, MPI_STATUSES_IGNORE);
+
+    replicate_edges(band, rows, halo, row_bytes, crank, csize);
+}
+
+/*******************************************************************************
+ * COMPRESSED HALO EXCHANGE
+ *
+ * Same contract as exchange_halos(). The packed size is not known in advance,
+ * so receivers probe for the message before posting the receive.
+ ******************************************************************************/
+static void exchange_halos_compressed(unsigned char *band, int rows, int halo,
+                                      int row_bytes, int ch, MPI_Comm comm)
+{
+    int crank, csize;
+    MPI_Comm_rank(comm, &crank);
+    MPI_Comm_size(comm, &csize);
+
+    if (halo <= 0) return;
+
+    int send_rows = (rows >= halo) ? halo : rows;
+    unsigned char *packed[2] = {NULL, NULL};
+    MPI_Request reqs[2];
+    int nreqs = 0;
+
+    if (crank > 0) {
+        packed[0] = (unsigned char*)malloc(lz_bound(send_rows * row_bytes));
+        int len = pack_rows(band, send_rows, row_bytes, ch, packed[0]);
+        MPI_Isend(packed[0], len, MPI_UNSIGNED_CHAR, crank - 1, 0, comm,
+                  &reqs[nreqs++]);
+    }
+    if (crank < csize - 1) {
+        packed[1] = (unsigned char*)malloc(lz_bound(send_rows * row_bytes));
+        int len = pack_rows(band + (rows - send_rows) * row_bytes, send_rows,
+                            row_bytes, ch, packed[1]);
+        MPI_Isend(packed[1], len, MPI_UNSIGNED_CHAR, crank + 1, 1, comm,
+                  &reqs[nreqs++]);
+    }
+
+    // Receive top halo from rank - 1 and bottom halo from rank + 1
+    for (int side = 0; side < 2; side++) {
+        int peer = side == 0 ? crank - 1 : crank + 1;
+        if (peer < 0 || peer >= csize) continue;
+
+        MPI_Status st;
+        int len;
+        MPI_Probe(peer, side == 0 ? 1 : 0, comm, &st);
+        MPI_Get_count(&st, MPI_UNSIGNED_CHAR, &len);
+        unsigned char *buf = (unsigned char*)malloc(len > 0 ? len : 1);
+        MPI_Recv(buf, len, MPI_UNSIGNED_CHAR, peer, st.MPI_TAG, comm,
+                 MPI_STATUS_IGNORE);
+
+        // A neighbour with fewer than 'halo' rows sends what it has
+        unsigned char *dst = (side == 0) ? band - halo * row_bytes
+                                         : band + rows * row_bytes;
+        if (unpack_rows(buf, len, dst, halo, row_bytes, ch) < 0) {
+            printf("Corrupt compressed halo received\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        free(buf);
+    }
+
+    MPI_Waitall(nreqs, reqs, MPI_STATUSES_IGNORE);
+    free(packed[0]);
+    free(packed[1]);
+
+    replicate_edges(band, rows, halo, row_bytes, crank, csize);
+}
+
+/*******************************************************************************
+ * PER-PHASE TIMING
+ *
+ * Every rank accumulates the time it spends in each phase. Time spent waiting
+ * inside a collective is charged to that collective's phase, so:
+ *   - for local phases (decode, compute, write) the slowest rank is the one
+ *     with the largest time;
+ *   - for communication phases the rank everyone waited for is the one with
+ *     the smallest time, and the minimum approximates the transfer itself.
+ * The critical path estimate adds the maximum of each local phase and the
+ * minimum of each communication phase.
+ ******************************************************************************/
+enum {
+    PH_DECODE, PH_BCAST, PH_SCATTER, PH_HALO, PH_COMPUTE, PH_GATHER, PH_WRITE,
+    PH_COUNT
+};
+
+static const char *phase_names[PH_COUNT] = {
+    "decode", "bcast", "scatter", "halo", "compute", "gather", "write"
+};
+
+static const int phase_is_comm[PH_COUNT] = {0, 1, 1, 1, 0, 1, 0};
+static const int phase_root_only[PH_COUNT] = {1, 0, 0, 0, 0, 0, 1};
+
+typedef struct {
+    double t[PH_COUNT];
+} phase_times;
+
+// Collective: gathers all ranks' phase times and prints/writes the report
+static void report_phases(const phase_times *pt, const char *json_path,
+                          const char *filter, int w, int h,
+                          double total_seconds, int rank, int size)
+{
+    double *all = NULL;
+    if (rank == 0) all = (double*)malloc(size * PH_COUNT * sizeof(double));
+    MPI_Gather(pt->t, PH_COUNT, MPI_DOUBLE, all, PH_COUNT, MPI_DOUBLE, 0,
+               MPI_COMM_WORLD);
+    if (rank != 0) return;
+
+    double mn[PH_COUNT], mx[PH_COUNT], mean[PH_COUNT], cost[PH_COUNT];
+    int slowest[PH_COUNT];
+    double critical = 0.0;
+    int crit_phase = 0;
+
+    for (int p = 0; p < PH_COUNT; p++) {
+        int arg_min = 0, arg_max = 0;
+        mn[p] = mx[p] = all[p];
+        mean[p] = 0.0;
+        for (int r = 0; r < size; r++) {
+            double v = all[r * PH_COUNT + p];
+            if (v < mn[p]) { mn[p] = v; arg_min = r; }
+            if (v > mx[p]) { mx[p] = v; arg_max = r; }
+            mean[p] += v;
+        }
+        mean[p] /= size;
+
+        if (phase_root_only[p]) {
+            cost[p] = all[p];
+            slowest[p] = 0;
+        }
+        else if (phase_is_comm[p]) {
+            cost[p] = mn[p];
+            slowest[p] = arg_min;
+        }
+        else {
+            cost[p] = mx[p];
+            slowest[p] = arg_max;
+        }
+
+        critical += cost[p];
+        if (cost[p] > cost[crit_phase]) crit_phase = p;
+    }
+
+    printf("Phase timing over %d rank(s) (seconds):\n", size);
+    printf("  %-8s %10s %10s %10s %10s %8s\n", "phase", "min", "mean", "max",
+           "imbalance", "critical");
+    for (int p = 0; p < PH_COUNT; p++) {
+        char imb[16];
+        if (phase_root_only[p] || mean[p] <= 0.0) strcpy(imb, "-");
+        else snprintf(imb, sizeof(imb), "%.3f", mx[p] / mean[p]);
+        printf("  %-8s %10.6f %10.6f %10.6f %10s   rank %d\n", phase_names[p],
+               mn[p], mean[p], mx[p], imb, slowest[p]);
+    }
+    printf("Critical path: ~%.6f seconds, dominated by %s (%.1f%%) on rank %d\n",
+           critical, phase_names[crit_phase],
+           critical > 0.0 ? 100.0 * cost[crit_phase] / critical : 0.0,
+           slowest[crit_phase]);
+
+    if (json_path) {
+        FILE *fp = fopen(json_path, "w");
+        if (!fp) {
+            printf("Could not write timing JSON: %s\n", json_path);
+        }
+        else {
+            fprintf(fp, "{\n  \"filter\": \"%s\",\n  \"width\": %d,\n  \"height\": %d,\n",
+                    filter, w, h);
+            fprintf(fp, "  \"ranks\": %d,\n  \"total_seconds\": %.9f,\n",
+                    size, total_seconds);
+            fprintf(fp, "  \"phases\": [\n");
+            for (int p = 0; p < PH_COUNT; p++) {
+                fprintf(fp, "    {\"name\": \"%s\", \"root_only\": %s, \"min\": %.9f, "
+                        "\"mean\": %.9f, \"max\": %.9f, \"imbalance\": %.6f, "
+                        "\"critical_rank\": %d, \"per_rank\": [", phase_names[p],
+                        phase_root_only[p] ? "true" : "false", mn[p], mean[p], mx[p],
+                        mean[p] > 0.0 ? mx[p] / mean[p] : 0.0, slowest[p]);
+                for (int r = 0; r < size; r++)
+                    fprintf(fp, "%s%.9f", r ? ", " : "", all[r * PH_COUNT + p]);
+                fprintf(fp, "]}%s\n", p + 1 < PH_COUNT ? "," : "");
+            }
+            fprintf(fp, "  ],\n  \"critical_path\": {\"seconds\": %.9f, "
+                    "\"phase\": \"%s\", \"rank\": %d}\n}\n",
+                    critical, phase_names[crit_phase], slowest[crit_phase]);
+            fclose(fp);
+        }
+    }
+
+    free(all);
+}
+
+/*******************************************************************************
+ * MESSAGE-PASSING DISTRIBUTION
+ *
+ * Every rank receives its band through MPI_Scatterv, exchanges halo rows with
+ * its neighbours by message and returns its result through collect_output().
+ * For a chain the bands stay on their ranks between stages; only the halo
+ * rows the next stage needs are refreshed. With 'compress' set, bands and
+ * halos travel packed (see BAND COMPRESSION).
+ *
+ * With 'raw' (a raw image file) there is no scatter: every rank maps its own
+ * band and the first stage's halo rows from the file and filters straight
+ * from the mapping, so that stage needs no halo exchange either.
+ ******************************************************************************/
+static void filter_message_passing(unsigned char *img, const char *raw,
+                                   unsigned char *out, int w, int h, int ch,
+                                   const imgf_stage *stages, int nstages,
+                                   int *row_counts, int *row_starts,
+                                   int write_mode, const char *outfile,
+                                   int compress, phase_times *pt,
+                                   int rank, int size)
+{
+    int local_rows = row_counts[rank];
+    int my_start = row_starts[rank];
+    int row_bytes = w * ch;
+    int halo = imgf_chain_halo(stages, nstages);
+
+    // Prepare scatter parameters
+    int *sendcounts = (int*)malloc(size * sizeof(int));
+    int *displs = (int*)malloc(size * sizeof(int));
+
+    for (int i = 0; i < size; i++) {
+        sendcounts[i] = row_counts[i] * row_bytes;
+        displs[i] = row_starts[i] * row_bytes;
+    }
+
+    /***************************************************************************
+     * STEP 6: Create extended buffers with room for the largest halo.
+     * Stages read from one buffer and write into the other.
+     ***************************************************************************/
+    int extended_rows = local_rows + 2 * halo;
+    unsigned char *extended[2];
+    extended[0] = (unsigned char*)imgf_buffer_alloc((size_t)extended_rows * row_bytes);
+    extended[1] = (unsigned char*)imgf_buffer_alloc((size_t)extended_rows * row_bytes);
+    int cur = 0;
+
+    /***************************************************************************
+     * STEP 7: Scatter image data straight into the centre of the buffer
+     * (or map this rank's rows of a raw image)
+     ***************************************************************************/
+    double t0 = MPI_Wtime();
+    imgf_raw band_map;
+    const unsigned char *mapped = NULL;
+    size_t pitch = 0;
+    if (raw) {
+        imgf_trace_begin("imgf_raw_map");
+        if (imgf_raw_map(raw, my_start - stages[0].halo,
+                         local_rows + 2 * stages[0].halo, &band_map))
+            mapped = imgf_raw_rows(&band_map, &pitch);
+        imgf_trace_end();
+        if (!mapped) {
+            printf("Rank %d: cannot map rows %d-%d of %s\n", rank, my_start,
+                   my_start + local_rows - 1, raw);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    else if (compress) {
+        // Root packs every band, then sizes and packed bytes are scattered
+        unsigned char *packed = NULL;
+        if (rank == 0) {
+            int total = 0;
+            for (int i = 0; i < size; i++) total += lz_bound(sendcounts[i]);
+            packed = (unsigned char*)malloc(total);
+            int pos = 0;
+            for (int i = 0; i < size; i++) {
+                int len = pack_rows(img + displs[i], row_counts[i], row_bytes,
+                                    ch, packed + pos);
+                displs[i] = pos;
+                sendcounts[i] = len;
+                pos += len;
+            }
+        }
+
+        int my_len;
+        MPI_Scatter(sendcounts, 1, MPI_INT, &my_len, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        unsigned char *mine = (unsigned char*)malloc(my_len > 0 ? my_len : 1);
+        imgf_trace_begin("MPI_Scatterv");
+        MPI_Scatterv(packed, sendcounts, displs, MPI_UNSIGNED_CHAR,
+                     mine, my_len, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+        imgf_trace_end();
+        unpack_or_abort(mine, my_len, extended[cur] + halo * row_bytes,
+                        local_rows, row_bytes, ch);
+        free(mine);
+        free(packed);
+    }
+    else {
+        imgf_trace_begin("MPI_Scatterv");
+        MPI_Scatterv(img, sendcounts, displs, MPI_UNSIGNED_CHAR,
+                     extended[cur] + halo * row_bytes, local_rows * row_bytes,
+                     MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+        imgf_trace_end();
+    }
+    pt->t[PH_SCATTER] += MPI_Wtime() - t0;
+
+    for (int s = 0; s < nstages; s++) {
+        const imgf_stage *st = &stages[s];
+        unsigned char *band = extended[cur] + halo * row_bytes;
+
+        // First stage of a mapped image: its halo rows come from the file
+        if (s == 0 && mapped) {
+            pt->t[PH_COMPUTE] += filter_rows(st, mapped, pitch, band_map.first_row,
+                                             band_map.rows,
+                                             extended[1 - cur] + halo * row_bytes,
+                                             w, local_rows, ch, my_start, h);
+            cur = 1 - cur;
+            continue;
+        }
+
+        /***********************************************************************
+         * STEPS 8-9: Halo exchange and edge replication for this stage
+         ***********************************************************************/
+        t0 = MPI_Wtime();
+        imgf_trace_begin("halo exchange");
+        if (compress)
+            exchange_halos_compressed(band, local_rows, st->halo, row_bytes,
+                                      ch, MPI_COMM_WORLD);
+        else
+            exchange_halos(band, local_rows, st->halo, row_bytes, MPI_COMM_WORLD);
+        imgf_trace_end();
+        pt->t[PH_HALO] += MPI_Wtime() - t0;
+
+        /***********************************************************************
+         * STEP 10: Apply the filter
+         ***********************************************************************/
+        pt->t[PH_COMPUTE] += filter_band(st, band - st->halo * row_bytes,
+                                         extended[1 - cur] + halo * row_bytes,
+                                         w, local_rows, ch, my_start, h);
+        cur = 1 - cur;
+    }
+
+    /***************************************************************************
+     * STEP 11: Collect results on root (or write them in parallel)
+     ***************************************************************************/
+    t0 = MPI_Wtime();
+    collect_output(extended[cur] + halo * row_bytes, local_rows, my_start,
+                   out, w, h, ch, write_mode, outfile, compress, MPI_COMM_WORLD);
+    pt->t[PH_GATHER] += MPI_Wtime() - t0;
+
+    if (mapped) imgf_raw_unmap(&band_map);
+    imgf_buffer_free(extended[0]);
+    imgf_buffer_free(extended[1]);
+    free(sendcounts);
+    free(displs);
+}
+
+/*******************************************************************************
+ * NODE-SHARED DISTRIBUTION (MPI-3 shared-memory windows)
+ *
+ * Ranks that share a node are grouped with MPI_Comm_split_type. The node
+ * leader (lowest rank on the node) owns two shared windows, each holding the
+ * node's rows plus 'halo' rows above and below. Stages read from one window
+ * and write into the other.
+ * Only leaders take part in Scatterv/output collection and only neighbouring
+ * leaders exchange halo rows by message. Every other rank reads its
+ * neighbours' rows straight from the shared window and writes its band in
+ * place.
+ *
+ * This needs the ranks of each node to be consecutive in MPI_COMM_WORLD
+ * (the default "by slot" mapping). Returns 0 without doing any work when that
+ * does not hold, so the caller can fall back to message passing.
+ ******************************************************************************/
+static int filter_shared_node(unsigned char *img, unsigned char *out,
+                              int w, int h, int ch,
+                              const imgf_stage *stages, int nstages,
+                              int *row_counts, int *row_starts,
+                              int write_mode, const char *outfile,
+                              phase_times *pt, int rank)
+{
+    MPI_Comm node_comm, leader_comm;
+    int node_rank, node_size;
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                        MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_size(node_comm, &node_size);
+
+    // Check that every node holds a consecutive range of world ranks
+    int first_rank, last_rank;
+    MPI_Allreduce(&rank, &first_rank, 1, MPI_INT, MPI_MIN, node_comm);
+    MPI_Allreduce(&rank, &last_rank, 1, MPI_INT, MPI_MAX, node_comm);
+
+    int contiguous = (last_rank - first_rank + 1 == node_size);
+    int all_contiguous;
+    MPI_Allreduce(&contiguous, &all_contiguous, 1, MPI_INT, MPI_LAND,
+                  MPI_COMM_WORLD);
+    if (!all_contiguous) {
+        MPI_Comm_free(&node_comm);
+        return 0;
+    }
+
+    MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, rank,
+                   &leader_comm);
+
+    int row_bytes = w * ch;
+    int halo = imgf_chain_halo(stages, nstages);
+    int node_start = row_starts[first_rank];
+    int node_rows = row_starts[last_rank] + row_counts[last_rank] - node_start;
+
+    /***************************************************************************
+     * Allocate the two node-shared buffers on the leader
+     ***************************************************************************/
+    MPI_Win win[2];
+    unsigned char *node_buf[2];
+    MPI_Aint bytes = (node_rank == 0) ? (MPI_Aint)(node_rows + 2 * halo) * row_bytes : 0;
+
+    for (int b = 0; b < 2; b++) {
+        MPI_Win_allocate_shared(bytes, 1, MPI_INFO_NULL, node_comm,
+                                &node_buf[b], &win[b]);
+        if (node_rank != 0) {
+            MPI_Aint qsize;
+            int qdisp;
+            MPI_Win_shared_query(win[b], 0, &qsize, &qdisp, &node_buf[b]);
+        }
+        MPI_Win_fence(0, win[b]);
+    }
+    int cur = 0;
+
+    /***************************************************************************
+     * Leaders: scatter node bands
+     ***************************************************************************/
+    double t0 = MPI_Wtime();
+    if (leader_comm != MPI_COMM_NULL) {
+        int leader_rank, leader_size;
+        MPI_Comm_rank(leader_comm, &leader_rank);
+        MPI_Comm_size(leader_comm, &leader_size);
+
+        int *node_counts = NULL;
+        int *node_displs = NULL;
+        if (leader_rank == 0) {
+            node_counts = (int*)malloc(leader_size * sizeof(int));
+            node_displs = (int*)malloc(leader_size * sizeof(int));
+            printf("Shared-memory mode: %d node(s), %d rank(s) on root node\n",
+                   leader_size, node_size);
+        }
+
+        int my_count = node_rows * row_bytes;
+        int my_displ = node_start * row_bytes;
+        MPI_Gather(&my_count, 1, MPI_INT, node_counts, 1, MPI_INT, 0, leader_comm);
+        MPI_Gather(&my_displ, 1, MPI_INT, node_displs, 1, MPI_INT, 0, leader_comm);
+
+        imgf_trace_begin("MPI_Scatterv");
+        MPI_Scatterv(img, node_counts, node_displs, MPI_UNSIGNED_CHAR,
+                     node_buf[cur] + halo * row_bytes, my_count,
+                     MPI_UNSIGNED_CHAR, 0, leader_comm);
+        imgf_trace_end();
 
-/*******************************************************************************
- * UTILITY FUNCTIONS
- ******************************************************************************/
+        free(node_counts);
+        free(node_displs);
+    }
+    pt->t[PH_SCATTER] += MPI_Wtime() - t0;
 
-static inline unsigned char clamp255(int v) {
-    if (v < 0) return 0;
-    if (v > 255) return 255;
-    return (unsigned char)v;
-}
+    int local_rows = row_counts[rank];
+    int local_off = halo + row_starts[rank] - node_start;
 
-/*******************************************************************************
- * BUILD GAUSSIAN KERNEL
- ******************************************************************************/
-double* build_gaussian(int ksize, double sigma) {
-    double *k = (double*)malloc(ksize * ksize * sizeof(double));
-    int half = ksize / 2;
-    double sum = 0.0;
+    for (int s = 0; s < nstages; s++) {
+        const imgf_stage *st = &stages[s];
 
-    for (int y = -half; y <= half; y++) {
-        for (int x = -half; x <= half; x++) {
-            double v = exp(-(x*x + y*y) / (2.0 * sigma * sigma));
-            k[(y + half) * ksize + (x + half)] = v;
-            sum += v;
+        /***********************************************************************
+         * Leaders: exchange inter-node halos and fill the image edges
+         ***********************************************************************/
+        t0 = MPI_Wtime();
+        imgf_trace_begin("halo exchange");
+        if (leader_comm != MPI_COMM_NULL) {
+            exchange_halos(node_buf[cur] + halo * row_bytes, node_rows,
+                           st->halo, row_bytes, leader_comm);
         }
+        MPI_Win_fence(0, win[cur]);
+        imgf_trace_end();
+        pt->t[PH_HALO] += MPI_Wtime() - t0;
+
+        /***********************************************************************
+         * Every rank filters its rows in place from the shared buffers. The
+         * rows in front of and behind its band already form the halo.
+         ***********************************************************************/
+        pt->t[PH_COMPUTE] += filter_band(st,
+                                         node_buf[cur] + (local_off - st->halo) * row_bytes,
+                                         node_buf[1 - cur] + local_off * row_bytes,
+                                         w, local_rows, ch, row_starts[rank], h);
+
+        // Waiting for the other ranks of the node counts as synchronisation
+        t0 = MPI_Wtime();
+        MPI_Win_fence(0, win[1 - cur]);
+        pt->t[PH_HALO] += MPI_Wtime() - t0;
+        cur = 1 - cur;
     }
-    
-    // Normalize
-    for (int i = 0; i < ksize * ksize; i++) {
-        k[i] /= sum;
+
+    /***************************************************************************
+     * Leaders collect node bands on root (or write them in parallel)
+     ***************************************************************************/
+    t0 = MPI_Wtime();
+    if (leader_comm != MPI_COMM_NULL) {
+        collect_output(node_buf[cur] + halo * row_bytes, node_rows, node_start,
+                       out, w, h, ch, write_mode, outfile, 0, leader_comm);
+        MPI_Comm_free(&leader_comm);
     }
+    pt->t[PH_GATHER] += MPI_Wtime() - t0;
 
-    return k;
+    MPI_Win_free(&win[1]);
+    MPI_Win_free(&win[0]);
+    MPI_Comm_free(&node_comm);
+    return 1;
 }
 
 /*******************************************************************************
- * LOCAL CONVOLUTION (operates on extended buffer with halos)
- * 
- * extended: buffer containing [halo_top rows] + [local_rows] + [halo_bot rows]
- * local_out: output buffer for local_rows only
- * w: image width
- * local_rows: number of rows this rank is responsible for
- * channels: number of color channels (3 for RGB)
- * kernel: convolution kernel
- * ksize: kernel size
- * halo: number of halo rows on each side
- * global_y_start: starting row index in global image
- * global_h: total image height
+ * FRAME SEQUENCE MODE (persistent communication)
+ *
+ * Processes frames infile % i -> outfile % i for i = first .. first+count-1
+ * (printf-style patterns, e.g. frame_%04d.png). All frames must have the
+ * size of the first one. Everything that does not depend on pixel data is
+ * set up once:
+ *   - the row distribution and Scatterv/Gatherv counts (in rows)
+ *   - a committed row datatype
+ *   - persistent halo requests (MPI_Send_init/MPI_Recv_init) per stage,
+ *     bound to the stage's buffer
+ * so per frame only MPI_Startall/MPI_Waitall remain.
  ******************************************************************************/
-void convolve_rgb_local(unsigned char *extended, unsigned char *local_out,
-                        int w, int local_rows, int channels,
-                        double *kernel, int ksize, int halo,
-                        int global_y_start, int global_h)
+static int init_halo_requests(unsigned char *band, int rows, int halo,
+                              MPI_Datatype row_type, int crank, int csize,
+                              MPI_Request *reqs)
+{
+    int nreqs = 0;
+    if (halo <= 0) return 0;
+
+    int row_bytes;
+    MPI_Type_size(row_type, &row_bytes);
+    int send_rows = (rows >= halo) ? halo : rows;
+
+    if (crank > 0) {
+        MPI_Send_init(band, send_rows, row_type, crank - 1, 0,
+                      MPI_COMM_WORLD, &reqs[nreqs++]);
+        MPI_Recv_init(band - halo * row_bytes, halo, row_type, crank - 1, 1,
+                      MPI_COMM_WORLD, &reqs[nreqs++]);
+    }
+    if (crank < csize - 1) {
+        MPI_Send_init(band + (rows - send_rows) * row_bytes, send_rows,
+                      row_type, crank + 1, 1, MPI_COMM_WORLD, &reqs[nreqs++]);
+        MPI_Recv_init(band + rows * row_bytes, halo, row_type, crank + 1, 0,
+                      MPI_COMM_WORLD, &reqs[nreqs++]);
+    }
+    return nreqs;
+}
+
+static unsigned char* load_frame(const char *pattern, int index,
+                                 int *w, int *h)
+{
+    char path[1024];
+    int ch;
+    snprintf(path, sizeof(path), pattern, index);
+    imgf_trace_begin("stbi_load");
+    unsigned char *img = stbi_load(path, w, h, &ch, 3);
+    imgf_trace_end();
+    if (!img) printf("Error loading frame: %s\n", path);
+    return img;
+}
+
+static int run_frames(const char *inpattern, const char *outpattern,
+                      imgf_stage *stages, int nstages, int first, int count,
+                      int rank, int size)
 {
-    int half = ksize / 2;
+    int w = 0, h = 0, ch = 3;
+    unsigned char *img = NULL;
+    unsigned char *out = NULL;
+
+    /***************************************************************************
+     * One-time setup
+     ***************************************************************************/
+    double setup_start = MPI_Wtime();
+    double first_decode = 0.0;   // frame 0 is loaded here for its size
+
+    if (rank == 0) {
+        img = load_frame(inpattern, first, &w, &h);
+        if (!img) MPI_Abort(MPI_COMM_WORLD, 1);
+        first_decode = MPI_Wtime() - setup_start;
+        out = (unsigned char*)imgf_buffer_alloc((size_t)w * h * ch);
+        printf("Frames: %d x %d, %d frame(s), %d MPI processes\n",
+               w, h, count, size);
+    }
+    MPI_Bcast(&w, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&h, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (!imgf_chain_build(stages, nstages)) {
+        printf("Rank %d: cannot allocate the filter kernels\n", rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    int row_bytes = w * ch;
+    int halo = imgf_chain_halo(stages, nstages);
+    int *row_counts = (int*)malloc(size * sizeof(int));
+    int *row_starts = (int*)malloc(size * sizeof(int));
+    compute_row_distribution(h, size, NULL, halo > 1 ? halo : 1,
+                             row_counts, row_starts);
+    int local_rows = row_counts[rank];
+    int my_start = row_starts[rank];
+
+    MPI_Datatype row_type;
+    MPI_Type_contiguous(row_bytes, MPI_UNSIGNED_CHAR, &row_type);
+    MPI_Type_commit(&row_type);
+
     int extended_rows = local_rows + 2 * halo;
+    unsigned char *extended[2];
+    extended[0] = (unsigned char*)imgf_buffer_alloc((size_t)extended_rows * row_bytes);
+    extended[1] = (unsigned char*)imgf_buffer_alloc((size_t)extended_rows * row_bytes);
 
-    for (int y = 0; y < local_rows; y++) {
-        int global_y = global_y_start + y;  // Global row index
-        
-        for (int x = 0; x < w; x++) {
-            for (int c = 0; c < channels; c++) {
-                double acc = 0.0;
-
-                for (int ky = -half; ky <= half; ky++) {
-                    for (int kx = -half; kx <= half; kx++) {
-                        // Global coordinates
-                        int gx = x + kx;
-                        int gy = global_y + ky;
-
-                        // Clamp to image boundaries (global)
-                        if (gx < 0) gx = 0;
-                        if (gx >= w) gx = w - 1;
-                        if (gy < 0) gy = 0;
-                        if (gy >= global_h) gy = global_h - 1;
-
-                        // Convert global y to extended buffer index
-                        // extended buffer starts at global row (global_y_start - halo)
-                        int ext_y = gy - (global_y_start - halo);
-                        
-                        // Clamp to extended buffer bounds
-                        if (ext_y < 0) ext_y = 0;
-                        if (ext_y >= extended_rows) ext_y = extended_rows - 1;
-
-                        int idx = (ext_y * w + gx) * channels + c;
-                        int kidx = (ky + half) * ksize + (kx + half);
-
-                        acc += extended[idx] * kernel[kidx];
-                    }
-                }
-
-                int out_index = (y * w + x) * channels + c;
-                local_out[out_index] = clamp255((int)acc);
+    // Stage s always reads buffer s % 2, so its requests can be bound now
+    MPI_Request reqs[IMGF_MAX_STAGES][4];
+    int nreqs[IMGF_MAX_STAGES];
+    for (int s = 0; s < nstages; s++) {
+        nreqs[s] = init_halo_requests(extended[s % 2] + halo * row_bytes,
+                                      local_rows, stages[s].halo, row_type,
+                                      rank, size, reqs[s]);
+    }
+
+    double setup_time = MPI_Wtime() - setup_start - first_decode;
+    if (rank == 0) {
+        printf("One-time communication setup: %.6f seconds\n", setup_time);
+        printf("%8s %10s %10s %10s %10s %10s %10s %10s\n", "frame", "decode",
+               "scatter", "halo", "compute", "gather", "encode", "total");
+    }
+
+    /***************************************************************************
+     * Per-frame loop
+     ***************************************************************************/
+    double run_start = MPI_Wtime();
+    double sum[7] = {0};
+    int ok = 1;
+    int done = 0;           // fewer than count if a frame fails to load
+    int write_failed = 0;   // root only
+
+    for (int f = 0; f < count && ok; f++) {
+        double t[7] = {0};   // decode scatter halo compute gather encode total
+        double t0 = MPI_Wtime();
+
+        if (rank == 0 && f > 0) {
+            int fw, fh;
+            stbi_image_free(img);
+            img = load_frame(inpattern, first + f, &fw, &fh);
+            if (img && (fw != w || fh != h)) {
+                printf("Frame %d is %d x %d, expected %d x %d\n",
+                       first + f, fw, fh, w, h);
+                stbi_image_free(img);
+                img = NULL;
+            }
+            ok = (img != NULL);
+        }
+        MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (!ok) break;
+        double t1 = MPI_Wtime();
+        t[0] = t1 - t0 + (f == 0 ? first_decode : 0.0);
+
+        imgf_trace_begin("MPI_Scatterv");
+        MPI_Scatterv(img, row_counts, row_starts, row_type,
+                     extended[0] + halo * row_bytes, local_rows, row_type,
+                     0, MPI_COMM_WORLD);
+        imgf_trace_end();
+        t[1] = MPI_Wtime() - t1;
+
+        int cur = 0;
+        for (int s = 0; s < nstages; s++) {
+            unsigned char *band = extended[cur] + halo * row_bytes;
+
+            double th = MPI_Wtime();
+            imgf_trace_begin("halo exchange");
+            MPI_Startall(nreqs[s], reqs[s]);
+            MPI_Waitall(nreqs[s], reqs[s], MPI_STATUSES_IGNORE);
+            replicate_edges(band, local_rows, stages[s].halo, row_bytes,
+                            rank, size);
+            imgf_trace_end();
+            t[2] += MPI_Wtime() - th;
+
+            t[3] += filter_band(&stages[s], band - stages[s].halo * row_bytes,
+                                extended[1 - cur] + halo * row_bytes,
+                                w, local_rows, ch, my_start, h);
+            cur = 1 - cur;
+        }
+
+        double tg = MPI_Wtime();
+        imgf_trace_begin("MPI_Gatherv");
+        MPI_Gatherv(extended[cur] + halo * row_bytes, local_rows, row_type,
+                    out, row_counts, row_starts, row_type, 0, MPI_COMM_WORLD);
+        imgf_trace_end();
+        t[4] = MPI_Wtime() - tg;
+
+        // Report the slowest rank for the distributed phases
+        MPI_Allreduce(MPI_IN_PLACE, &t[2], 2, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+        if (rank == 0) {
+            char path[1024];
+            double te = MPI_Wtime();
+            snprintf(path, sizeof(path), outpattern, first + f);
+            imgf_trace_begin("stbi_write_png");
+            if (!stbi_write_png(path, w, h, ch, out, row_bytes)) {
+                printf("Error writing image: %s\n", path);
+                write_failed = 1;
             }
+            imgf_trace_end();
+            t[5] = MPI_Wtime() - te;
+            t[6] = MPI_Wtime() - t0 + (f == 0 ? first_decode : 0.0);
+
+            printf("%8d %10.6f %10.6f %10.6f %10.6f %10.6f %10.6f %10.6f\n",
+                   first + f, t[0], t[1], t[2], t[3], t[4], t[5], t[6]);
+            for (int i = 0; i < 7; i++) sum[i] += t[i];
         }
+        done++;
+    }
+
+    double run_time = MPI_Wtime() - run_start + first_decode;
+    if (rank == 0 && done > 0) {
+        printf("%8s %10.6f %10.6f %10.6f %10.6f %10.6f %10.6f %10.6f\n", "mean",
+               sum[0] / done, sum[1] / done, sum[2] / done, sum[3] / done,
+               sum[4] / done, sum[5] / done, sum[6] / done);
+        printf("Sustained rate: %.2f frames/s", done / run_time);
+        if (done < count) printf(" (%d of %d frames)", done, count);
+        printf("\n");
     }
+
+    for (int s = 0; s < nstages; s++)
+        for (int i = 0; i < nreqs[s]; i++)
+            MPI_Request_free(&reqs[s][i]);
+    MPI_Type_free(&row_type);
+    imgf_buffer_free(extended[0]);
+    imgf_buffer_free(extended[1]);
+    free(row_counts);
+    free(row_starts);
+    stbi_image_free(img);
+    imgf_buffer_free(out);
+    return ok && !write_failed ? 0 : 1;
 }
 
 /*******************************************************************************
- * LOCAL SOBEL FILTER
+ * WHOLE-IMAGE FILTERING ON ONE RANK
+ *
+ * Runs the chain over a complete image held by a single rank. Returns a newly
+ * allocated output image, NULL if memory runs out.
  ******************************************************************************/
-void sobel_local(unsigned char *extended, unsigned char *local_out,
-                 int w, int local_rows, int ch, int halo,
-                 int global_y_start, int global_h)
+static unsigned char* filter_whole_image(const imgf_stage *stages, int nstages,
+                                         const unsigned char *img,
+                                         int w, int h, int ch)
 {
-    int extended_rows = local_rows + 2 * halo;
-    
-    // Convert extended region to grayscale
-    unsigned char *gray = (unsigned char*)malloc(w * extended_rows);
-    
-    for (int i = 0; i < w * extended_rows; i++) {
-        int r = extended[i * ch + 0];
-        int g = extended[i * ch + 1];
-        int b = extended[i * ch + 2];
-        gray[i] = (unsigned char)(0.299 * r + 0.587 * g + 0.114 * b);
-    }
-
-    int gx[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
-    int gy[9] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
-
-    for (int y = 0; y < local_rows; y++) {
-        int global_y = global_y_start + y;
-        
-        for (int x = 0; x < w; x++) {
-            double sx = 0.0, sy = 0.0;
-
-            for (int ky = -1; ky <= 1; ky++) {
-                for (int kx = -1; kx <= 1; kx++) {
-                    // Global coordinates
-                    int gxx = x + kx;
-                    int gyy = global_y + ky;
-
-                    // Clamp to image boundaries
-                    if (gxx < 0) gxx = 0;
-                    if (gxx >= w) gxx = w - 1;
-                    if (gyy < 0) gyy = 0;
-                    if (gyy >= global_h) gyy = global_h - 1;
-
-                    // Convert to extended buffer index
-                    int ext_y = gyy - (global_y_start - halo);
-                    if (ext_y < 0) ext_y = 0;
-                    if (ext_y >= extended_rows) ext_y = extended_rows - 1;
-
-                    int val = gray[ext_y * w + gxx];
-                    int kidx = (ky + 1) * 3 + (kx + 1);
-
-                    sx += val * gx[kidx];
-                    sy += val * gy[kidx];
-                }
+    unsigned char *out = (unsigned char*)imgf_buffer_alloc((size_t)w * h * ch);
+    if (!out) return NULL;
+    imgf_trace_begin("filter image");
+    imgf_counters_start(&band_counters);
+    int ok = imgf_apply_chain(stages, nstages, img, out, w, h, ch, IMGF_SERIAL);
+    imgf_counters_stop(&band_counters);
+    imgf_trace_end();
+    if (!ok) {
+        imgf_buffer_free(out);
+        return NULL;
+    }
+    counted_pixels += (double)w * h * nstages;
+    return out;
+}
+
+/*******************************************************************************
+ * TASK FARM MODE
+ *
+ * Filters every image of a directory (or of a list file, one path per line)
+ * into an output directory. Images up to 'split_threshold' pixels are whole
+ * tasks: rank 0 hands them out dynamically to the other ranks, which ask
+ * for the next image as soon as they finish one. Larger images are filtered
+ * afterwards by all ranks together with the band decomposition.
+ ******************************************************************************/
+#define FARM_TAG_READY 10
+#define FARM_TAG_TASK  11
+
+static int is_image_name(const char *name)
+{
+    static const char *exts[] = {".png", ".jpg", ".jpeg", ".bmp", ".tga",
+                                 ".ppm", ".pgm", ".PNG", ".JPG", ".JPEG"};
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++)
+        if (has_suffix(name, exts[i])) return 1;
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Lists the images of a directory or list file; returns the count
+static int list_images(const char *source, char ***paths)
+{
+    int n = 0, cap = 0;
+    *paths = NULL;
+
+#ifdef _WIN32
+    char pattern[1024];
+    WIN32_FIND_DATAA fd;
+    snprintf(pattern, sizeof(pattern), "%s\\*", source);
+    HANDLE hf = FindFirstFileA(pattern, &fd);
+    int is_dir = (hf != INVALID_HANDLE_VALUE);
+    if (is_dir) {
+        do {
+            const char *name = fd.cFileName;
+#else
+    DIR *dir = opendir(source);
+    int is_dir = (dir != NULL);
+    if (is_dir) {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            const char *name = ent->d_name;
+#endif
+            if (!is_image_name(name)) continue;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                *paths = (char**)realloc(*paths, cap * sizeof(char*));
+            }
+            (*paths)[n] = (char*)malloc(strlen(source) + strlen(name) + 2);
+            sprintf((*paths)[n], "%s/%s", source, name);
+            n++;
+#ifdef _WIN32
+        } while (FindNextFileA(hf, &fd));
+        FindClose(hf);
+    }
+#else
+        }
+        closedir(dir);
+    }
+#endif
+
+    if (!is_dir) {
+        FILE *fp = fopen(source, "r");
+        if (!fp) return -1;
+        char line[1024];
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0' || line[0] == '#') continue;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                *paths = (char**)realloc(*paths, cap * sizeof(char*));
+            }
+            (*paths)[n++] = strdup(line);
+        }
+        fclose(fp);
+    }
+    else {
+        qsort(*paths, n, sizeof(char*), compare_names);
+    }
+    return n;
+}
+
+// Filters one whole image on this rank; returns the input bytes, or -1 if
+// it cannot be loaded or written
+static double farm_process(const char *path, const char *outdir,
+                           const imgf_stage *stages, int nstages)
+{
+    int w, h, ch;
+    imgf_trace_begin("stbi_load");
+    unsigned char *img = stbi_load(path, &w, &h, &ch, 3);
+    imgf_trace_end();
+    if (!img) {
+        printf("Error loading image: %s\n", path);
+        return -1.0;
+    }
+    ch = 3;
+
+    unsigned char *res = filter_whole_image(stages, nstages, img, w, h, ch);
+    if (!res) {
+        printf("Out of memory filtering image: %s\n", path);
+        stbi_image_free(img);
+        return -1.0;
+    }
+
+    char outpath[1024];
+    imgf_output_path(outpath, sizeof(outpath), outdir, path);
+    imgf_trace_begin("stbi_write_png");
+    int written = stbi_write_png(outpath, w, h, ch, res, w * ch);
+    imgf_trace_end();
+    if (!written)
+        printf("Error writing image: %s\n", outpath);
+
+    stbi_image_free(img);
+    imgf_buffer_free(res);
+    return written ? (double)w * h * ch : -1.0;
+}
+
+static int run_farm(const char *source, const char *outdir,
+                    imgf_stage *stages, int nstages, double split_threshold,
+                    int rank, int size)
+{
+    char **paths = NULL;
+    int n = 0;
+    char *big = NULL;    // 1 = split across all ranks
+
+    if (!imgf_chain_build(stages, nstages)) {
+        printf("Rank %d: cannot allocate the filter kernels\n", rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    /***************************************************************************
+     * Root lists and classifies the images, then shares the list
+     ***************************************************************************/
+    size_t names_len = 0;
+    char *names = NULL;
+
+    if (rank == 0) {
+        n = list_images(source, &paths);
+        if (n < 0) printf("Cannot read image directory or list: %s\n", source);
+
+        // Ranks write concurrently: two images with the same output name
+        // would silently overwrite each other
+        int earlier = 0;
+        int clash = imgf_output_collision(outdir, (const char *const *)paths, n, &earlier);
+        if (clash >= 0) {
+            char out[1024];
+            imgf_output_path(out, sizeof(out), outdir, paths[clash]);
+            printf("%s and %s would both be written to %s\n",
+                   paths[earlier], paths[clash], out);
+            for (int i = 0; i < n; i++) free(paths[i]);
+            free(paths);
+            paths = NULL;
+            n = -1;
+        }
+
+        big = (char*)calloc(n > 0 ? n : 1, 1);
+        for (int i = 0; i < n; i++) {
+            names_len += strlen(paths[i]) + 1;
+            int iw, ih, ic;
+            if (stbi_info(paths[i], &iw, &ih, &ic) &&
+                (double)iw * ih > split_threshold)
+                big[i] = 1;
+        }
+
+        names = (char*)malloc(names_len + 1);
+        size_t pos = 0;
+        for (int i = 0; i < n; i++) {
+            strcpy(names + pos, paths[i]);
+            pos += strlen(paths[i]) + 1;
+        }
+    }
+
+    MPI_Bcast(&n, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (n <= 0) {
+        if (rank == 0) free(names);
+        free(big);
+        return n < 0;
+    }
+
+    unsigned long long len64 = names_len;
+    MPI_Bcast(&len64, 1, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+    names_len = (size_t)len64;
+    if (rank != 0) {
+        names = (char*)malloc(names_len + 1);
+        big = (char*)malloc(n);
+        paths = (char**)malloc(n * sizeof(char*));
+    }
+    MPI_Bcast(names, (int)names_len, MPI_CHAR, 0, MPI_COMM_WORLD);
+    MPI_Bcast(big, n, MPI_CHAR, 0, MPI_COMM_WORLD);
+    if (rank != 0) {
+        size_t pos = 0;
+        for (int i = 0; i < n; i++) {
+            paths[i] = names + pos;
+            pos += strlen(names + pos) + 1;
+        }
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    int my_images = 0;
+    int my_failed = 0;   // images that could not be loaded or written
+    double my_bytes = 0.0;
+
+    /***************************************************************************
+     * Farm phase: whole images handed out on demand
+     ***************************************************************************/
+    if (size == 1) {
+        for (int i = 0; i < n; i++) {
+            if (big[i]) continue;
+            double bytes = farm_process(paths[i], outdir, stages, nstages);
+            if (bytes >= 0.0) {
+                my_images++;
+                my_bytes += bytes;
+            }
+            else {
+                my_failed++;
+            }
+        }
+    }
+    else if (rank == 0) {
+        int next = 0;
+        int active = size - 1;
+        while (active > 0) {
+            int dummy;
+            MPI_Status st;
+            MPI_Recv(&dummy, 1, MPI_INT, MPI_ANY_SOURCE, FARM_TAG_READY,
+                     MPI_COMM_WORLD, &st);
+
+            while (next < n && big[next]) next++;
+            int task = (next < n) ? next++ : -1;
+            if (task < 0) active--;
+            MPI_Send(&task, 1, MPI_INT, st.MPI_SOURCE, FARM_TAG_TASK,
+                     MPI_COMM_WORLD);
+        }
+    }
+    else {
+        for (;;) {
+            int task, ready = 0;
+            MPI_Send(&ready, 1, MPI_INT, 0, FARM_TAG_READY, MPI_COMM_WORLD);
+            MPI_Recv(&task, 1, MPI_INT, 0, FARM_TAG_TASK, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+            if (task < 0) break;
+
+            double bytes = farm_process(paths[task], outdir, stages, nstages);
+            if (bytes >= 0.0) {
+                my_images++;
+                my_bytes += bytes;
+            }
+            else {
+                my_failed++;
+            }
+        }
+    }
+
+    /***************************************************************************
+     * Split phase: large images use all ranks
+     ***************************************************************************/
+    int halo = imgf_chain_halo(stages, nstages);
+    int *row_counts = (int*)malloc(size * sizeof(int));
+    int *row_starts = (int*)malloc(size * sizeof(int));
+
+    for (int i = 0; i < n; i++) {
+        if (!big[i]) continue;
+
+        int w = 0, h = 0, ch = 3;
+        unsigned char *img = NULL;
+        unsigned char *out = NULL;
+        if (rank == 0) {
+            imgf_trace_begin("stbi_load");
+            img = stbi_load(paths[i], &w, &h, &ch, 3);
+            imgf_trace_end();
+            if (!img) {
+                printf("Error loading image: %s\n", paths[i]);
+                my_failed++;
             }
+            ch = 3;
+            out = img ? (unsigned char*)imgf_buffer_alloc((size_t)w * h * ch) : NULL;
+        }
+        MPI_Bcast(&w, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        MPI_Bcast(&h, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (w == 0) continue;   // root failed to load it
 
-            int mag = (int)sqrt(sx * sx + sy * sy);
-            if (mag > 255) mag = 255;
+        compute_row_distribution(h, size, NULL, halo > 1 ? halo : 1,
+                                 row_counts, row_starts);
+        phase_times pt = {{0}};
+        filter_message_passing(img, NULL, out, w, h, ch, stages, nstages,
+                               row_counts, row_starts, WRITE_GATHER, NULL,
+                               0, &pt, rank, size);
 
-            // Write to all channels
-            for (int c = 0; c < ch; c++) {
-                local_out[(y * w + x) * ch + c] = (unsigned char)mag;
+        if (rank == 0) {
+            char outpath[1024];
+            imgf_output_path(outpath, sizeof(outpath), outdir, paths[i]);
+            imgf_trace_begin("stbi_write_png");
+            int written = stbi_write_png(outpath, w, h, ch, out, w * ch);
+            imgf_trace_end();
+            if (!written) {
+                printf("Error writing image: %s\n", outpath);
+                my_failed++;
+            }
+            else {
+                my_images++;
+                my_bytes += (double)w * h * ch;
             }
         }
+        stbi_image_free(img);
+        imgf_buffer_free(out);
+    }
+
+    /***************************************************************************
+     * Throughput report
+     ***************************************************************************/
+    double elapsed = MPI_Wtime() - start;
+    int *per_rank = NULL;
+    int total_images = 0, total_failed = 0;
+    double total_bytes = 0.0;
+
+    if (rank == 0) per_rank = (int*)malloc(size * sizeof(int));
+    MPI_Gather(&my_images, 1, MPI_INT, per_rank, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&my_images, &total_images, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&my_bytes, &total_bytes, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&my_failed, &total_failed, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        int nbig = 0;
+        for (int i = 0; i < n; i++) nbig += big[i];
+
+        printf("Task farm: %d image(s), %d split across all ranks, %d failed\n",
+               n, nbig, total_failed);
+        printf("Images per rank:");
+        for (int i = 0; i < size; i++) printf(" %d", per_rank[i]);
+        printf("\n");
+        printf("Processed %d image(s) in %.6f seconds\n", total_images, elapsed);
+        printf("Throughput: %.2f images/s, %.2f MB/s\n",
+               total_images / elapsed, total_bytes / elapsed / 1e6);
+
+        for (int i = 0; i < n; i++) free(paths[i]);
+        free(per_rank);
     }
 
-    free(gray);
+    free(paths);
+    free(names);
+    free(big);
+    free(row_counts);
+    free(row_starts);
+    return total_failed > 0;   // root only; the others report 0
 }
 
 /*******************************************************************************
@@ -184,10 +2333,73 @@ int main(int argc, char **argv)
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
+    int use_shm = take_flag(&argc, argv, "shm");
+    const char *write_opt = take_option(&argc, argv, "write");
+    const char *balance_opt = take_option(&argc, argv, "balance");
+    const char *profile_path = take_option(&argc, argv, "profile");
+    const char *frames_opt = take_option(&argc, argv, "frames");
+    const char *first_opt = take_option(&argc, argv, "first");
+    int use_farm = take_flag(&argc, argv, "farm");
+    const char *split_opt = take_option(&argc, argv, "split-threshold");
+    const char *timing_json = take_option(&argc, argv, "timing-json");
+    const char *compress_opt = take_option(&argc, argv, "compress");
+    int use_counters = take_flag(&argc, argv, "counters");
+    int use_roofline = take_flag(&argc, argv, "roofline");
+    int use_prefault = take_flag(&argc, argv, "prefault");
+    const char *pages_opt = take_flag(&argc, argv, "hugepages") ? "thp" : take_option(&argc, argv, "hugepages");
+    const char *trace_path = take_option(&argc, argv, "trace");
+
+    if (frames_opt && (write_opt || use_shm || compress_opt || balance_opt ||
+                       profile_path)) {
+        if (rank == 0) printf("--frames does not support --write, --shm, "
+                              "--compress, --balance or --profile\n");
+        MPI_Finalize();
+        return 1;
+    }
+
     if (argc < 4) {
         if (rank == 0) {
-            printf("Usage: %s input.png output.png [sobel|gaussian|laplacian|sharpen] [params]\n", argv[0]);
+            printf("Usage: %s input.png output.png [sobel|gaussian|laplacian|sharpen] [params] [options]\n", argv[0]);
+            printf("       %s input.png output.png stage,stage,... [options]\n", argv[0]);
             printf("  gaussian requires: ksize sigma\n");
+            printf("  chain stages: sobel, laplacian, sharpen, gaussian:ksize:sigma\n");
+            printf("                e.g. gaussian:5:1.0,sobel\n");
+            printf("Options:\n");
+            printf("  --shm   share buffers between ranks on the same node (MPI-3 shared memory)\n");
+            printf("  --write=gather|stream|mpiio\n");
+            printf("          gather: Gatherv to root, then PNG (default)\n");
+            printf("          stream: root receives bands in rank order and streams them to disk\n");
+            printf("          mpiio:  each rank writes its band of a .ppm with MPI-IO\n");
+            printf("  --balance=calibrate\n");
+            printf("          size bands by a short per-rank timing run of the filter\n");
+            printf("  --profile=FILE\n");
+            printf("          size bands by the per-host speeds in FILE and update it afterwards\n");
+            printf("  --frames=N [--first=K]\n");
+            printf("          process N same-sized frames; input/output are printf patterns\n");
+            printf("          (e.g. in_%%04d.png out_%%04d.png), starting at index K (default 0)\n");
+            printf("  --farm [--split-threshold=PIXELS]\n");
+            printf("          input is a directory or list file, output a directory; whole images\n");
+            printf("          are handed to ranks on demand, images above PIXELS (default\n");
+            printf("          33177600, i.e. 8K UHD) are split across all ranks\n");
+            printf("  --timing-json=FILE\n");
+            printf("          also write the per-rank, per-phase timing report as JSON\n");
+            printf("  --compress=off|on|auto\n");
+            printf("          pack bands and halos with the in-tree delta+LZ codec; auto enables it\n");
+            printf("          when a bandwidth/codec probe predicts a saving (default off)\n");
+            printf("  --counters\n");
+            printf("          count cycles, instructions, cache and branch misses around every\n");
+            printf("          filter call (Linux perf_event_open) and print the totals\n");
+            printf("  --roofline\n");
+            printf("          measure the machine's FLOP/s and memory bandwidth peaks and report\n");
+            printf("          the filter's share of them (single-image mode)\n");
+            printf("  --prefault\n");
+            printf("          touch the pages of newly allocated image and band buffers up front\n");
+            printf("  --hugepages[=thp|hugetlb]\n");
+            printf("          put image and band buffers of 2 MiB and more on huge pages: transparent\n");
+            printf("          (default) or reserved hugetlbfs pages; compare dTLB misses with --counters\n");
+            printf("  --trace=FILE\n");
+            printf("          record load, scatter, halo exchange, filter bands, gather and\n");
+            printf("          write per thread and rank as Chrome trace JSON (open in Perfetto)\n");
         }
         MPI_Finalize();
         return 1;
@@ -197,71 +2409,130 @@ int main(int argc, char **argv)
     char *outfile = argv[2];
     char *mode = argv[3];
 
+    int write_mode = WRITE_GATHER;
+    if (write_opt && strcmp(write_opt, "stream") == 0) {
+        write_mode = WRITE_STREAM;
+    }
+    else if (write_opt && strcmp(write_opt, "mpiio") == 0) {
+        write_mode = WRITE_MPIIO;
+        if (!has_suffix(outfile, ".ppm")) {
+            if (rank == 0) printf("--write=mpiio needs a .ppm output; streaming instead\n");
+            write_mode = WRITE_STREAM;
+        }
+    }
+
     int w = 0, h = 0, ch = 3;
     unsigned char *img = NULL;
     unsigned char *out = NULL;
-    double *kernel = NULL;
-    int ksize = 3;
-    double sigma = 1.0;
+    imgf_stage stages[IMGF_MAX_STAGES];
+    int nstages = 0;
+    phase_times pt = {{0}};
+
+    if (use_counters && !imgf_counters_open(&band_counters) && rank == 0)
+        printf("Hardware counters not available on this system.\n");
+
+    if (trace_path) start_trace(rank);
 
     double start_time = MPI_Wtime();
 
     /***************************************************************************
-     * STEP 1: Parse parameters and determine kernel size
+     * STEP 1: Parse the filter (or filter chain) and its parameters.
+     * Every rank parses the same arguments, so no broadcast is needed.
      ***************************************************************************/
-    if (strcmp(mode, "gaussian") == 0) {
-        if (argc < 6) {
-            if (rank == 0) printf("Usage: gaussian ksize sigma\n");
-            MPI_Finalize();
-            return 1;
-        }
-        ksize = atoi(argv[4]);
-        sigma = atof(argv[5]);
+    if (strcmp(mode, "gaussian") == 0 && argc < 6) {
+        if (rank == 0) printf("Usage: gaussian ksize sigma\n");
+        MPI_Finalize();
+        return 1;
+    }
+    nstages = imgf_parse_filter(mode, argc > 4 ? argv[4] : NULL,
+                                argc > 5 ? argv[5] : NULL,
+                                stages, IMGF_MAX_STAGES);
+
+    if (nstages == 0) {
+        if (rank == 0) printf("Unknown mode or bad parameters: %s\n", mode);
+        MPI_Finalize();
+        return 1;
+    }
+
+    // Image and band buffers come from the libimgfilter pool (--prefault,
+    // --hugepages)
+    imgf_page_mode pages = IMGF_PAGES_DEFAULT;
+    if (pages_opt && !imgf_page_mode_from_name(pages_opt, &pages)) {
+        if (rank == 0) printf("Unknown page mode %s (thp or hugetlb)\n", pages_opt);
+        MPI_Finalize();
+        return 1;
+    }
+    imgf_pool_prefault(use_prefault);
+    imgf_pool_pages(pages);
+
+    if (frames_opt) {
+        int first = first_opt ? atoi(first_opt) : 0;
+        int rc = run_frames(infile, outfile, stages, nstages, first,
+                            atoi(frames_opt), rank, size);
+        if (use_counters) report_counters(rank);
+        report_buffers(rank);
+        if (trace_path) write_trace(trace_path, rank, size);
+        for (int s = 0; s < nstages; s++)
+            imgf_stage_free(&stages[s]);
+        MPI_Finalize();
+        return rc;
+    }
+
+    if (use_farm) {
+        double threshold = split_opt ? atof(split_opt) : 7680.0 * 4320.0;
+        int rc = run_farm(infile, outfile, stages, nstages, threshold,
+                          rank, size);
+        if (use_counters) report_counters(rank);
+        report_buffers(rank);
+        if (trace_path) write_trace(trace_path, rank, size);
+        for (int s = 0; s < nstages; s++)
+            imgf_stage_free(&stages[s]);
+        MPI_Finalize();
+        return rc;
     }
 
-    int halo = ksize / 2;  // Number of rows needed from neighbors
+    int halo = imgf_chain_halo(stages, nstages);  // Rows needed from neighbors
 
     /***************************************************************************
-     * STEP 2: Root loads the image
+     * STEP 2: Root loads the image. A raw image (.imgf, see raw_convert) is
+     * not decoded: every rank maps its own band of it in STEP 7
      ***************************************************************************/
+    double t0 = MPI_Wtime();
+    const char *raw = imgf_raw_info(infile, &w, &h, &ch) ? infile : NULL;
     if (rank == 0) {
-        img = stbi_load(infile, &w, &h, &ch, 3);
-        if (!img) {
-            printf("Error loading image: %s\n", infile);
-            MPI_Abort(MPI_COMM_WORLD, 1);
+        if (!raw) {
+            imgf_trace_begin("stbi_load");
+            img = stbi_load(infile, &w, &h, &ch, 3);
+            imgf_trace_end();
+            if (!img) {
+                printf("Error loading image: %s\n", infile);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            ch = 3;  // Force RGB
         }
-        ch = 3;  // Force RGB
-        out = (unsigned char*)malloc(w * h * ch);
+        if (write_mode == WRITE_GATHER)
+            out = (unsigned char*)imgf_buffer_alloc((size_t)w * h * ch);
         
-        printf("Image loaded: %d x %d, %d channels\n", w, h, ch);
+        printf("Image %s: %d x %d, %d channels\n", raw ? "mapped" : "loaded", w, h, ch);
         printf("Using %d MPI processes\n", size);
     }
+    pt.t[PH_DECODE] = MPI_Wtime() - t0;
 
     /***************************************************************************
-     * STEP 3: Broadcast image dimensions and parameters
+     * STEP 3: Broadcast image dimensions
      ***************************************************************************/
+    t0 = MPI_Wtime();
     MPI_Bcast(&w, 1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&h, 1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&ch, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&ksize, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&sigma, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    halo = ksize / 2;
+    pt.t[PH_BCAST] = MPI_Wtime() - t0;
 
     /***************************************************************************
-     * STEP 4: Build kernel on all processes
+     * STEP 4: Build kernels on all processes
      ***************************************************************************/
-    if (strcmp(mode, "gaussian") == 0) {
-        kernel = build_gaussian(ksize, sigma);
-    } 
-    else if (strcmp(mode, "laplacian") == 0) {
-        kernel = (double*)malloc(9 * sizeof(double));
-        double lap[9] = {0, 1, 0, 1, -4, 1, 0, 1, 0};
-        memcpy(kernel, lap, 9 * sizeof(double));
-    } 
-    else if (strcmp(mode, "sharpen") == 0) {
-        kernel = (double*)malloc(9 * sizeof(double));
-        double sh[9] = {0, -1, 0, -1, 5, -1, 0, -1, 0};
-        memcpy(kernel, sh, 9 * sizeof(double));
+    if (!imgf_chain_build(stages, nstages)) {
+        printf("Rank %d: cannot allocate the filter kernels\n", rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
     /***************************************************************************
@@ -269,125 +2540,76 @@ int main(int argc, char **argv)
      ***************************************************************************/
     int *row_counts = (int*)malloc(size * sizeof(int));
     int *row_starts = (int*)malloc(size * sizeof(int));
+    double *weights = NULL;
 
-    int base_rows = h / size;
-    int extra = h % size;
-
-    int offset = 0;
-    for (int i = 0; i < size; i++) {
-        row_counts[i] = base_rows + (i < extra ? 1 : 0);
-        row_starts[i] = offset;
-        offset += row_counts[i];
+    if (balance_opt && strcmp(balance_opt, "calibrate") == 0) {
+        double rate = calibrate_rank(stages, nstages, w, h, ch);
+        imgf_counters_reset(&band_counters);
+        counted_pixels = 0.0;
+        weights = (double*)malloc(size * sizeof(double));
+        MPI_Allgather(&rate, 1, MPI_DOUBLE, weights, 1, MPI_DOUBLE, MPI_COMM_WORLD);
     }
-
-    int local_rows = row_counts[rank];
-    int my_start = row_starts[rank];
-
-    // Prepare scatter/gather parameters
-    int *sendcounts = (int*)malloc(size * sizeof(int));
-    int *displs = (int*)malloc(size * sizeof(int));
-
-    for (int i = 0; i < size; i++) {
-        sendcounts[i] = row_counts[i] * w * ch;
-        displs[i] = row_starts[i] * w * ch;
+    else if (profile_path) {
+        weights = profile_weights(profile_path, rank, size);
     }
 
-    /***************************************************************************
-     * STEP 6: Scatter image data to all processes
-     ***************************************************************************/
-    unsigned char *local_data = (unsigned char*)malloc(local_rows * w * ch);
-
-    MPI_Scatterv(img, sendcounts, displs, MPI_UNSIGNED_CHAR,
-                 local_data, local_rows * w * ch, MPI_UNSIGNED_CHAR,
-                 0, MPI_COMM_WORLD);
-
-    /***************************************************************************
-     * STEP 7: Create extended buffer with halo regions
-     ***************************************************************************/
-    int extended_rows = local_rows + 2 * halo;
-    unsigned char *extended = (unsigned char*)malloc(extended_rows * w * ch);
+    compute_row_distribution(h, size, weights, halo > 1 ? halo : 1,
+                             row_counts, row_starts);
 
-    // Copy local data to center of extended buffer
-    memcpy(extended + halo * w * ch, local_data, local_rows * w * ch);
+    if (weights && rank == 0) {
+        printf("Row distribution:");
+        for (int i = 0; i < size; i++) printf(" %d", row_counts[i]);
+        printf("\n");
+    }
+    free(weights);
 
     /***************************************************************************
-     * STEP 8: Halo exchange with neighboring processes
+     * STEPS 6-11: Distribute, exchange halos, filter and gather
      ***************************************************************************/
-    MPI_Request reqs[4];
-    int nreqs = 0;
-
-    // Calculate actual halo sizes to send/receive
-    int send_top = (local_rows >= halo) ? halo : local_rows;
-    int send_bot = (local_rows >= halo) ? halo : local_rows;
-
-    // Exchange with previous rank (rank - 1)
-    if (rank > 0) {
-        // Send my first 'send_top' rows to previous rank
-        MPI_Isend(local_data, send_top * w * ch, MPI_UNSIGNED_CHAR,
-                  rank - 1, 0, MPI_COMM_WORLD, &reqs[nreqs++]);
-        
-        // Receive their last rows into my top halo
-        MPI_Irecv(extended, halo * w * ch, MPI_UNSIGNED_CHAR,
-                  rank - 1, 1, MPI_COMM_WORLD, &reqs[nreqs++]);
+    int compress = 0;
+    if (compress_opt && strcmp(compress_opt, "on") == 0) {
+        compress = 1;
     }
+    else if (compress_opt && strcmp(compress_opt, "auto") == 0 && !raw) {
+        // Mapped bands are not scattered, which is most of what it would save
+        compress = decide_compression(img, w, h, ch, rank, size);
+    }
+    if (compress && use_shm && !raw && rank == 0)
+        printf("Compression only applies to message passing; ignored with --shm\n");
+    if (raw && use_shm && rank == 0)
+        printf("Every rank maps its band of %s; --shm ignored\n", infile);
 
-    // Exchange with next rank (rank + 1)
-    if (rank < size - 1) {
-        // Send my last 'send_bot' rows to next rank
-        MPI_Isend(local_data + (local_rows - send_bot) * w * ch,
-                  send_bot * w * ch, MPI_UNSIGNED_CHAR,
-                  rank + 1, 1, MPI_COMM_WORLD, &reqs[nreqs++]);
-        
-        // Receive their first rows into my bottom halo
-        MPI_Irecv(extended + (halo + local_rows) * w * ch,
-                  halo * w * ch, MPI_UNSIGNED_CHAR,
-                  rank + 1, 0, MPI_COMM_WORLD, &reqs[nreqs++]);
+    int done = 0;
+    if (use_shm && !raw) {
+        done = filter_shared_node(img, out, w, h, ch, stages, nstages,
+                                  row_counts, row_starts,
+                                  write_mode, outfile, &pt, rank);
+        if (!done && rank == 0)
+            printf("Ranks are not grouped by node; using message passing\n");
     }
-    
-    MPI_Waitall(nreqs, reqs, MPI_STATUSES_IGNORE);
-    /***************************************************************************
-     * STEP 9: Handle boundary conditions (replicate edge rows)
-     ***************************************************************************/
-    // For rank 0: Fill top halo by replicating first row of local data
-    if (rank == 0) {
-        for (int i = 0; i < halo; i++) {
-            memcpy(extended + i * w * ch,
-                   local_data,  // First row of local data
-                   w * ch);
-        }
+    if (!done) {
+        filter_message_passing(img, raw, out, w, h, ch, stages, nstages,
+                               row_counts, row_starts, write_mode, outfile,
+                               compress, &pt, rank, size);
     }
 
-    // For last rank: Fill bottom halo by replicating last row of local data
-    if (rank == size - 1) {
-        for (int i = 0; i < halo; i++) {
-            memcpy(extended + (halo + local_rows + i) * w * ch,
-                   local_data + (local_rows - 1) * w * ch,  // Last row
-                   w * ch);
-        }
+    if (compress) {
+        double totals[2] = {comp_raw_bytes, comp_sent_bytes};
+        MPI_Allreduce(MPI_IN_PLACE, totals, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        if (rank == 0 && totals[0] > 0.0)
+            printf("Compressed transfers: %.2f MB -> %.2f MB (%.1f%%)\n",
+                   totals[0] / 1e6, totals[1] / 1e6, 100.0 * totals[1] / totals[0]);
     }
 
-    /***************************************************************************
-     * STEP 10: Apply the filter
-     ***************************************************************************/
-    unsigned char *local_out = (unsigned char*)malloc(local_rows * w * ch);
-
-    if (strcmp(mode, "sobel") == 0) {
-        sobel_local(extended, local_out, w, local_rows, ch, halo, my_start, h);
-    } 
-    else {
-        convolve_rgb_local(extended, local_out, w, local_rows, ch,
-                           kernel, ksize, halo, my_start, h);
+    if (profile_path) {
+        double compute_seconds = pt.t[PH_COMPUTE];
+        double rate = (compute_seconds > 0.0) ? row_counts[rank] / compute_seconds : 0.0;
+        update_profile(profile_path, rate, rank, size);
     }
 
-    /***************************************************************************
-     * STEP 11: Gather results back to root
-     ***************************************************************************/
-    MPI_Gatherv(local_out, local_rows * w * ch, MPI_UNSIGNED_CHAR,
-                out, sendcounts, displs, MPI_UNSIGNED_CHAR,
-                0, MPI_COMM_WORLD);
-
     /***************************************************************************
      * STEP 12: Root writes output and reports timing
+     * (streamed and MPI-IO outputs are already on disk at this point)
      ***************************************************************************/
     double end_time = MPI_Wtime();
 
@@ -395,25 +2617,39 @@ int main(int argc, char **argv)
         printf("Filter: %s\n", mode);
         printf("Execution time: %.6f seconds\n", end_time - start_time);
         
-        stbi_write_png(outfile, w, h, ch, out, w * ch);
+        t0 = MPI_Wtime();
+        if (write_mode == WRITE_GATHER) {
+            imgf_trace_begin("stbi_write_png");
+            stbi_write_png(outfile, w, h, ch, out, w * ch);
+            imgf_trace_end();
+        }
+        pt.t[PH_WRITE] = MPI_Wtime() - t0;
+        printf("Total time (including write): %.6f seconds\n",
+               MPI_Wtime() - start_time);
         printf("Output written to: %s\n", outfile);
         
-        free(img);
-        free(out);
+        stbi_image_free(img);
+        imgf_buffer_free(out);
     }
 
+    report_phases(&pt, timing_json, mode, w, h, MPI_Wtime() - start_time,
+                  rank, size);
+
+    report_throughput(stages, nstages, w, h, ch, pt.t[PH_COMPUTE],
+                      use_roofline, rank, size);
+
+    if (use_counters) report_counters(rank);
+    report_buffers(rank);
+    if (trace_path) write_trace(trace_path, rank, size);
+
     /***************************************************************************
      * STEP 13: Cleanup
      ***************************************************************************/
-    free(local_data);
-    free(extended);
-    free(local_out);
     free(row_counts);
     free(row_starts);
-    free(sendcounts);
-    free(displs);
-    if (kernel) free(kernel);
+    for (int s = 0; s < nstages; s++)
+        imgf_stage_free(&stages[s]);
 
     MPI_Finalize();
     return 0;
-}
\ No newline at end of file
+}
@@ -2,137 +2,1359 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
 #include <omp.h>
+#include "imgfilter.h"
+
+// Decoded images come from the libimgfilter pool as well, so --hugepages
+// covers the input buffers and not just the output
+#define STBI_MALLOC(sz) imgf_buffer_alloc(sz)
+#define STBI_REALLOC(p, newsz) imgf_buffer_realloc(p, newsz)
+#define STBI_FREE(p) imgf_buffer_free(p)
 #include "stb_image.h"
 #include "stb_image_write.h"
 
+#include <dirent.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sched.h>
+#endif
+
+/*******************************************************************************
+ * FRAME STREAMS (--stream)
+ *
+ * Input is either a Y4M (YUV4MPEG2) stream with 8-bit 4:2:0, 4:2:2, 4:4:4 or
+ * mono frames, or a sequence of binary PPM/PGM images as written by
+ * "ffmpeg -f image2pipe -c:v ppm -". The output has the same format. "-"
+ * reads stdin / writes stdout, so the filter can sit between a producer and
+ * a consumer; reports then go to stderr.
+ *
+ * Y4M planes are filtered one at a time as 1-channel images. A chain that
+ * contains sobel yields gray edges, so its chroma planes become neutral.
+ ******************************************************************************/
+typedef struct {
+    int y4m;            // 1: Y4M planes, 0: interleaved pixels
+    int w, h, ch;       // ch: PPM/PNG 3, PGM 1; Y4M 1 per plane
+    int cw, chh;        // Y4M chroma plane size, 0 for mono
+} frame_format;
 
-static inline unsigned char clamp255(int v) {
-    if(v < 0) return 0;
-    if(v > 255) return 255;
-    return (unsigned char)v;
+typedef struct {
+    FILE *fp;
+    frame_format f;     // of the last frame read
+    char header[512];   // Y4M stream header, repeated on the output
+    int first;          // first frame's header already consumed
+} frame_stream;
+
+static size_t frame_bytes(const frame_format *f)
+{
+    if(!f->y4m) return (size_t)f->w * f->h * f->ch;
+    return (size_t)f->w * f->h + 2 * (size_t)f->cw * f->chh;
 }
 
-// Laplacian+Sharpen filter
-void convolve_rgb(unsigned char *in, unsigned char *out,
-                  int w, int h, int channels,
-                  double *kernel, int ksize)
+// Grows a pool buffer to at least 'bytes', dropping its contents; 0 if out of memory
+static int reserve_buffer(unsigned char **buf, size_t *cap, size_t bytes)
 {
-int half = ksize / 2;
+    if(bytes <= *cap) return 1;
+    imgf_buffer_free(*buf);
+    *buf = imgf_buffer_alloc(bytes);
+    *cap = *buf ? bytes : 0;
+    return *buf != NULL;
+}
 
-#pragma omp parallel for collapse(2) schedule(guided)
-for(int y = 0; y < h; y++) {
-    for(int x = 0; x < w; x++) {
-        for(int c = 0; c < channels; c++) {
-            double acc = 0.0;  
+static const char* frame_kind(const frame_format *f)
+{
+    return f->y4m ? "Y4M" : (f->ch == 3 ? "PPM" : "PGM");
+}
 
-            for(int ky = -half; ky <= half; ky++) {
-                for(int kx = -half; kx <= half; kx++) {
-                    int xx = x + kx;
-                    int yy = y + ky;
+// Next whitespace-separated PNM header number, skipping comments
+static int pnm_number(FILE *fp, int *value)
+{
+    int c = fgetc(fp);
+    for(;;) {
+        while(c == ' ' || c == '\t' || c == '\n' || c == '\r') c = fgetc(fp);
+        if(c != '#') break;
+        while(c != '\n' && c != EOF) c = fgetc(fp);
+    }
+    if(c < '0' || c > '9') return 0;
+    *value = 0;
+    while(c >= '0' && c <= '9') {
+        *value = *value * 10 + (c - '0');
+        if(*value > 1000000) return 0;
+        c = fgetc(fp);
+    }
+    return 1;   // the single whitespace after the number is consumed
+}
 
+// Rest of a PNM header after "P5"/"P6"; 1 on success
+static int read_pnm_header(frame_stream *fs, int magic)
+{
+    int w, h, maxval;
+    if(!pnm_number(fs->fp, &w) || !pnm_number(fs->fp, &h) ||
+       !pnm_number(fs->fp, &maxval) || w < 1 || h < 1 || maxval != 255) {
+        fprintf(stderr, "Unsupported PNM frame (8-bit P5/P6 only)\n");
+        return 0;
+    }
+    fs->f.w = w;
+    fs->f.h = h;
+    fs->f.ch = (magic == '6') ? 3 : 1;
+    return 1;
+}
 
-                    if(xx < 0) xx = 0;
-                    if(xx >= w) xx = w-1;
-                    if(yy < 0) yy = 0;
-                    if(yy >= h) yy = h-1;
+static int parse_y4m_header(frame_stream *fs)
+{
+    char *line = fs->header;
+    int chroma_w_shift = 1, chroma_h_shift = 1, mono = 0;
+    fs->f.w = fs->f.h = 0;
 
-                    int idx = (yy * w + xx) * channels + c;
-                    int kidx = (ky + half)*ksize + (kx + half);
+    char copy[sizeof(fs->header)];
+    strcpy(copy, line);
+    for(char *tok = strtok(copy, " \n"); tok; tok = strtok(NULL, " \n")) {
+        if(tok[0] == 'W') fs->f.w = atoi(tok + 1);
+        else if(tok[0] == 'H') fs->f.h = atoi(tok + 1);
+        else if(tok[0] == 'C') {
+            const char *cs = tok + 1;
+            if(cs[0] && cs[1] && cs[2] && cs[3] == 'p' && cs[4] >= '0' && cs[4] <= '9') {
+                fprintf(stderr, "Unsupported Y4M bit depth: %s\n", cs);
+                return 0;
+            }
+            if(strncmp(cs, "420", 3) == 0) {
+                chroma_w_shift = chroma_h_shift = 1;
+            }
+            else if(strcmp(cs, "422") == 0) {
+                chroma_w_shift = 1;
+                chroma_h_shift = 0;
+            }
+            else if(strcmp(cs, "444") == 0) {
+                chroma_w_shift = chroma_h_shift = 0;
+            }
+            else if(strcmp(cs, "mono") == 0) {
+                mono = 1;
+            }
+            else {
+                fprintf(stderr, "Unsupported Y4M colour space: %s\n", cs);
+                return 0;
+            }
+        }
+    }
+    if(fs->f.w < 1 || fs->f.h < 1) {
+        fprintf(stderr, "Y4M header without frame size\n");
+        return 0;
+    }
 
-                    acc += in[idx] * kernel[kidx];
-                }
+    fs->f.ch = 1;
+    fs->f.cw = mono ? 0 : (fs->f.w + chroma_w_shift) >> chroma_w_shift;
+    fs->f.chh = mono ? 0 : (fs->f.h + chroma_h_shift) >> chroma_h_shift;
+    return 1;
+}
+
+static int open_stream(frame_stream *fs, const char *path)
+{
+    memset(fs, 0, sizeof(*fs));
+    fs->fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if(!fs->fp) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 0;
+    }
+
+    int c0 = fgetc(fs->fp), c1 = fgetc(fs->fp);
+    if(c0 == 'Y' && c1 == 'U') {
+        fs->f.y4m = 1;
+        strcpy(fs->header, "YU");
+        if(!fgets(fs->header + 2, sizeof(fs->header) - 2, fs->fp) ||
+           strncmp(fs->header, "YUV4MPEG2 ", 10) != 0 ||
+           strchr(fs->header, '\n') == NULL) {
+            fprintf(stderr, "Bad Y4M header\n");
+            return 0;
+        }
+        return parse_y4m_header(fs);
+    }
+    if(c0 == 'P' && (c1 == '5' || c1 == '6')) {
+        fs->first = 1;
+        return read_pnm_header(fs, c1);
+    }
+
+    fprintf(stderr, "Input is neither Y4M nor a PPM/PGM stream\n");
+    return 0;
+}
+
+// Reads the next frame into *buf (grown as needed); 1 ok, 0 end, -1 error
+static int read_frame(frame_stream *fs, unsigned char **buf, size_t *cap)
+{
+    if(fs->f.y4m) {
+        char tag[256];
+        if(!fgets(tag, sizeof(tag), fs->fp)) return 0;
+        if(strncmp(tag, "FRAME", 5) != 0 || strchr(tag, '\n') == NULL) {
+            fprintf(stderr, "Bad Y4M frame header\n");
+            return -1;
+        }
+    }
+    else if(fs->first) {
+        fs->first = 0;
+    }
+    else {
+        // Every PNM frame has its own header; sizes may change
+        int c0 = fgetc(fs->fp), c1 = fgetc(fs->fp);
+        if(c0 == EOF) return 0;
+        if(c0 != 'P' || (c1 != '5' && c1 != '6') || !read_pnm_header(fs, c1))
+            return -1;
+    }
+
+    size_t bytes = frame_bytes(&fs->f);
+    if(!reserve_buffer(buf, cap, bytes)) return -1;
+    if(fread(*buf, 1, bytes, fs->fp) != bytes) {
+        fprintf(stderr, "Truncated frame\n");
+        return -1;
+    }
+    return 1;
+}
+
+static int write_frame(FILE *fp, const frame_format *f, const unsigned char *buf)
+{
+    if(f->y4m) fputs("FRAME\n", fp);
+    else fprintf(fp, "P%c\n%d %d\n255\n", f->ch == 3 ? '6' : '5', f->w, f->h);
+    return fwrite(buf, 1, frame_bytes(f), fp) == frame_bytes(f);
+}
+
+/*
+ * Half-resolution preview: 2x2 averages, the chain at half size, and each
+ * result pixel repeated 2x2. 'scratch' holds two half-size planes.
+ */
+static int filter_half(const imgf_stage *stages, int nstages,
+                       const unsigned char *in, unsigned char *out,
+                       int w, int h, int ch, unsigned char *scratch)
+{
+    int hw = (w + 1) / 2, hh = (h + 1) / 2;
+    unsigned char *small = scratch;
+    unsigned char *small_out = scratch + (size_t)hw * hh * ch;
+
+    #pragma omp parallel for
+    for(int y=0; y<hh; y++) {
+        int y1 = (2*y + 1 < h) ? 2*y + 1 : 2*y;
+        for(int x=0; x<hw; x++) {
+            int x1 = (2*x + 1 < w) ? 2*x + 1 : 2*x;
+            for(int c=0; c<ch; c++) {
+                int sum = in[((size_t)2*y * w + 2*x) * ch + c] + in[((size_t)2*y * w + x1) * ch + c] +
+                          in[((size_t)y1 * w + 2*x) * ch + c] + in[((size_t)y1 * w + x1) * ch + c];
+                small[((size_t)y * hw + x) * ch + c] = (unsigned char)((sum + 2) / 4);
             }
-            int out_index = (y * w + x) * channels + c;
-            out[out_index] = clamp255((int)acc); 
         }
     }
+
+    if(!imgf_apply_chain(stages, nstages, small, small_out, hw, hh, ch, IMGF_THREADS))
+        return 0;
+
+    #pragma omp parallel for
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            memcpy(&out[((size_t)y * w + x) * ch],
+                   &small_out[((size_t)(y/2) * hw + x/2) * ch], ch);
+    return 1;
+}
+
+static int filter_plane(const imgf_stage *stages, int nstages,
+                        const unsigned char *in, unsigned char *out,
+                        int w, int h, int ch, unsigned char *half_scratch)
+{
+    if(half_scratch) return filter_half(stages, nstages, in, out, w, h, ch, half_scratch);
+    return imgf_apply_chain(stages, nstages, in, out, w, h, ch, IMGF_THREADS);
+}
+
+// 'half_scratch' (see half_scratch_bytes) selects the half-resolution preview.
+// 0 if the filters run out of memory
+static int filter_frame(const frame_format *f, const imgf_stage *stages,
+                        int nstages, const unsigned char *in, unsigned char *out,
+                        unsigned char *half_scratch)
+{
+    if(!f->y4m)
+        return filter_plane(stages, nstages, in, out, f->w, f->h, f->ch, half_scratch);
+
+    size_t luma = (size_t)f->w * f->h;
+    size_t chroma = (size_t)f->cw * f->chh;
+    if(!filter_plane(stages, nstages, in, out, f->w, f->h, 1, half_scratch)) return 0;
+    if(chroma == 0) return 1;
+
+    int edges = 0;
+    for(int s=0; s<nstages; s++)
+        if(strcmp(stages[s].name, "sobel") == 0) edges = 1;
+
+    if(edges) {
+        memset(out + luma, 128, 2 * chroma);
+        return 1;
+    }
+    for(int p=0; p<2; p++) {
+        if(!filter_plane(stages, nstages, in + luma + p * chroma,
+                         out + luma + p * chroma, f->cw, f->chh, 1, half_scratch))
+            return 0;
+    }
+    return 1;
+}
+
+// Scratch filter_frame needs for the half-resolution preview of a frame
+static size_t half_scratch_bytes(const frame_format *f)
+{
+    return 2 * (size_t)((f->w + 1) / 2) * ((f->h + 1) / 2) * f->ch;
+}
+
+/*******************************************************************************
+ * LATENCY REPORT
+ * Percentiles and a histogram with power-of-two millisecond buckets.
+ ******************************************************************************/
+#define LATENCY_BUCKETS 16   // [0, 0.25) ms, [0.25, 0.5), ... , >= 4096 ms
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency_report(FILE *fp, const char *title, double *lat, int n)
+{
+    if(n == 0) return;
+    qsort(lat, n, sizeof(double), compare_doubles);
+
+    fprintf(fp, "%s (ms): min %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n", title,
+            1e3 * lat[0], 1e3 * lat[n / 2], 1e3 * lat[(int)(0.9 * (n - 1))],
+            1e3 * lat[(int)(0.99 * (n - 1))], 1e3 * lat[n - 1]);
+
+    int count[LATENCY_BUCKETS] = {0};
+    for(int i=0; i<n; i++) {
+        double ms = 1e3 * lat[i];
+        int b = 0;
+        for(double edge = 0.25; b < LATENCY_BUCKETS - 1 && ms >= edge; edge *= 2.0) b++;
+        count[b]++;
+    }
+
+    int lo = 0, hi = LATENCY_BUCKETS - 1, peak = 1;
+    while(count[lo] == 0) lo++;
+    while(count[hi] == 0) hi--;
+    for(int b=lo; b<=hi; b++) if(count[b] > peak) peak = count[b];
+
+    for(int b=lo; b<=hi; b++) {
+        double from = b == 0 ? 0.0 : 0.25 * (1 << (b - 1));
+        char range[32];
+        if(b == LATENCY_BUCKETS - 1) snprintf(range, sizeof(range), ">= %g", from);
+        else snprintf(range, sizeof(range), "%g - %g", from, 0.25 * (1 << b));
+        fprintf(fp, "  %16s ms %8d ", range, count[b]);
+        for(int i=0; i<(40 * count[b] + peak - 1) / peak; i++) fputc('#', fp);
+        fputc('\n', fp);
+    }
+}
+
+/*******************************************************************************
+ * FRAME LOG
+ * Per-frame latency and filter time, shared by the sequential and the
+ * pipelined frame loops.
+ ******************************************************************************/
+typedef struct {
+    double *latency, *filter_time;
+    int frames, cap;
+    double pixels, filter_total;
+    frame_format last;
+} frame_log;
+
+static void log_frame(frame_log *log, const frame_format *f,
+                      double latency, double filter_time)
+{
+    #pragma omp critical(frame_log)
+    {
+        if(log->frames == log->cap) {
+            log->cap = log->cap ? 2 * log->cap : 1024;
+            log->latency = realloc(log->latency, log->cap * sizeof(double));
+            log->filter_time = realloc(log->filter_time, log->cap * sizeof(double));
+        }
+        log->latency[log->frames] = latency;
+        log->filter_time[log->frames] = filter_time;
+        log->frames++;
+        log->pixels += (double)f->w * f->h;
+        log->filter_total += filter_time;
+        log->last = *f;
+    }
+}
+
+static void print_frame_log(frame_log *log, const char *kind, double elapsed,
+                            const imgf_stage *stages, int nstages,
+                            const imgf_counters *counters)
+{
+    fprintf(stderr, "Stream: %d frame(s) of %dx%d %s in %.3f s, %.2f fps sustained\n",
+            log->frames, log->last.w, log->last.h, kind,
+            elapsed, elapsed > 0.0 ? log->frames / elapsed : 0.0);
+    print_latency_report(stderr, "Frame latency (filter + write)", log->latency, log->frames);
+    print_latency_report(stderr, "Filter time", log->filter_time, log->frames);
+    if(log->frames > 0)
+        imgf_throughput_print(stderr, "Throughput", stages, nstages,
+                              log->pixels, log->last.ch, log->filter_total);
+    if(counters->enabled)
+        imgf_counters_print(stderr, "Counters", counters, log->pixels * nstages);
+    imgf_pool_print(stderr, "Buffers");
+
+    free(log->latency);
+    free(log->filter_time);
+}
+
+/*******************************************************************************
+ * FRAME DEADLINES (--deadline=MS)
+ *
+ * Every frame should be written within MS milliseconds of being read. Before
+ * a frame is filtered the scheduler predicts what each quality level would
+ * cost, from the filter and write time per byte of recent frames, and takes
+ * the best level that still meets the deadline:
+ *   full          the chain as given
+ *   small kernel  gaussian stages reduced to 3x3
+ *   half res      the reduced chain on a 2x2-averaged frame, scaled back up
+ *   drop          the frame is not written
+ * A level that has not run yet is assumed to fit, so its cost gets measured.
+ * Levels better than the chosen one are not measured while the stream is
+ * degraded, so on every degraded frame their estimates decay towards the
+ * cost just measured for the chosen level. A decayed estimate is only
+ * trusted with SCHED_MARGIN headroom; once it fits that way the level runs
+ * and is measured again. A slow start (page faults, thread start-up) then
+ * does not keep the stream degraded for good, and no frame is run at a
+ * level predicted to miss. Small kernel is skipped when the chain has no
+ * gaussian stage to reduce.
+ ******************************************************************************/
+enum { LEVEL_FULL, LEVEL_SMALL_KERNEL, LEVEL_HALF_RES, LEVEL_DROP, NUM_LEVELS };
+
+#define SCHED_DECAY 0.99     // share of a stale estimate's excess kept per frame
+#define SCHED_MARGIN 1.5     // headroom a stale estimate must fit with
+
+typedef struct {
+    double budget;                        // seconds; 0: no deadlines
+    imgf_stage reduced[IMGF_MAX_STAGES];  // built, for small kernel and half res
+    int nstages;
+    int reduces;                          // some stage differs in 'reduced'
+    double cost[LEVEL_DROP];              // filter seconds per byte, 0: unknown
+    int stale[LEVEL_DROP];                // cost decayed since it was measured
+    double write_cost;                    // write seconds per byte
+    unsigned char *scratch;               // half-resolution planes
+    size_t scratch_cap;
+    int frames[NUM_LEVELS];
+    int missed;
+} deadline_sched;
+
+// 0 if the reduced kernels cannot be allocated
+static int sched_init(deadline_sched *ds, double budget,
+                      const imgf_stage *stages, int nstages)
+{
+    memset(ds, 0, sizeof(*ds));
+    ds->budget = budget;
+    ds->nstages = nstages;
+    for(int s=0; s<nstages; s++) {
+        ds->reduced[s] = stages[s];
+        if(strcmp(stages[s].name, "gaussian") == 0 && stages[s].ksize > 3) {
+            ds->reduced[s].ksize = 3;
+            ds->reduced[s].halo = 1;
+            ds->reduces = 1;
+        }
+        ds->reduced[s].kernel = NULL;
+    }
+    return budget <= 0.0 || imgf_chain_build(ds->reduced, nstages);
+}
+
+static void sched_free(deadline_sched *ds)
+{
+    for(int s=0; s<ds->nstages; s++) imgf_stage_free(&ds->reduced[s]);
+    imgf_buffer_free(ds->scratch);
+}
+
+static void update_cost(double *cost, double seconds, size_t bytes)
+{
+    double sample = seconds / (double)bytes;
+    *cost = *cost > 0.0 ? 0.8 * *cost + 0.2 * sample : sample;
+}
+
+// Quality level for a frame with 'remaining' seconds left before its deadline
+static int sched_choose(deadline_sched *ds, const frame_format *f, double remaining)
+{
+    if(ds->budget <= 0.0) return LEVEL_FULL;
+
+    size_t bytes = frame_bytes(f);
+    double write_cost;
+    #pragma omp atomic read
+    write_cost = ds->write_cost;
+
+    int level = LEVEL_FULL;
+    for(; level<LEVEL_DROP; level++) {
+        if(level == LEVEL_SMALL_KERNEL && !ds->reduces) continue;
+        double margin = ds->stale[level] ? SCHED_MARGIN : 1.0;
+        if(ds->cost[level] == 0.0 ||
+           (ds->cost[level] * margin + write_cost) * (double)bytes <= remaining)
+            break;
+    }
+
+    // Better levels cost at least what the chosen one does
+    double lower = ds->cost[level < LEVEL_DROP ? level : LEVEL_HALF_RES];
+    for(int l=0; l<level && l<LEVEL_DROP; l++) {
+        if(ds->cost[l] > lower) {
+            ds->cost[l] = lower + (ds->cost[l] - lower) * SCHED_DECAY;
+            ds->stale[l] = 1;
+        }
+    }
+    return level;
+}
+
+// Filters at 'level' (not LEVEL_DROP) and learns its cost; 0 as filter_frame
+static int sched_filter(deadline_sched *ds, int level, const frame_format *f,
+                        const imgf_stage *stages, int nstages,
+                        const unsigned char *in, unsigned char *out)
+{
+    double t0 = omp_get_wtime();
+    int ok;
+    if(level == LEVEL_FULL) {
+        ok = filter_frame(f, stages, nstages, in, out, NULL);
+    }
+    else if(level == LEVEL_SMALL_KERNEL) {
+        ok = filter_frame(f, ds->reduced, nstages, in, out, NULL);
+    }
+    else {
+        if(reserve_buffer(&ds->scratch, &ds->scratch_cap, half_scratch_bytes(f)))
+            ok = filter_frame(f, ds->reduced, nstages, in, out, ds->scratch);
+        else
+            ok = filter_frame(f, ds->reduced, nstages, in, out, NULL);
+    }
+    if(!ok) return 0;
+    if(ds->budget > 0.0) {
+        // A measurement replaces a decayed estimate rather than averaging with it
+        if(ds->stale[level]) ds->cost[level] = 0.0;
+        ds->stale[level] = 0;
+        update_cost(&ds->cost[level], omp_get_wtime() - t0, frame_bytes(f));
+    }
+    return 1;
+}
+
+// After a frame is written: its write cost and whether it was late
+static void sched_written(deadline_sched *ds, const frame_format *f,
+                          double write_seconds, double latency)
+{
+    if(ds->budget <= 0.0) return;
+    #pragma omp critical(deadline)
+    {
+        double cost = ds->write_cost;
+        update_cost(&cost, write_seconds, frame_bytes(f));
+        #pragma omp atomic write
+        ds->write_cost = cost;
+        if(latency > ds->budget) ds->missed++;
+    }
+}
+
+static void sched_print(const deadline_sched *ds)
+{
+    if(ds->budget <= 0.0) return;
+    fprintf(stderr, "Deadline %.1f ms: %d missed, %d full, %d with smaller kernels, "
+            "%d at half resolution, %d dropped\n", 1e3 * ds->budget, ds->missed,
+            ds->frames[LEVEL_FULL], ds->frames[LEVEL_SMALL_KERNEL],
+            ds->frames[LEVEL_HALF_RES], ds->frames[LEVEL_DROP]);
+}
+
+/*******************************************************************************
+ * STREAM MODE
+ * Kernels and frame buffers are set up once and reused for every frame.
+ * Latency is measured from a frame being read to it being written, so time
+ * spent waiting for the producer is not counted.
+ ******************************************************************************/
+static FILE* open_output(const frame_stream *fs, const char *outfile)
+{
+    FILE *out_fp = strcmp(outfile, "-") == 0 ? stdout : fopen(outfile, "wb");
+    if(!out_fp) {
+        fprintf(stderr, "Cannot open %s\n", outfile);
+        return NULL;
+    }
+    if(fs->f.y4m) fputs(fs->header, out_fp);
+    return out_fp;
+}
+
+static int run_stream(const char *infile, const char *outfile,
+                      const imgf_stage *stages, int nstages, imgf_counters *counters,
+                      double deadline)
+{
+    deadline_sched ds;
+    if(!sched_init(&ds, deadline, stages, nstages)) {
+        fprintf(stderr, "Cannot allocate the filter kernels\n");
+        return 1;
+    }
+    frame_stream fs;
+    if(!open_stream(&fs, infile)) return 1;
+    FILE *out_fp = open_output(&fs, outfile);
+    if(!out_fp) return 1;
+
+    unsigned char *in = NULL, *out = NULL;
+    size_t in_cap = 0, out_cap = 0;
+    frame_log log = {0};
+    int rc;
+
+    double start = omp_get_wtime();
+    for(;;) {
+        imgf_trace_begin("read frame");
+        rc = read_frame(&fs, &in, &in_cap);
+        imgf_trace_end();
+        if(rc <= 0) break;
+
+        double t0 = omp_get_wtime();
+        if(!reserve_buffer(&out, &out_cap, in_cap)) {
+            rc = -1;
+            break;
+        }
+
+        int level = sched_choose(&ds, &fs.f, deadline - (omp_get_wtime() - t0));
+        ds.frames[level]++;
+        if(level == LEVEL_DROP) continue;
+
+        imgf_counters_start(counters);
+        imgf_trace_begin("filter");
+        int filtered = sched_filter(&ds, level, &fs.f, stages, nstages, in, out);
+        imgf_trace_end();
+        imgf_counters_stop(counters);
+        if(!filtered) {
+            fprintf(stderr, "Out of memory filtering frame %d\n", log.frames);
+            rc = -1;
+            break;
+        }
+        double t1 = omp_get_wtime();
+
+        imgf_trace_begin("write frame");
+        int ok = write_frame(out_fp, &fs.f, out) && fflush(out_fp) == 0;
+        imgf_trace_end();
+        if(!ok) {
+            fprintf(stderr, "Cannot write frame %d\n", log.frames);
+            rc = -1;
+            break;
+        }
+
+        double t2 = omp_get_wtime();
+        sched_written(&ds, &fs.f, t2 - t1, t2 - t0);
+        log_frame(&log, &fs.f, t2 - t0, t1 - t0);
+    }
+    double elapsed = omp_get_wtime() - start;
+
+    if(out_fp != stdout) fclose(out_fp);
+    if(fs.fp != stdin) fclose(fs.fp);
+
+    print_frame_log(&log, frame_kind(&fs.f), elapsed, stages, nstages, counters);
+    sched_print(&ds);
+    sched_free(&ds);
+    imgf_buffer_free(in);
+    imgf_buffer_free(out);
+    return rc < 0 ? 1 : 0;
+}
+
+/*******************************************************************************
+ * IMAGE SEQUENCES
+ * A file name with one printf number (e.g. frames/f%04d.png) names a
+ * sequence starting at 0 or 1 and ending before the first missing file.
+ * Frames are decoded with stb_image and written as PNG, each on its own, so
+ * several threads can decode and encode at once.
+ ******************************************************************************/
+
+// Exactly one %d, %Nd or %0Nd and no other conversion
+static int sequence_pattern(const char *name)
+{
+    const char *p = strchr(name, '%');
+    if(!p) return 0;
+    p++;
+    while(*p >= '0' && *p <= '9') p++;
+    return *p == 'd' && strchr(p, '%') == NULL;
+}
+
+static int file_exists(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if(fp) fclose(fp);
+    return fp != NULL;
+}
+
+// Number of frames; *first is the number of the first one
+static int count_sequence(const char *pattern, int *first)
+{
+    char path[1024];
+    for(*first = 0; *first <= 1; (*first)++) {
+        int n = 0;
+        for(;;) {
+            snprintf(path, sizeof(path), pattern, *first + n);
+            if(!file_exists(path)) break;
+            n++;
+        }
+        if(n > 0) return n;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * PIPELINE (--pipeline[=D:F:E])
+ *
+ * Decode, filter and encode run at the same time on different frames: while
+ * frame N is filtered, frame N+1 is decoded and frame N-1 encoded. D threads
+ * decode, one thread drives the filter with an OpenMP team of F threads and
+ * E threads encode. D + E + 2 frame jobs circulate through three bounded
+ * queues (free -> decoded -> filtered -> free), so memory stays bounded and
+ * frame buffers are reused. A byte stream can only be read and written in
+ * order, so streams always use one decode and one encode thread.
+ ******************************************************************************/
+typedef struct frame_job {
+    int index;                 // frame number
+    frame_format f;
+    unsigned char *in, *out;
+    size_t in_cap, out_cap;
+    double decoded, filter_seconds;
+} frame_job;
+
+/*
+ * Bounded multi-producer multi-consumer queue without locks (D. Vyukov's
+ * design): each cell carries a sequence number that says whether it is free
+ * for the producer or full for the consumer at a given position, and a
+ * position is claimed with one compare-and-swap on head or tail.
+ */
+typedef struct {
+    atomic_size_t seq;
+    frame_job *job;
+} queue_cell;
+
+typedef struct {
+    queue_cell *cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t tail;   // next position to fill
+    _Alignas(64) atomic_size_t head;   // next position to drain
+} job_queue;
+
+static int queue_init(job_queue *q, size_t min_size)
+{
+    size_t size = 1;
+    while(size < min_size) size *= 2;
+    q->cells = malloc(size * sizeof(queue_cell));
+    if(!q->cells) return 0;
+    for(size_t i=0; i<size; i++) {
+        atomic_init(&q->cells[i].seq, i);
+        q->cells[i].job = NULL;
+    }
+    q->mask = size - 1;
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+    return 1;
+}
+
+static int queue_try_push(job_queue *q, frame_job *job)
+{
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    queue_cell *cell;
+    for(;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        long diff = (long)(seq - pos);
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed))
+                break;
+        }
+        else if(diff < 0) {
+            return 0;   // full
+        }
+        else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+    cell->job = job;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
 }
+
+static frame_job* queue_try_pop(job_queue *q)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    queue_cell *cell;
+    for(;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        long diff = (long)(seq - (pos + 1));
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed))
+                break;
+        }
+        else if(diff < 0) {
+            return NULL;   // empty
+        }
+        else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+    frame_job *job = cell->job;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return job;
 }
 
-// Used for Sobel
-unsigned char* to_grayscale(unsigned char *img, int w, int h, int ch) {
-    unsigned char *g = malloc(w * h);
-    #pragma omp parallel for default(none) shared(img,w,h,g,ch) 
-    for(int i=0;i<w*h;i++) {
-        int r = img[i*ch + 0];
-        int g1 = img[i*ch + 1];
-        int b = img[i*ch + 2];
+// A waiting stage gives its core to the others instead of spinning on it
+static void yield_cpu(void)
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+static void queue_push(job_queue *q, frame_job *job)
+{
+    while(!queue_try_push(q, job)) yield_cpu();
+}
 
-        g[i] = (unsigned char)(0.299*r + 0.587*g1 + 0.114*b);
+static frame_job* queue_pop(job_queue *q)
+{
+    frame_job *job;
+    while(!(job = queue_try_pop(q))) yield_cpu();
+    return job;
+}
+
+static frame_job end_of_frames;   // passed down the queues when input ends
+
+typedef struct {
+    frame_stream *fs;                   // NULL for an image sequence
+    FILE *out_fp;
+    const char *in_pattern, *out_pattern;
+    int first, nframes;
+    atomic_int next_frame;
+
+    const imgf_stage *stages;
+    int nstages;
+    imgf_counters *counters;
+    int decoders, filter_threads, encoders;
+
+    job_queue free_jobs, decoded, filtered;
+    atomic_int decoders_left;
+    atomic_int failed;
+    frame_log log;
+    deadline_sched ds;
+    double busy[3];                     // decode, filter, encode seconds
+} pipeline;
+
+// 1 ok, 0 end of input, -1 error
+static int decode_job(pipeline *p, frame_job *job)
+{
+    if(p->fs) {
+        int rc = read_frame(p->fs, &job->in, &job->in_cap);
+        job->f = p->fs->f;
+        job->index = p->next_frame++;   // one decoder for streams
+        return rc;
     }
-    return g;
+
+    int i = atomic_fetch_add(&p->next_frame, 1);
+    if(i >= p->nframes) return 0;
+
+    char path[1024];
+    int w, h, ch;
+    snprintf(path, sizeof(path), p->in_pattern, p->first + i);
+    stbi_image_free(job->in);
+    job->in = stbi_load(path, &w, &h, &ch, 3);
+    if(!job->in) {
+        fprintf(stderr, "Error loading %s\n", path);
+        return -1;
+    }
+    job->f = (frame_format){0, w, h, 3, 0, 0};
+    job->index = i;
+    return 1;
 }
 
-// Sobel filter
-void sobel(unsigned char *img, unsigned char *out, int w, int h, int ch)
+static int encode_job(pipeline *p, const frame_job *job)
 {
-    unsigned char *g = to_grayscale(img, w, h, ch);
+    if(p->fs)
+        return write_frame(p->out_fp, &job->f, job->out) && fflush(p->out_fp) == 0;
+
+    char path[1024];
+    snprintf(path, sizeof(path), p->out_pattern, p->first + job->index);
+    return stbi_write_png(path, job->f.w, job->f.h, job->f.ch, job->out,
+                          job->f.w * job->f.ch);
+}
 
-    int gx[9] = {-1,0,1,-2,0,2,-1,0,1};
-    int gy[9] = {-1,-2,-1,0,0,0,1,2,1};
+static void decode_worker(pipeline *p)
+{
+    double busy = 0.0;
+    while(!atomic_load(&p->failed)) {
+        frame_job *job = queue_pop(&p->free_jobs);
+        double t0 = omp_get_wtime();
+        imgf_trace_begin("decode frame");
+        int rc = decode_job(p, job);
+        imgf_trace_end();
+        job->decoded = omp_get_wtime();
+        busy += job->decoded - t0;
+        if(rc <= 0) {
+            if(rc < 0) atomic_store(&p->failed, 1);
+            queue_push(&p->free_jobs, job);
+            break;
+        }
+        queue_push(&p->decoded, job);
+    }
 
-    #pragma omp parallel for collapse(2) default(none) shared(g,out,w,h,ch,gx,gy)
-    for(int y=0; y<h; y++) {
-        for(int x=0; x<w; x++) {
-            double sx=0, sy=0;
+    // The last decoder to stop tells the filter thread
+    if(atomic_fetch_sub(&p->decoders_left, 1) == 1)
+        queue_push(&p->decoded, &end_of_frames);
+    #pragma omp atomic
+    p->busy[0] += busy;
+}
 
-            for(int ky=-1; ky<=1; ky++) {
-                for(int kx=-1; kx<=1; kx++) {
-                    int xx = x + kx;
-                    int yy = y + ky;
+static void filter_worker(pipeline *p)
+{
+    // Size of the team the kernels open under this thread
+    omp_set_num_threads(p->filter_threads);
 
-                    if(xx<0) xx=0;
-                    if(xx>=w) xx=w-1;
-                    if(yy<0) yy=0;
-                    if(yy>=h) yy=h-1;
+    double busy = 0.0;
+    for(;;) {
+        frame_job *job = queue_pop(&p->decoded);
+        if(job == &end_of_frames) break;
 
-                    int val = g[yy*w + xx];
-                    int idx = (ky+1)*3 + (kx+1);
+        double t0 = omp_get_wtime();
+        if(!reserve_buffer(&job->out, &job->out_cap, frame_bytes(&job->f))) {
+            atomic_store(&p->failed, 1);
+            queue_push(&p->free_jobs, job);
+            continue;
+        }
 
-                    sx += val * gx[idx];
-                    sy += val * gy[idx];
-                }
+        int level = sched_choose(&p->ds, &job->f, p->ds.budget - (t0 - job->decoded));
+        p->ds.frames[level]++;
+        if(level == LEVEL_DROP) {
+            queue_push(&p->free_jobs, job);
+            continue;
+        }
+
+        imgf_counters_start(p->counters);
+        imgf_trace_begin("filter");
+        int filtered = sched_filter(&p->ds, level, &job->f, p->stages, p->nstages,
+                                    job->in, job->out);
+        imgf_trace_end();
+        imgf_counters_stop(p->counters);
+        if(!filtered) {
+            fprintf(stderr, "Out of memory filtering frame %d\n", job->index);
+            atomic_store(&p->failed, 1);
+            queue_push(&p->free_jobs, job);
+            continue;
+        }
+        job->filter_seconds = omp_get_wtime() - t0;
+        busy += job->filter_seconds;
+        queue_push(&p->filtered, job);
+    }
+
+    for(int e=0; e<p->encoders; e++) queue_push(&p->filtered, &end_of_frames);
+    p->busy[1] = busy;
+}
+
+static void encode_worker(pipeline *p)
+{
+    double busy = 0.0;
+    for(;;) {
+        frame_job *job = queue_pop(&p->filtered);
+        if(job == &end_of_frames) break;
+
+        // After a failure the remaining frames are only drained
+        if(!atomic_load(&p->failed)) {
+            double t0 = omp_get_wtime();
+            imgf_trace_begin("encode frame");
+            int ok = encode_job(p, job);
+            imgf_trace_end();
+            double t1 = omp_get_wtime();
+            busy += t1 - t0;
+            if(ok) {
+                sched_written(&p->ds, &job->f, t1 - t0, t1 - job->decoded);
+                log_frame(&p->log, &job->f, t1 - job->decoded, job->filter_seconds);
+            }
+            else {
+                fprintf(stderr, "Cannot write frame %d\n", job->index);
+                atomic_store(&p->failed, 1);
             }
+        }
+        queue_push(&p->free_jobs, job);
+    }
+    #pragma omp atomic
+    p->busy[2] += busy;
+}
+
+static int run_pipeline(const char *infile, const char *outfile, int stream,
+                        const imgf_stage *stages, int nstages, imgf_counters *counters,
+                        int decoders, int filter_threads, int encoders, double deadline)
+{
+    pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.stages = stages;
+    p.nstages = nstages;
+    p.counters = counters;
+    p.filter_threads = filter_threads;
+    if(!sched_init(&p.ds, deadline, stages, nstages)) {
+        fprintf(stderr, "Cannot allocate the filter kernels\n");
+        return 1;
+    }
+
+    frame_stream fs;
+    if(stream) {
+        if(!open_stream(&fs, infile)) return 1;
+        p.out_fp = open_output(&fs, outfile);
+        if(!p.out_fp) return 1;
+        p.fs = &fs;
+        if(decoders > 1 || encoders > 1)
+            fprintf(stderr, "A stream is read and written in order: using 1 decode and 1 encode thread\n");
+        decoders = encoders = 1;
+    }
+    else {
+        if(!sequence_pattern(infile) || !sequence_pattern(outfile)) {
+            fprintf(stderr, "Image sequences need one %%d in the input and output names\n");
+            return 1;
+        }
+        p.in_pattern = infile;
+        p.out_pattern = outfile;
+        p.nframes = count_sequence(infile, &p.first);
+        if(p.nframes == 0) {
+            fprintf(stderr, "No frames match %s\n", infile);
+            return 1;
+        }
+    }
+    p.decoders = decoders;
+    p.encoders = encoders;
+
+    // Every queue can hold all jobs plus the end markers, so pushes never wait
+    int njobs = decoders + encoders + 2;
+    frame_job *jobs = calloc(njobs, sizeof(frame_job));
+    if(!jobs || !queue_init(&p.free_jobs, njobs + encoders + 1) ||
+       !queue_init(&p.decoded, njobs + encoders + 1) ||
+       !queue_init(&p.filtered, njobs + encoders + 1)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for(int j=0; j<njobs; j++) queue_push(&p.free_jobs, &jobs[j]);
+    atomic_init(&p.next_frame, 0);
+    atomic_init(&p.decoders_left, decoders);
+    atomic_init(&p.failed, 0);
 
-            int mag = (int)sqrt(sx*sx + sy*sy);
-            if(mag > 255) mag = 255;
+    int team = decoders + 1 + encoders, short_team = 0;
+    omp_set_max_active_levels(2);
 
-            for(int c=0;c<ch;c++)
-                out[(y*w + x)*ch + c] = (unsigned char)mag;
+    double start = omp_get_wtime();
+    #pragma omp parallel num_threads(team)
+    {
+        int t = omp_get_thread_num();
+        if(omp_get_num_threads() < team) {
+            if(t == 0) short_team = 1;
         }
+        else if(t < decoders) decode_worker(&p);
+        else if(t == decoders) filter_worker(&p);
+        else encode_worker(&p);
+    }
+    double elapsed = omp_get_wtime() - start;
+
+    if(stream) {
+        if(p.out_fp != stdout) fclose(p.out_fp);
+        if(fs.fp != stdin) fclose(fs.fp);
     }
+    if(short_team)
+        fprintf(stderr, "Could not start %d pipeline threads (OMP_THREAD_LIMIT?)\n", team);
+
+    const char *kind = stream ? frame_kind(&p.log.last) : "PNG";
+    print_frame_log(&p.log, kind, elapsed, stages, nstages, counters);
+    sched_print(&p.ds);
+
+    // Busy time of all stages over the wall time: above 1 means overlap
+    double busy = p.busy[0] + p.busy[1] + p.busy[2];
+    fprintf(stderr, "Pipeline: decode %.3f s on %d thread(s), filter %.3f s on %d, "
+            "encode %.3f s on %d; %.2fx stage overlap\n",
+            p.busy[0], decoders, p.busy[1], filter_threads, p.busy[2], encoders,
+            elapsed > 0.0 ? busy / elapsed : 0.0);
 
-    free(g);
+    for(int j=0; j<njobs; j++) {
+        if(stream) imgf_buffer_free(jobs[j].in);
+        else stbi_image_free(jobs[j].in);
+        imgf_buffer_free(jobs[j].out);
+    }
+    free(jobs);
+    free(p.free_jobs.cells);
+    free(p.decoded.cells);
+    free(p.filtered.cells);
+    sched_free(&p.ds);
+    return (short_team || atomic_load(&p.failed)) ? 1 : 0;
 }
 
-// Gaussian filter
-double* build_gaussian(int ksize, double sigma) {
-double *k = malloc(ksize * ksize * sizeof(double));
-int half = ksize/2;
-double sum = 0.0;
-#pragma omp parallel for collapse(2) reduction(+:sum) shared(k,half,ksize,sigma)
-for(int y=-half; y<=half; y++){
-    for(int x=-half; x<=half; x++){
-        double v = exp(-(x*x + y*y)/(2*sigma*sigma));
-        k[(y+half)*ksize + (x+half)] = v;
-        sum += v;
+/*******************************************************************************
+ * INPUT IMAGES
+ *
+ * A raw image (.imgf, written by raw_convert) is mapped read-only instead of
+ * decoded, and the filter reads its padded rows straight from the page
+ * cache. Anything else goes through stb_image as RGB.
+ ******************************************************************************/
+typedef struct {
+    int w, h, ch;
+    const unsigned char *pixels;
+    size_t pitch;               // bytes from one row to the next
+    unsigned char *decoded;     // stb_image result, NULL when mapped
+    imgf_raw raw;
+} input_image;
+
+static int load_image(const char *path, input_image *in)
+{
+    memset(in, 0, sizeof(*in));
+    imgf_trace_begin("imgf_raw_map");
+    int mapped = imgf_raw_map(path, 0, -1, &in->raw);
+    imgf_trace_end();
+    if(mapped) {
+        in->w = in->raw.w;
+        in->h = in->raw.h;
+        in->ch = in->raw.ch;
+        in->pixels = imgf_raw_rows(&in->raw, &in->pitch);
+    }
+    else {
+        imgf_trace_begin("stbi_load");
+        in->decoded = stbi_load(path, &in->w, &in->h, &in->ch, 3);
+        imgf_trace_end();
+        in->ch = 3;
+        in->pixels = in->decoded;
+        in->pitch = (size_t)in->w * in->ch;
     }
+    return in->pixels != NULL;
 }
-#pragma omp parallel for shared(k,ksize,sum)
-for(int i=0; i<ksize*ksize; i++) {
-    k[i] /= sum;
+
+static void free_image(input_image *in)
+{
+    stbi_image_free(in->decoded);
+    imgf_raw_unmap(&in->raw);
 }
-return k;
+
+/*******************************************************************************
+ * BATCH MODE (--batch)
+ *
+ * The input is a directory (every raw image or file stb_image can read) or
+ * a manifest (one image path per line, # starts a comment); each image is
+ * written to the output directory as NAME.png. Small images are spread one
+ * per thread, largest first, each filtered serially. An image bigger than a
+ * thread's fair share of all pixels would keep one thread busy long after
+ * the others are done, so such images are filtered one at a time by the
+ * whole team before the rest.
+ ******************************************************************************/
+typedef struct {
+    char *path;
+    int w, h;
+} batch_image;
+
+typedef struct {
+    int done, failed;
+    double pixels, bytes;   // decoded or mapped
+} batch_totals;
+
+static int add_batch_image(batch_image **list, int *n, int *cap, const char *path)
+{
+    int w, h, ch;
+    if(!imgf_raw_info(path, &w, &h, &ch) && !stbi_info(path, &w, &h, &ch)) {
+        printf("Skipping %s (not an image)\n", path);
+        return 1;
+    }
+    if(*n == *cap) {
+        *cap = *cap ? 2 * *cap : 64;
+        batch_image *grown = realloc(*list, *cap * sizeof(batch_image));
+        if(!grown) return 0;
+        *list = grown;
+    }
+    (*list)[*n].path = strdup(path);
+    (*list)[*n].w = w;
+    (*list)[*n].h = h;
+    (*n)++;
+    return 1;
+}
+
+// Images of a directory or manifest; NULL (and *n = 0) if there are none
+static batch_image* list_batch(const char *input, int *n)
+{
+    batch_image *list = NULL;
+    int cap = 0;
+    char path[1024];
+    struct stat st;
+    *n = 0;
+
+    if(stat(input, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(input);
+        if(!dir) return NULL;
+        struct dirent *e;
+        while((e = readdir(dir)) != NULL) {
+            if(e->d_name[0] == '.') continue;
+            snprintf(path, sizeof(path), "%s/%s", input, e->d_name);
+            if(stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if(!add_batch_image(&list, n, &cap, path)) break;
+        }
+        closedir(dir);
+        return list;
+    }
+
+    FILE *fp = fopen(input, "r");
+    if(!fp) return NULL;
+    while(fgets(path, sizeof(path), fp)) {
+        size_t len = strcspn(path, "#\r\n");
+        while(len > 0 && (path[len-1] == ' ' || path[len-1] == '\t')) len--;
+        path[len] = '\0';
+        if(len == 0) continue;
+        if(!add_batch_image(&list, n, &cap, path)) break;
+    }
+    fclose(fp);
+    return list;
+}
+
+static int larger_image_first(const void *a, const void *b)
+{
+    double pa = (double)((const batch_image*)a)->w * ((const batch_image*)a)->h;
+    double pb = (double)((const batch_image*)b)->w * ((const batch_image*)b)->h;
+    return (pa < pb) - (pa > pb);
+}
+
+// Decode (or map), filter with 'be' and encode one image
+static void batch_one(const batch_image *im, const char *outdir,
+                      const imgf_stage *stages, int nstages, imgf_backend be,
+                      batch_totals *tot)
+{
+    input_image in;
+    int loaded = load_image(im->path, &in);
+    int w = in.w, h = in.h, ch = in.ch;
+
+    // Output buffers of finished images are reused through the pool
+    size_t bytes = loaded ? (size_t)w * h * ch : 0;
+    unsigned char *out = loaded ? imgf_buffer_alloc(bytes) : NULL;
+
+    int ok = 0;
+    if(out) {
+        imgf_trace_begin("filter");
+        int filtered = imgf_apply_chain_pitch(stages, nstages, in.pixels, in.pitch,
+                                              out, w, h, ch, be);
+        imgf_trace_end();
+
+        char path[1024];
+        imgf_output_path(path, sizeof(path), outdir, im->path);
+        imgf_trace_begin("stbi_write_png");
+        ok = filtered && stbi_write_png(path, w, h, ch, out, w * ch);
+        imgf_trace_end();
+    }
+    free_image(&in);
+    imgf_buffer_free(out);
+
+    #pragma omp critical(batch_totals)
+    {
+        if(ok) {
+            tot->done++;
+            tot->pixels += (double)w * h;
+            tot->bytes += (double)bytes;
+        }
+        else {
+            tot->failed++;
+            printf("Failed: %s\n", im->path);
+        }
+    }
+}
+
+static int run_batch(const char *input, const char *outdir,
+                     const imgf_stage *stages, int nstages, int threads)
+{
+    int n;
+    batch_image *list = list_batch(input, &n);
+    if(n == 0) {
+        printf("No images in %s\n", input);
+        free(list);
+        return 1;
+    }
+
+    // Images are written concurrently: two with the same output name
+    // would silently overwrite each other
+    const char **paths = malloc(n * sizeof(char*));
+    int earlier = 0, clash = -1;
+    if(paths) {
+        for(int i=0; i<n; i++) paths[i] = list[i].path;
+        clash = imgf_output_collision(outdir, paths, n, &earlier);
+    }
+    if(clash >= 0) {
+        char out[1024];
+        imgf_output_path(out, sizeof(out), outdir, list[clash].path);
+        printf("%s and %s would both be written to %s\n",
+               list[earlier].path, list[clash].path, out);
+    }
+    if(!paths || clash >= 0) {
+        free(paths);
+        for(int i=0; i<n; i++) free(list[i].path);
+        free(list);
+        return 1;
+    }
+    free(paths);
+    qsort(list, n, sizeof(batch_image), larger_image_first);
+
+    double total_pixels = 0.0;
+    for(int i=0; i<n; i++) total_pixels += (double)list[i].w * list[i].h;
+    int huge = 0;
+    while(huge < n && (double)list[huge].w * list[huge].h * threads > total_pixels) huge++;
+
+    batch_totals tot = {0};
+
+    double start = omp_get_wtime();
+    for(int i=0; i<huge; i++)
+        batch_one(&list[i], outdir, stages, nstages, IMGF_THREADS, &tot);
+    double split_time = omp_get_wtime() - start;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int i=huge; i<n; i++)
+        batch_one(&list[i], outdir, stages, nstages, IMGF_SERIAL, &tot);
+    double elapsed = omp_get_wtime() - start;
+
+    printf("Batch: %d image(s), %d failed, %.1f MPixels in %.3f s\n",
+           tot.done, tot.failed, tot.pixels / 1e6, elapsed);
+    printf("  %d split across all threads (%.3f s), %d one per thread (%.3f s)\n",
+           huge, split_time, n - huge, elapsed - split_time);
+    if(elapsed > 0.0)
+        printf("  %.2f images/s, %.2f MPixels/s, %.2f MB/s decoded pixels\n",
+               tot.done / elapsed, tot.pixels / elapsed / 1e6, tot.bytes / elapsed / 1e6);
+    imgf_pool_print(stdout, "Buffers");
+
+    for(int i=0; i<n; i++) free(list[i].path);
+    free(list);
+    return tot.failed ? 1 : 0;
+}
+
+// "--name" or "--name=value", but not "--namefoo"
+static int is_option(const char *arg, const char *name)
+{
+    size_t n = strlen(name);
+    return strncmp(arg, name, n)==0 && (arg[n] == '\0' || arg[n] == '=');
 }
 
 int main(int argc, char **argv)
 {
+    // --counters / --roofline / --prefault / --hugepages[=thp|hugetlb] /
+    // --stream / --batch / --pipeline[=D:F:E] / --deadline=MS / --trace=FILE
+    // may appear anywhere; drop them from the positional arguments
+    int use_counters = 0, use_roofline = 0, use_prefault = 0, use_stream = 0, use_batch = 0;
+    const char *trace_path = NULL, *pipeline_arg = NULL, *pages_arg = NULL;
+    double deadline = 0.0;
+    for(int i=1; i<argc; i++) {
+        int *flag = strcmp(argv[i], "--counters")==0 ? &use_counters :
+                    strcmp(argv[i], "--roofline")==0 ? &use_roofline :
+                    strcmp(argv[i], "--prefault")==0 ? &use_prefault :
+                    strcmp(argv[i], "--stream")==0 ? &use_stream :
+                    strcmp(argv[i], "--batch")==0 ? &use_batch : NULL;
+        if(flag || strncmp(argv[i], "--trace=", 8)==0 || is_option(argv[i], "--pipeline") ||
+           strncmp(argv[i], "--deadline=", 11)==0 || is_option(argv[i], "--hugepages")) {
+            if(flag) *flag = 1;
+            else if(argv[i][2] == 't') trace_path = argv[i] + 8;
+            else if(argv[i][2] == 'p') pipeline_arg = argv[i] + 10;
+            else if(argv[i][2] == 'h') pages_arg = argv[i] + 11;
+            else deadline = atof(argv[i] + 11) / 1000.0;
+            memmove(&argv[i], &argv[i+1], (argc-i) * sizeof(char*));
+            argc--;
+            i--;
+        }
+    }
+
     if(argc < 5) {
-        printf("Usage: %s input.png output.png [thread_count] [sobel|gaussian|laplacian|sharpen] [params]\n", argv[0]);
+        printf("Usage: %s input.png output.png [thread_count] [sobel|gaussian|laplacian|sharpen] [params] [--counters] [--roofline] [--prefault] [--hugepages[=thp|hugetlb]] [--trace=FILE]\n", argv[0]);
+        printf("       %s input.png output.png [thread_count] stage,stage,...   (e.g. gaussian:5:1.0,sobel) [--counters] [--roofline] [--prefault] [--hugepages[=thp|hugetlb]] [--trace=FILE]\n", argv[0]);
+        printf("       %s in.y4m|in.ppm|- out|- [thread_count] FILTER [params] --stream\n", argv[0]);
+        printf("         filters a Y4M or PPM/PGM frame stream (\"-\" = stdin/stdout)\n");
+        printf("       %s frame%%04d.png out%%04d.png [thread_count] FILTER [params]\n", argv[0]);
+        printf("         filters a numbered image sequence\n");
+        printf("       %s input_dir|manifest.txt output_dir [thread_count] FILTER [params] --batch\n", argv[0]);
+        printf("         filters many images, one per thread (manifest: one path per line)\n");
+        printf("       --pipeline[=D:F:E] decodes, filters and encodes frames concurrently with\n");
+        printf("         D decode, F filter and E encode threads (default 1:thread_count:1)\n");
+        printf("       --deadline=MS writes each frame within MS ms of reading it, degrading\n");
+        printf("         to smaller kernels, half resolution or a dropped frame when needed\n");
         return 1;
     }
 
@@ -142,49 +1364,118 @@ int main(int argc, char **argv)
     int thread_count = strtol(argv[3], NULL, 10); omp_set_num_threads(thread_count);
     char *mode = argv[4];
 
-    int w, h, ch;
+    int decoders = 1, filter_threads = thread_count, encoders = 1;
+    if(pipeline_arg && pipeline_arg[0] != '\0' &&
+       (sscanf(pipeline_arg, "=%d:%d:%d", &decoders, &filter_threads, &encoders) != 3 ||
+        decoders < 1 || filter_threads < 1 || encoders < 1)) {
+        printf("Usage: --pipeline=D:F:E (decode, filter and encode threads, each >= 1)\n");
+        return 1;
+    }
 
-    unsigned char *img = stbi_load(infile, &w, &h, &ch, 3);
-    if(!img) {
-        printf("Error loading image.\n");
+    if(strcmp(mode,"gaussian")==0 && argc < 7) {
+        printf("Usage: gaussian ksize sigma\n");
         return 1;
     }
 
-    ch = 3;
-    unsigned char *out = malloc(w * h * ch);
+    imgf_stage stages[IMGF_MAX_STAGES];
+    int nstages = imgf_parse_filter(mode, argc > 5 ? argv[5] : NULL,
+                                    argc > 6 ? argv[6] : NULL,
+                                    stages, IMGF_MAX_STAGES);
+    if(nstages == 0) {
+        printf("Unknown mode.\n");
+        return 1;
+    }
 
-    /* ----------- START TIMER ----------- */
-    double start = omp_get_wtime();
+    // Opened before any OpenMP region so the worker threads are counted too
+    imgf_counters counters = {0};
+    if(use_counters && !imgf_counters_open(&counters))
+        fprintf(use_stream || sequence_pattern(infile) ? stderr : stdout, "Hardware counters not available on this system.\n");
 
-    if(strcmp(mode,"sobel")==0) {
-        sobel(img, out, w, h, ch);
+    // Image, frame and scratch buffers come from the libimgfilter pool and
+    // are reused across images and frames (--prefault touches their pages
+    // when they are first allocated, --hugepages puts the large ones on
+    // 2 MiB pages)
+    imgf_page_mode pages = IMGF_PAGES_DEFAULT;
+    if(pages_arg && !imgf_page_mode_from_name(*pages_arg == '=' ? pages_arg + 1 : "thp", &pages)) {
+        printf("Unknown page mode %s (thp or hugetlb)\n", pages_arg + 1);
+        return 1;
     }
-    else if(strcmp(mode,"gaussian")==0) {
-        if(argc < 7) {
-            printf("Usage: gaussian ksize sigma\n");
+    imgf_pool_prefault(use_prefault);
+    imgf_pool_pages(pages);
+
+    // Timeline of load, filter bands and write (--trace)
+    if(trace_path) imgf_trace_start(0, "image_filter_parallel");
+
+    if(deadline > 0.0 && !use_stream && !sequence_pattern(infile))
+        printf("--deadline only applies to --stream and image sequences\n");
+
+    if(use_batch) {
+        if(!imgf_chain_build(stages, nstages)) {
+            printf("Cannot allocate the filter kernels\n");
             return 1;
         }
-        int ksize = atoi(argv[5]);
-        double sigma = atof(argv[6]);
+        imgf_counters_start(&counters);
+        int rc = run_batch(infile, outfile, stages, nstages, thread_count);
+        imgf_counters_stop(&counters);
+        for(int s=0; s<nstages; s++) imgf_stage_free(&stages[s]);
+        if(counters.enabled)
+            imgf_counters_print(stdout, "Counters (decode, filter and encode)", &counters, 0.0);
+        imgf_counters_close(&counters);
+        if(trace_path && !imgf_trace_write(trace_path))
+            printf("Could not write trace %s\n", trace_path);
+        return rc;
+    }
 
-        double *g = build_gaussian(ksize, sigma);
-        convolve_rgb(img, out, w, h, ch, g, ksize);
-        free(g);
+    // Frame streams and image sequences; sequences always use the pipeline
+    if(use_stream || sequence_pattern(infile)) {
+        if(!imgf_chain_build(stages, nstages)) {
+            fprintf(stderr, "Cannot allocate the filter kernels\n");
+            return 1;
+        }
+        int rc = use_stream && !pipeline_arg
+               ? run_stream(infile, outfile, stages, nstages, &counters, deadline)
+               : run_pipeline(infile, outfile, use_stream, stages, nstages, &counters,
+                              decoders, filter_threads, encoders, deadline);
+        for(int s=0; s<nstages; s++) imgf_stage_free(&stages[s]);
+        imgf_counters_close(&counters);
+        if(trace_path && !imgf_trace_write(trace_path))
+            fprintf(stderr, "Could not write trace %s\n", trace_path);
+        return rc;
     }
-    else if(strcmp(mode,"laplacian")==0) {
-        double lap[9] = {0,1,0,
-                         1,-4,1,
-                         0,1,0};
-        convolve_rgb(img, out, w, h, ch, lap, 3);
+
+    input_image in;
+    if(!load_image(infile, &in)) {
+        printf("Error loading image.\n");
+        free_image(&in);
+        return 1;
     }
-    else if(strcmp(mode,"sharpen")==0) {
-        double sh[9] = {0,-1,0,
-                        -1,5,-1,
-                        0,-1,0};
-        convolve_rgb(img, out, w, h, ch, sh, 3);
+    int w = in.w, h = in.h, ch = in.ch;
+    if(!in.decoded) printf("Mapped %s: %d x %d, %d channels, no decode\n", infile, w, h, ch);
+
+    unsigned char *out = imgf_buffer_alloc((size_t)w * h * ch);
+
+    /* ----------- START TIMER ----------- */
+    double start = omp_get_wtime();
+
+    if(!imgf_chain_build(stages, nstages)) {
+        printf("Cannot allocate the filter kernels\n");
+        free_image(&in);
+        imgf_buffer_free(out);
+        return 1;
     }
-    else {
-        printf("Unknown mode.\n");
+    imgf_counters_start(&counters);
+    double filter_start = omp_get_wtime();
+    imgf_trace_begin("filter");
+    int filtered = imgf_apply_chain_pitch(stages, nstages, in.pixels, in.pitch,
+                                          out, w, h, ch, IMGF_THREADS);
+    imgf_trace_end();
+    double filter_time = omp_get_wtime() - filter_start;
+    imgf_counters_stop(&counters);
+    for(int s=0; s<nstages; s++) imgf_stage_free(&stages[s]);
+    if(!filtered) {
+        printf("Out of memory while filtering\n");
+        free_image(&in);
+        imgf_buffer_free(out);
         return 1;
     }
 
@@ -193,10 +1484,33 @@ int main(int argc, char **argv)
 
     printf("Execution time: %.6f seconds\n", end - start);
 
+    if(counters.enabled) {
+        imgf_counters_print(stdout, "Counters", &counters, (double)w * h * nstages);
+        imgf_counters_close(&counters);
+    }
+
+    // Filter throughput, and against the machine peaks (--roofline)
+    imgf_throughput_print(stdout, "Throughput", stages, nstages,
+                          (double)w * h, ch, filter_time);
+    if(use_roofline) {
+        imgf_machine_peaks peaks;
+        imgf_measure_peaks(&peaks, IMGF_THREADS);
+        imgf_roofline_print(stdout, "Roofline", stages, nstages,
+                            (double)w * h, ch, filter_time, &peaks);
+    }
+    imgf_pool_print(stdout, "Buffers");
+
+    imgf_trace_begin("stbi_write_png");
     stbi_write_png(outfile, w, h, ch, out, w * ch);
+    imgf_trace_end();
+
+    if(trace_path) {
+        if(imgf_trace_write(trace_path)) printf("Trace written to %s\n", trace_path);
+        else printf("Could not write trace %s\n", trace_path);
+    }
 
-    free(img);
-    free(out);
+    free_image(&in);
+    imgf_buffer_free(out);
 
     return 0;
 }
@@ -0,0 +1,94 @@
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include "imgfilter.h"
+
+#define STBI_MALLOC(sz) imgf_buffer_alloc(sz)
+#define STBI_REALLOC(p, newsz) imgf_buffer_realloc(p, newsz)
+#define STBI_FREE(p) imgf_buffer_free(p)
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*******************************************************************************
+ * RAW IMAGE CONVERTER
+ *
+ * PNG (or anything stb_image reads) to the mapped raw format (.imgf) that
+ * the filter programs load without decoding, and back to PNG. Images are
+ * stored as RGB, the way the filter programs load them.
+ ******************************************************************************/
+static int has_suffix(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    // --tile=N may appear anywhere; drop it from the positional arguments
+    int tile = 0;
+    for(int i=1; i<argc; i++) {
+        if(strncmp(argv[i], "--tile=", 7)==0) {
+            tile = atoi(argv[i] + 7);
+            memmove(&argv[i], &argv[i+1], (argc-i) * sizeof(char*));
+            argc--;
+            i--;
+        }
+    }
+
+    if(argc != 3 || tile < 0) {
+        printf("Usage: %s input.png output.imgf [--tile=N]\n", argv[0]);
+        printf("         stores the pixels uncompressed, rows padded to %d bytes\n", IMGF_RAW_ALIGN);
+        printf("         (--tile=N: in NxN tiles) for mapping instead of decoding\n");
+        printf("       %s input.imgf output.png\n", argv[0]);
+        return 1;
+    }
+
+    char *infile = argv[1];
+    char *outfile = argv[2];
+    int w, h, ch;
+    double start = omp_get_wtime();
+
+    if(imgf_raw_info(infile, &w, &h, &ch)) {
+        if(has_suffix(outfile, ".imgf")) {
+            printf("%s already is a raw image\n", infile);
+            return 1;
+        }
+        imgf_raw raw;
+        if(!imgf_raw_map(infile, 0, -1, &raw)) {
+            printf("Error mapping image: %s\n", infile);
+            return 1;
+        }
+        size_t pitch;
+        const unsigned char *rows = imgf_raw_rows(&raw, &pitch);
+        int ok = rows && stbi_write_png(outfile, w, h, ch, rows, (int)pitch);
+        imgf_raw_unmap(&raw);
+        if(!ok) {
+            printf("Error writing %s\n", outfile);
+            return 1;
+        }
+    }
+    else {
+        unsigned char *img = stbi_load(infile, &w, &h, &ch, 3);
+        if(!img) {
+            printf("Error loading image: %s\n", infile);
+            return 1;
+        }
+        ch = 3;
+        int ok = imgf_raw_write(outfile, img, w, h, ch, tile);
+        stbi_image_free(img);
+        if(!ok) {
+            printf("Error writing %s\n", outfile);
+            return 1;
+        }
+    }
+
+    printf("%s -> %s: %d x %d, %d channels", infile, outfile, w, h, ch);
+    if(tile) printf(", %dx%d tiles", tile, tile);
+    printf(" (%.3f s)\n", omp_get_wtime() - start);
+    return 0;
+}